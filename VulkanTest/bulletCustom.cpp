@@ -17,6 +17,15 @@ btCustomMotionState::~btCustomMotionState() {
 
 };
 
+void* btCustomMotionState::operator new(size_t size) {
+	physicsMemory::Scope scope(physicsMemory::CATEGORY_BODIES);
+	return btAlignedAlloc(size, 16);
+}
+
+void btCustomMotionState::operator delete(void* ptr) {
+	btAlignedFree(ptr);
+}
+
 void btCustomMotionState::getWorldTransform(btTransform& centerOfMassWorldTrans) const
 {
 	centerOfMassWorldTrans = m_graphicsWorldTrans * m_centerOfMassOffset.inverse();
@@ -33,4 +42,33 @@ void btCustomMotionState::getGraphicsTransform(glm::mat4* matrix) {
 	btTransform COMadjustedTransform = m_graphicsWorldTrans * m_centerOfMassOffset.inverse();
 	COMadjustedTransform.getOpenGLMatrix(reinterpret_cast<btScalar*>(&physicsTransform));
 	*matrix *= physicsTransform;
+}
+
+btAccountedDispatcher::btAccountedDispatcher(btCollisionConfiguration* config) : btCollisionDispatcher(config) {
+
+}
+
+void btAccountedDispatcher::dispatchAllCollisionPairs(btOverlappingPairCache* pairCache, const btDispatcherInfo& dispatchInfo, btDispatcher* dispatcher) {
+	physicsMemory::Scope scope(physicsMemory::CATEGORY_MANIFOLDS);
+	btCollisionDispatcher::dispatchAllCollisionPairs(pairCache, dispatchInfo, dispatcher);
+}
+
+btPersistentManifold* btAccountedDispatcher::getNewManifold(const btCollisionObject* b0, const btCollisionObject* b1) {
+	physicsMemory::Scope scope(physicsMemory::CATEGORY_MANIFOLDS);
+	return btCollisionDispatcher::getNewManifold(b0, b1);
+}
+
+btBroadphaseProxy* btAccountedBroadphase::createProxy(const btVector3& aabbMin, const btVector3& aabbMax, int shapeType, void* userPtr, int collisionFilterGroup, int collisionFilterMask, btDispatcher* dispatcher) {
+	physicsMemory::Scope scope(physicsMemory::CATEGORY_BROADPHASE);
+	return btDbvtBroadphase::createProxy(aabbMin, aabbMax, shapeType, userPtr, collisionFilterGroup, collisionFilterMask, dispatcher);
+}
+
+void btAccountedBroadphase::setAabb(btBroadphaseProxy* proxy, const btVector3& aabbMin, const btVector3& aabbMax, btDispatcher* dispatcher) {
+	physicsMemory::Scope scope(physicsMemory::CATEGORY_BROADPHASE);
+	btDbvtBroadphase::setAabb(proxy, aabbMin, aabbMax, dispatcher);
+}
+
+void btAccountedBroadphase::calculateOverlappingPairs(btDispatcher* dispatcher) {
+	physicsMemory::Scope scope(physicsMemory::CATEGORY_BROADPHASE);
+	btDbvtBroadphase::calculateOverlappingPairs(dispatcher);
 }
\ No newline at end of file
@@ -5,6 +5,7 @@
 #include "btBulletCollisionCommon.h"
 #include <iostream>
 #include <stdexcept>
+#include "physicsMemory.h"
 
 class btBoxCollider2 : public btBoxShape {
 public:
@@ -14,6 +15,10 @@ public:
 
 class btCustomMotionState : public btMotionState {
 public:
+	/* Routed through btAlignedAlloc so motion states show up with the bodies in physicsMemory */
+	void* operator new(size_t size);
+	void operator delete(void* ptr);
+
 	glm::mat4 scale;
 	btTransform m_graphicsWorldTrans;
 	btTransform m_centerOfMassOffset;
@@ -25,4 +30,20 @@ public:
 	void getWorldTransform(btTransform& centerOfMassWorldTrans) const;
 	void setWorldTransform(const btTransform& centerOfMassWorldTrans);
 	void getGraphicsTransform(glm::mat4* matrix);
+};
+
+/* Tag the allocations made while finding overlaps and contacts for physicsMemory */
+class btAccountedDispatcher : public btCollisionDispatcher {
+public:
+	btAccountedDispatcher(btCollisionConfiguration* config);
+
+	void dispatchAllCollisionPairs(btOverlappingPairCache* pairCache, const btDispatcherInfo& dispatchInfo, btDispatcher* dispatcher);
+	btPersistentManifold* getNewManifold(const btCollisionObject* b0, const btCollisionObject* b1);
+};
+
+class btAccountedBroadphase : public btDbvtBroadphase {
+public:
+	btBroadphaseProxy* createProxy(const btVector3& aabbMin, const btVector3& aabbMax, int shapeType, void* userPtr, int collisionFilterGroup, int collisionFilterMask, btDispatcher* dispatcher);
+	void setAabb(btBroadphaseProxy* proxy, const btVector3& aabbMin, const btVector3& aabbMax, btDispatcher* dispatcher);
+	void calculateOverlappingPairs(btDispatcher* dispatcher);
 };
\ No newline at end of file
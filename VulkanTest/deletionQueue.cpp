@@ -0,0 +1,158 @@
+#include "deletionQueue.h"
+
+#include <cassert>
+#include <stdexcept>
+
+using namespace render;
+
+/* Non-dispatchable handles are pointers on 64 bit and uint64_t on 32 bit, both fit */
+template <typename T>
+inline uint64_t toHandle(T handle) {
+    return (uint64_t)handle;
+}
+
+template <typename T>
+inline T fromHandle(uint64_t handle) {
+    return (T)handle;
+}
+
+DeletionQueue::DeletionQueue(VkDevice device, GpuAllocator* allocator) {
+    this->device = device;
+    this->allocator = allocator;
+}
+
+DeletionQueue::~DeletionQueue() {
+    /* Destroying the leftovers here could reach an allocator or pool that is already gone */
+    assert(entries.empty() && "deletion queue destroyed before flushAll");
+}
+
+void DeletionQueue::push(Kind kind, uint64_t handle, uint64_t owner, const Allocation& allocation) {
+    if (handle == 0) return;
+
+    std::lock_guard<std::mutex> guard(lock);
+    entries.push_back({ frame, kind, handle, owner, allocation });
+}
+
+void DeletionQueue::buffer(VkBuffer buffer, const Allocation& allocation) {
+    push(Kind::Buffer, toHandle(buffer), 0, allocation);
+}
+
+void DeletionQueue::image(VkImage image, const Allocation& allocation) {
+    push(Kind::Image, toHandle(image), 0, allocation);
+}
+
+void DeletionQueue::image(VkImage image, VkDeviceMemory memory) {
+    push(Kind::OwnedImage, toHandle(image), toHandle(memory), Allocation());
+}
+
+void DeletionQueue::imageView(VkImageView view) {
+    push(Kind::ImageView, toHandle(view), 0, Allocation());
+}
+
+void DeletionQueue::sampler(VkSampler sampler) {
+    push(Kind::Sampler, toHandle(sampler), 0, Allocation());
+}
+
+void DeletionQueue::framebuffer(VkFramebuffer framebuffer) {
+    push(Kind::Framebuffer, toHandle(framebuffer), 0, Allocation());
+}
+
+void DeletionQueue::pipeline(VkPipeline pipeline) {
+    push(Kind::Pipeline, toHandle(pipeline), 0, Allocation());
+}
+
+void DeletionQueue::pipelineLayout(VkPipelineLayout layout) {
+    push(Kind::PipelineLayout, toHandle(layout), 0, Allocation());
+}
+
+void DeletionQueue::descriptorSet(VkDescriptorPool pool, VkDescriptorSet set) {
+    push(Kind::DescriptorSet, toHandle(set), toHandle(pool), Allocation());
+}
+
+void DeletionQueue::poolRange(MeshPool* pool, const PoolRange& range) {
+    if (range.count == 0) return;
+
+    std::lock_guard<std::mutex> guard(lock);
+    Entry entry{ frame, Kind::PoolRange, toHandle(pool), 0, Allocation() };
+    entry.range = range;
+    entries.push_back(entry);
+}
+
+void DeletionQueue::slot(SlotAllocator* slots, uint32_t slot) {
+    if (slot == SlotAllocator::noSlot) return;
+    push(Kind::Slot, toHandle(slots), slot, Allocation());
+}
+
+uint64_t DeletionQueue::nextFrame() {
+    std::lock_guard<std::mutex> guard(lock);
+    return ++frame;
+}
+
+void DeletionQueue::retire(uint64_t completedFrame) {
+    /* Destroying happens outside the lock, freeing allocations takes the allocator's */
+    std::deque<Entry> done;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        while (!entries.empty() && entries.front().frame <= completedFrame) {
+            done.push_back(entries.front());
+            entries.pop_front();
+        }
+    }
+
+    for (size_t i = 0; i < done.size(); i++)
+    {
+        destroy(done[i]);
+    }
+}
+
+void DeletionQueue::flushAll() {
+    retire(UINT64_MAX);
+}
+
+size_t DeletionQueue::pending() {
+    std::lock_guard<std::mutex> guard(lock);
+    return entries.size();
+}
+
+void DeletionQueue::destroy(Entry& entry) {
+    switch (entry.kind) {
+    case Kind::Buffer:
+        allocator->destroyBuffer(fromHandle<VkBuffer>(entry.handle), entry.allocation);
+        break;
+    case Kind::Image:
+        allocator->destroyImage(fromHandle<VkImage>(entry.handle), entry.allocation);
+        break;
+    case Kind::OwnedImage:
+        vkDestroyImage(device, fromHandle<VkImage>(entry.handle), nullptr);
+        vkFreeMemory(device, fromHandle<VkDeviceMemory>(entry.owner), nullptr);
+        break;
+    case Kind::ImageView:
+        vkDestroyImageView(device, fromHandle<VkImageView>(entry.handle), nullptr);
+        break;
+    case Kind::Sampler:
+        vkDestroySampler(device, fromHandle<VkSampler>(entry.handle), nullptr);
+        break;
+    case Kind::Framebuffer:
+        vkDestroyFramebuffer(device, fromHandle<VkFramebuffer>(entry.handle), nullptr);
+        break;
+    case Kind::Pipeline:
+        vkDestroyPipeline(device, fromHandle<VkPipeline>(entry.handle), nullptr);
+        break;
+    case Kind::PipelineLayout:
+        vkDestroyPipelineLayout(device, fromHandle<VkPipelineLayout>(entry.handle), nullptr);
+        break;
+    case Kind::DescriptorSet: {
+        VkDescriptorSet set = fromHandle<VkDescriptorSet>(entry.handle);
+        if (vkFreeDescriptorSets(device, fromHandle<VkDescriptorPool>(entry.owner), 1, &set) != VK_SUCCESS) {
+            throw std::runtime_error("Failed to free descriptor set");
+        }
+        break;
+    }
+    case Kind::PoolRange:
+        fromHandle<MeshPool*>(entry.handle)->free(entry.range);
+        break;
+    case Kind::Slot:
+        fromHandle<SlotAllocator*>(entry.handle)->free(static_cast<uint32_t>(entry.owner));
+        break;
+    }
+}
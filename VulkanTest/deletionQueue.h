@@ -0,0 +1,86 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+
+#include <cstdint>
+#include <deque>
+#include <mutex>
+
+#include "gpuMemory.h"
+#include "meshPool.h"
+#include "slotAllocator.h"
+
+namespace render
+{
+    /*
+     * Vulkan objects handed to the queue are tagged with the number of the newest frame that could still be using them
+     * and only destroyed once that frame's fence has signaled, so freeing never waits on the GPU.
+     * Frames complete in submission order, so retire only has to look at the front.
+     *
+     * Can be fed from any thread. Descriptor sets need a pool created with FREE_DESCRIPTOR_SET_BIT.
+     */
+    class DeletionQueue {
+    public:
+        DeletionQueue(VkDevice device, GpuAllocator* allocator);
+        /* Everything has to be flushed by then */
+        ~DeletionQueue();
+
+        void buffer(VkBuffer buffer, const Allocation& allocation);
+        void image(VkImage image, const Allocation& allocation);
+        /* For images that own their memory, like the ones ktx uploads */
+        void image(VkImage image, VkDeviceMemory memory);
+        void imageView(VkImageView view);
+        void sampler(VkSampler sampler);
+        void framebuffer(VkFramebuffer framebuffer);
+        void pipeline(VkPipeline pipeline);
+        void pipelineLayout(VkPipelineLayout layout);
+        void descriptorSet(VkDescriptorPool pool, VkDescriptorSet set);
+        void poolRange(MeshPool* pool, const PoolRange& range);
+        void slot(SlotAllocator* slots, uint32_t slot);
+
+        /* Called once per frame after its fence was reset, returns the number the frame's objects get tagged with */
+        uint64_t nextFrame();
+        /* Destroys everything tagged with completedFrame or earlier */
+        void retire(uint64_t completedFrame);
+        /* Destroys everything, the device has to be idle */
+        void flushAll();
+
+        size_t pending();
+
+    private:
+        enum class Kind {
+            Buffer,
+            Image,
+            OwnedImage,
+            ImageView,
+            Sampler,
+            Framebuffer,
+            Pipeline,
+            PipelineLayout,
+            DescriptorSet,
+            PoolRange,
+            Slot
+        };
+
+        struct Entry {
+            uint64_t frame;
+            Kind kind;
+            uint64_t handle;
+            /* The descriptor pool, the memory of an OwnedImage, or the index of a Slot */
+            uint64_t owner;
+            Allocation allocation;
+            /* For PoolRange, handle is then the MeshPool */
+            PoolRange range;
+        };
+
+        VkDevice device;
+        GpuAllocator* allocator;
+
+        std::mutex lock;
+        uint64_t frame = 0;
+        std::deque<Entry> entries;
+
+        void push(Kind kind, uint64_t handle, uint64_t owner, const Allocation& allocation);
+        void destroy(Entry& entry);
+    };
+};
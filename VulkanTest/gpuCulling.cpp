@@ -0,0 +1,534 @@
+#include "gpuCulling.h"
+#include "util.h"
+
+#include <glm/gtc/matrix_transform.hpp>
+
+#include <algorithm>
+#include <cstring>
+#include <random>
+#include <stdexcept>
+
+using namespace render;
+
+GpuCuller::GpuCuller(Drawer* d, PFN_vkCmdDrawIndexedIndirectCountKHR drawIndirectCount) {
+    this->d = d;
+    this->drawIndirectCount = drawIndirectCount;
+    std::cout << "GPU culling with " << (drawIndirectCount != nullptr ? "VK_KHR_draw_indirect_count" : "uncompacted indirect draws") << "\n";
+
+    /* Instances, batches, commands, counts */
+    VkDescriptorSetLayoutBinding bindings[4]{};
+    for (uint32_t i = 0; i < 4; i++)
+    {
+        bindings[i].binding = i;
+        bindings[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        bindings[i].descriptorCount = 1;
+        bindings[i].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+    }
+
+    VkDescriptorSetLayoutCreateInfo setInfo{};
+    setInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    setInfo.bindingCount = 4;
+    setInfo.pBindings = bindings;
+
+    if (vkCreateDescriptorSetLayout(d->device, &setInfo, nullptr, &setLayout) != VK_SUCCESS) {
+        throw std::runtime_error("Error creating descriptor set layout");
+    }
+
+    VkPushConstantRange pushConstantRange{};
+    pushConstantRange.offset = 0;
+    pushConstantRange.size = sizeof(CullConstants);
+    pushConstantRange.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+
+    VkPipelineLayoutCreateInfo layoutInfo{};
+    layoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    layoutInfo.setLayoutCount = 1;
+    layoutInfo.pSetLayouts = &setLayout;
+    layoutInfo.pushConstantRangeCount = 1;
+    layoutInfo.pPushConstantRanges = &pushConstantRange;
+
+    if (vkCreatePipelineLayout(d->device, &layoutInfo, nullptr, &layout) != VK_SUCCESS) {
+        throw std::runtime_error("Error creating pipeline layout");
+    }
+
+    std::vector<char> code = getBytes("shaders/cull.spv");
+    VkShaderModuleCreateInfo moduleInfo{};
+    moduleInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+    moduleInfo.codeSize = code.size();
+    moduleInfo.pCode = reinterpret_cast<const uint32_t*>(code.data());
+
+    VkShaderModule module;
+    if (vkCreateShaderModule(d->device, &moduleInfo, nullptr, &module) != VK_SUCCESS) {
+        throw std::runtime_error("Error creating shader module");
+    }
+
+    VkComputePipelineCreateInfo pipelineInfo{};
+    pipelineInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+    pipelineInfo.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    pipelineInfo.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+    pipelineInfo.stage.module = module;
+    pipelineInfo.stage.pName = "main";
+    pipelineInfo.layout = layout;
+
+    if (vkCreateComputePipelines(d->device, d->pipelines->cache(), 1, &pipelineInfo, nullptr, &pipeline) != VK_SUCCESS) {
+        throw std::runtime_error("Error creating compute pipeline");
+    }
+    vkDestroyShaderModule(d->device, module, nullptr);
+
+    frames.resize(d->FRAMES_IN_FLIGHT);
+    for (size_t i = 0; i < frames.size(); i++)
+    {
+        VkDescriptorSetAllocateInfo allocInfo{};
+        allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+        allocInfo.descriptorPool = d->descPool;
+        allocInfo.descriptorSetCount = 1;
+        allocInfo.pSetLayouts = &setLayout;
+
+        if (vkAllocateDescriptorSets(d->device, &allocInfo, &frames[i].set) != VK_SUCCESS) {
+            throw std::runtime_error("Error allocating descriptor sets");
+        }
+    }
+}
+
+GpuCuller::~GpuCuller() {
+    for (size_t i = 0; i < frames.size(); i++)
+    {
+        FrameBuffers& f = frames[i];
+        if (f.upload != VK_NULL_HANDLE) d->memory->destroyBuffer(f.upload, f.uploadAllocation);
+        if (f.commands != VK_NULL_HANDLE) d->memory->destroyBuffer(f.commands, f.commandAllocation);
+        if (f.counts != VK_NULL_HANDLE) d->memory->destroyBuffer(f.counts, f.countAllocation);
+    }
+    if (batchBuffer != VK_NULL_HANDLE) d->memory->destroyBuffer(batchBuffer, batchAllocation);
+    /* Back to the pool, testGpuCulling replaces the culler */
+    for (size_t i = 0; i < frames.size(); i++)
+    {
+        vkFreeDescriptorSets(d->device, d->descPool, 1, &frames[i].set);
+    }
+    vkDestroyPipeline(d->device, pipeline, nullptr);
+    vkDestroyPipelineLayout(d->device, layout, nullptr);
+    vkDestroyDescriptorSetLayout(d->device, setLayout, nullptr);
+}
+
+bool GpuCuller::countsDraws() const {
+    return drawIndirectCount != nullptr;
+}
+
+uint32_t GpuCuller::uploadedBatches() const {
+    return uploaded;
+}
+
+uint32_t GpuCuller::runCount() const {
+    return static_cast<uint32_t>(frames[d->currentFrame].runs.size());
+}
+
+/* Everything bindBatch binds is the same, only firstIndex and vertexOffset differ */
+inline bool sameRun(const DrawBatch& a, const DrawBatch& b) {
+    return a.material->sharesBindings(b.material) && a.mesh->vertexBuffer == b.mesh->vertexBuffer && a.submesh->indexBuffer == b.submesh->indexBuffer;
+}
+
+void GpuCuller::reserve(VkBuffer& buffer, Allocation& allocation, uint32_t& capacity, uint32_t count, VkDeviceSize stride, VkBufferUsageFlags usage, VkMemoryPropertyFlags required) {
+    if (count <= capacity) return;
+    /* The frame that last used it is done, but draws recorded earlier this frame may still point at it */
+    if (buffer != VK_NULL_HANDLE) d->deletions->buffer(buffer, allocation);
+
+    capacity = std::max({ capacity * 2, count, 256u });
+    d->memory->createBuffer(stride * capacity, usage, required, buffer, allocation, 0, MemoryCategory::Other);
+}
+
+void GpuCuller::cull(const std::vector<DrawBatch>& batches, const std::vector<const Frustum*>& frusta, std::vector<uint32_t>& passes) {
+    FrameBuffers& f = frames[d->currentFrame];
+    f.passes.clear();
+    f.runs.clear();
+    passes.clear();
+    for (uint32_t p = 0; p < frusta.size(); p++)
+    {
+        passes.push_back(p);
+    }
+    f.objectCount = 0;
+    uploaded = 0;
+    if (batches.empty()) {
+        f.passes.resize(frusta.size(), { 0, 0 });
+        return;
+    }
+
+    /* batchDraws reserves every instance of a call at once, so the batches cover one stretch of one buffer */
+    VkBuffer instanceBuffer = batches[0].instanceBuffer;
+    f.instanceBase = batches[0].firstInstance;
+    std::vector<CullBatch> described(batches.size());
+    for (size_t b = 0; b < batches.size(); b++)
+    {
+        const DrawBatch& batch = batches[b];
+        if (batch.instanceBuffer != instanceBuffer || batch.firstInstance != f.instanceBase + f.objectCount) {
+            throw std::runtime_error("Culled batches have to come from a single batchDraws call");
+        }
+
+        if (b > 0 && sameRun(f.runs.back().first, batch)) f.runs.back().instanceCount += batch.instanceCount;
+        else f.runs.push_back({ batch, batch.firstInstance, batch.instanceCount });
+
+        CullBatch& c = described[b];
+        c.boundsMin = glm::vec4(batch.mesh->boundsMin, 0.0f);
+        c.boundsMax = glm::vec4(batch.mesh->boundsMax, 0.0f);
+        c.info = glm::uvec4(f.objectCount, static_cast<uint32_t>(f.runs.size() - 1), f.runs.back().firstInstance - f.instanceBase, 0);
+        c.draw = glm::uvec4(static_cast<uint32_t>(batch.submesh->iBufferSize), batch.submesh->firstIndex, batch.mesh->vertexOffset, 0);
+        f.objectCount += batch.instanceCount;
+    }
+    uint32_t objectCount = f.objectCount;
+    uint32_t batchCount = static_cast<uint32_t>(batches.size());
+    uint32_t runCount = static_cast<uint32_t>(f.runs.size());
+    uint32_t passCount = static_cast<uint32_t>(frusta.size());
+
+    uint32_t previousCapacity = batchCapacity;
+    reserve(batchBuffer, batchAllocation, batchCapacity, batchCount, sizeof(CullBatch),
+        VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+    /* A new buffer starts empty */
+    if (batchCapacity != previousCapacity) resident.clear();
+    reserve(f.commands, f.commandAllocation, f.commandCapacity, objectCount * passCount, sizeof(VkDrawIndexedIndirectCommand),
+        VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+    reserve(f.counts, f.countAllocation, f.countCapacity, runCount * passCount, sizeof(uint32_t),
+        VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+
+    /* Only batches that differ from what the GPU holds are copied, consecutive ones in one region */
+    std::vector<VkBufferCopy> regions;
+    for (uint32_t b = 0; b < batchCount; b++)
+    {
+        if (b < resident.size() && memcmp(&described[b], &resident[b], sizeof(CullBatch)) == 0) continue;
+
+        VkDeviceSize dst = b * sizeof(CullBatch);
+        if (!regions.empty() && regions.back().dstOffset + regions.back().size == dst) {
+            regions.back().size += sizeof(CullBatch);
+        }
+        else {
+            regions.push_back({ uploaded * sizeof(CullBatch), dst, sizeof(CullBatch) });
+        }
+        uploaded++;
+    }
+    if (uploaded > 0) {
+        reserve(f.upload, f.uploadAllocation, f.uploadCapacity, uploaded, sizeof(CullBatch),
+            VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+        char* mapped = static_cast<char*>(f.uploadAllocation.mapped);
+        for (size_t r = 0; r < regions.size(); r++)
+        {
+            memcpy(mapped + regions[r].srcOffset, reinterpret_cast<const char*>(described.data()) + regions[r].dstOffset, regions[r].size);
+        }
+    }
+    resident = std::move(described);
+
+    /* Written every time, the instance buffer is replaced whenever it grows.
+     * The set is only bound by this frame's command buffer, which is done with it.
+     */
+    VkDescriptorBufferInfo infos[4]{};
+    infos[0].buffer = instanceBuffer;
+    infos[1].buffer = batchBuffer;
+    infos[2].buffer = f.commands;
+    infos[3].buffer = f.counts;
+
+    VkWriteDescriptorSet writes[4]{};
+    for (uint32_t i = 0; i < 4; i++)
+    {
+        infos[i].offset = 0;
+        infos[i].range = VK_WHOLE_SIZE;
+        writes[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        writes[i].dstSet = f.set;
+        writes[i].dstBinding = i;
+        writes[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        writes[i].descriptorCount = 1;
+        writes[i].pBufferInfo = &infos[i];
+    }
+    vkUpdateDescriptorSets(d->device, 4, writes, 0, nullptr);
+
+    VkCommandBuffer cmd = d->frameOrder[d->currentFrame].frameCommandBuffer;
+    if (!regions.empty()) {
+        /* Earlier frames' dispatches are done reading the batches before they're overwritten */
+        VkMemoryBarrier read{};
+        read.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+        vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 1, &read, 0, nullptr, 0, nullptr);
+        vkCmdCopyBuffer(cmd, f.upload, batchBuffer, static_cast<uint32_t>(regions.size()), regions.data());
+    }
+    VkCommandBuffer cmd = d->frameOrder[d->currentFrame].frameCommandBuffer;
+    vkCmdFillBuffer(cmd, f.counts, 0, sizeof(uint32_t) * runCount * passCount, 0);
+
+    VkMemoryBarrier cleared{};
+    cleared.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    cleared.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    cleared.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+    vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &cleared, 0, nullptr, 0, nullptr);
+
+    vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline);
+    vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, layout, 0, 1, &f.set, 0, nullptr);
+
+    for (uint32_t p = 0; p < passCount; p++)
+    {
+        Pass pass{ p * objectCount, p * runCount };
+        f.passes.push_back(pass);
+
+        /* All zero planes keep everything */
+        CullConstants constants{};
+        if (frusta[p] != nullptr) {
+            for (int i = 0; i < 6; i++)
+            {
+                constants.planes[i] = frusta[p]->planes[i];
+            }
+        }
+        constants.objectCount = objectCount;
+        constants.batchCount = batchCount;
+        constants.instanceBase = f.instanceBase;
+        constants.commandBase = pass.commandBase;
+        constants.countBase = pass.countBase;
+        constants.compact = drawIndirectCount != nullptr ? 1 : 0;
+
+        vkCmdPushConstants(cmd, layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(CullConstants), &constants);
+        vkCmdDispatch(cmd, (objectCount + groupSize - 1) / groupSize, 1, 1);
+    }
+
+    VkMemoryBarrier written{};
+    written.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    written.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    written.dstAccessMask = VK_ACCESS_INDIRECT_COMMAND_READ_BIT;
+    vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT, 0, 1, &written, 0, nullptr, 0, nullptr);
+}
+
+void GpuCuller::draw(DrawContext& context, uint32_t run, uint32_t pass, bool bindMaterial) {
+    FrameBuffers& f = frames[d->currentFrame];
+    const Pass& p = f.passes[pass];
+    const Run& r = f.runs[run];
+    d->bindBatch(context, r.first, bindMaterial);
+
+    const VkDeviceSize stride = sizeof(VkDrawIndexedIndirectCommand);
+    VkDeviceSize offset = (p.commandBase + r.firstInstance - f.instanceBase) * stride;
+    if (drawIndirectCount != nullptr) {
+        drawIndirectCount(context.commandBuffer, f.commands, offset, f.counts, (p.countBase + run) * sizeof(uint32_t), r.instanceCount, static_cast<uint32_t>(stride));
+    }
+    else {
+        vkCmdDrawIndexedIndirect(context.commandBuffer, f.commands, offset, r.instanceCount, static_cast<uint32_t>(stride));
+    }
+    context.stats.draws++;
+}
+
+void GpuCuller::copyResults(uint32_t pass, VkBuffer commands, VkBuffer counts) {
+    FrameBuffers& f = frames[d->currentFrame];
+    if (f.objectCount == 0) return;
+    const Pass& p = f.passes[pass];
+    VkCommandBuffer cmd = d->frameOrder[d->currentFrame].frameCommandBuffer;
+
+    VkMemoryBarrier written{};
+    written.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    written.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    written.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+    vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 1, &written, 0, nullptr, 0, nullptr);
+
+    VkBufferCopy command{ p.commandBase * sizeof(VkDrawIndexedIndirectCommand), 0, f.objectCount * sizeof(VkDrawIndexedIndirectCommand) };
+    vkCmdCopyBuffer(cmd, f.commands, commands, 1, &command);
+    VkBufferCopy count{ p.countBase * sizeof(uint32_t), 0, f.runs.size() * sizeof(uint32_t) };
+    vkCmdCopyBuffer(cmd, f.counts, counts, 1, &count);
+}
+
+/* Bounds grown and shrunk by this much that Frustum::intersects disagrees on are too close to a plane to compare,
+ * the GPU rounds differently.
+ */
+const float cullTolerance = 0.01f;
+
+struct CullReadback {
+    VkBuffer commands;
+    Allocation commandAllocation;
+    VkBuffer counts;
+    Allocation countAllocation;
+};
+
+/* Checks one pass of a cull against frustum, null keeps everything. items are in instance order after batchDraws. */
+inline uint32_t checkPass(bool compact, uint32_t runCount, const std::vector<DrawItem>& items, const std::vector<DrawBatch>& batches, const Frustum* frustum, const CullReadback& readback) {
+    const VkDrawIndexedIndirectCommand* commands = static_cast<const VkDrawIndexedIndirectCommand*>(readback.commandAllocation.mapped);
+    const uint32_t* counts = static_cast<const uint32_t*>(readback.countAllocation.mapped);
+    uint32_t instanceBase = batches[0].firstInstance;
+    uint32_t errors = 0;
+
+    /* 1 visible, 0 culled, 2 either */
+    std::vector<uint32_t> expected(items.size());
+    for (size_t i = 0; i < items.size(); i++)
+    {
+        if (frustum == nullptr) {
+            expected[i] = 1;
+            continue;
+        }
+        const Mesh* mesh = items[i].mesh;
+        glm::vec3 margin(cullTolerance);
+        bool inner = frustum->intersects(mesh->boundsMin + margin, mesh->boundsMax - margin, items[i].model);
+        bool outer = frustum->intersects(mesh->boundsMin - margin, mesh->boundsMax + margin, items[i].model);
+        expected[i] = inner == outer ? (inner ? 1 : 0) : 2;
+    }
+
+    auto matches = [&](const VkDrawIndexedIndirectCommand& command, uint32_t i) {
+        return command.indexCount == items[i].submesh->iBufferSize && command.firstIndex == items[i].submesh->firstIndex
+            && command.vertexOffset == static_cast<int32_t>(items[i].mesh->vertexOffset) && command.firstInstance == instanceBase + i;
+    };
+
+    if (!compact) {
+        for (uint32_t i = 0; i < items.size(); i++)
+        {
+            const VkDrawIndexedIndirectCommand& command = commands[i];
+            if (!matches(command, i) || command.instanceCount > 1 || (expected[i] != 2 && command.instanceCount != expected[i])) errors++;
+        }
+        return errors;
+    }
+
+    /* Runs as cull finds them, every visible instance packed to the front of its run's range */
+    uint32_t run = 0;
+    for (size_t b = 0; b < batches.size(); run++)
+    {
+        uint32_t first = batches[b].firstInstance - instanceBase;
+        uint32_t end = first;
+        size_t next = b;
+        while (next < batches.size() && (next == b || sameRun(batches[b], batches[next])))
+        {
+            end += batches[next].instanceCount;
+            next++;
+        }
+        b = next;
+
+        uint32_t certain = 0;
+        uint32_t possible = 0;
+        for (uint32_t i = first; i < end; i++)
+        {
+            certain += expected[i] == 1 ? 1 : 0;
+            possible += expected[i] != 0 ? 1 : 0;
+        }
+        uint32_t count = counts[run];
+        if (count < certain || count > possible) {
+            errors++;
+            continue;
+        }
+
+        std::vector<bool> seen(end - first, false);
+        for (uint32_t slot = 0; slot < count; slot++)
+        {
+            const VkDrawIndexedIndirectCommand& command = commands[first + slot];
+            uint32_t i = command.firstInstance - instanceBase;
+            if (i < first || i >= end || seen[i - first] || !matches(command, i) || command.instanceCount != 1 || expected[i] == 0) {
+                errors++;
+                continue;
+            }
+            seen[i - first] = true;
+        }
+        for (uint32_t i = first; i < end; i++)
+        {
+            if (expected[i] == 1 && !seen[i - first]) errors++;
+        }
+    }
+    if (run != runCount) errors++;
+    return errors;
+}
+
+/* Culls items on the next frame with both passes and compares them to the CPU, uploads is what cull should have copied */
+inline uint32_t cullFrame(Drawer* d, GpuCuller* culler, std::vector<DrawItem>& items, const Frustum& frustum, CullReadback* readback, int64_t uploads) {
+    d->beginFrame(glm::mat4(1.0f), 90, { glm::mat4(1.0f) }, { 90 });
+    std::vector<DrawBatch> batches;
+    d->batchDraws(items, batches, d->frameInstances());
+    std::vector<uint32_t> passes;
+    culler->cull(batches, { nullptr, &frustum }, passes);
+    uint32_t runCount = culler->runCount();
+    for (uint32_t p = 0; p < passes.size(); p++)
+    {
+        culler->copyResults(passes[p], readback[p].commands, readback[p].counts);
+    }
+    d->submitDraws();
+    d->endFrame();
+    d->queues->waitDeviceIdle();
+
+    bool compact = culler->countsDraws();
+    uint32_t errors = checkPass(compact, runCount, items, batches, nullptr, readback[0]) + checkPass(compact, runCount, items, batches, &frustum, readback[1]);
+    if (uploads >= 0 && culler->uploadedBatches() != uploads) errors++;
+    return errors;
+}
+
+bool testGpuCulling() {
+    Drawer* d = new Drawer(nullptr, true);
+    if (d->enableGpuCulling() == nullptr) {
+        std::cout << "GPU culling test skipped, the device can't draw indirectly\n";
+        delete d;
+        return true;
+    }
+
+    /* Pooled meshes share buffers and runs, the one with its own buffers splits them */
+    std::vector<Submesh::SubmeshCreateInfo> submeshes;
+    submeshes.push_back(Submesh::SubmeshCreateInfo(d->defaultIndices.data(), static_cast<uint32_t>(d->defaultIndices.size()), 0));
+    std::vector<Mesh> meshes;
+    meshes.reserve(4);
+    for (uint32_t m = 0; m < 4; m++)
+    {
+        std::vector<Vertex> vertices = d->defaultBox;
+        for (size_t v = 0; v < vertices.size(); v++)
+        {
+            vertices[v].pos = vertices[v].pos * glm::vec3(1.0f + m, 1.0f, 0.5f + m) + glm::vec3(0.0f, 0.5f * m, 0.0f);
+        }
+        meshes.push_back(Mesh(d, vertices.data(), static_cast<uint32_t>(vertices.size()), submeshes, false, m == 2));
+    }
+
+    CullReadback readback[2];
+    const uint32_t itemCount = 2000;
+    for (uint32_t p = 0; p < 2; p++)
+    {
+        d->memory->createBuffer(itemCount * sizeof(VkDrawIndexedIndirectCommand), VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, readback[p].commands, readback[p].commandAllocation);
+        d->memory->createBuffer(itemCount * sizeof(uint32_t), VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, readback[p].counts, readback[p].countAllocation);
+    }
+
+    glm::mat4 view = glm::lookAt(glm::vec3(0.0f, 5.0f, 40.0f), glm::vec3(0.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+    Frustum frustum(d->cameraProjection(90) * view);
+
+    std::mt19937 random{ 1 };
+    std::uniform_real_distribution<float> position(-60.0f, 60.0f);
+    std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+    std::vector<DrawItem> items(itemCount);
+    auto place = [&]() {
+        for (size_t i = 0; i < items.size(); i++)
+        {
+            glm::vec3 axis = glm::normalize(glm::vec3(unit(random), unit(random), unit(random)) + glm::vec3(0.1f));
+            items[i].model = glm::translate(glm::mat4(1.0f), glm::vec3(position(random), position(random), position(random)))
+                * glm::rotate(glm::mat4(1.0f), unit(random) * 6.28f, axis) * glm::scale(glm::mat4(1.0f), glm::vec3(0.5f + 2.0f * unit(random)));
+        }
+    };
+    auto assign = [&]() {
+        for (size_t i = 0; i < items.size(); i++)
+        {
+            Mesh* mesh = &meshes[random() % meshes.size()];
+            items[i] = { mesh, &mesh->submeshes[0], &d->registeredMaterials[0], glm::mat4(1.0f), glm::vec4(0.0f) };
+        }
+        place();
+    };
+
+    uint32_t layouts = d->culler->countsDraws() ? 2 : 1;
+    uint32_t errors = 0;
+    for (uint32_t layout = 0; layout < layouts; layout++)
+    {
+        if (layout == 1) {
+            /* Again with every instance left in its slot, as without VK_KHR_draw_indirect_count */
+            delete d->culler;
+            d->culler = new GpuCuller(d, nullptr);
+        }
+        assign();
+        /* Everything is new, then the same meshes moved around, then different meshes */
+        errors += cullFrame(d, d->culler, items, frustum, readback, -1);
+        place();
+        errors += cullFrame(d, d->culler, items, frustum, readback, 0);
+        assign();
+        errors += cullFrame(d, d->culler, items, frustum, readback, -1);
+        for (uint32_t f = 0; f < d->FRAMES_IN_FLIGHT; f++)
+        {
+            place();
+            errors += cullFrame(d, d->culler, items, frustum, readback, 0);
+        }
+    }
+
+    for (uint32_t p = 0; p < 2; p++)
+    {
+        d->memory->destroyBuffer(readback[p].commands, readback[p].commandAllocation);
+        d->memory->destroyBuffer(readback[p].counts, readback[p].countAllocation);
+    }
+    for (size_t m = 0; m < meshes.size(); m++)
+    {
+        meshes[m].free(d);
+    }
+    delete d;
+
+    std::cout << "GPU culling test " << (errors == 0 ? "passed" : "failed") << ", " << errors << " mismatches\n";
+    return errors == 0;
+}
@@ -0,0 +1,132 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+
+#include <cstdint>
+#include <vector>
+
+#include "render.h"
+
+namespace render
+{
+    /*
+     * GPU driven drawing. cull describes every batch (bounds, draw parameters, its instances) in a storage buffer,
+     * and a compute shader runs once per instance, finds its batch, tests it against each frustum and writes one
+     * VkDrawIndexedIndirectCommand per visible instance.
+     * Consecutive batches that share material bindings and, through MeshPool, their vertex and index buffers form a run,
+     * and a run costs one indirect draw however many meshes and instances are in it.
+     *
+     * The batch descriptions stay resident in device local memory, cull only copies the ones that changed since the last frame,
+     * so a scene that doesn't change costs nothing to upload and the CPU side grows with batches, not instances.
+     *
+     * With VK_KHR_draw_indirect_count the shader packs each run's visible commands to the front of its range
+     * and counts them, the draw reads the count. Without it every instance keeps its slot, culled ones with an instanceCount of 0,
+     * and the draw runs over the whole range.
+     *
+     * Needs multiDrawIndirect, drawIndirectFirstInstance and compute on the graphics family, Drawer::culler is null otherwise.
+     */
+    class GpuCuller {
+    public:
+        static const uint32_t groupSize = 64;
+
+        /* drawIndirectCount is null without VK_KHR_draw_indirect_count */
+        GpuCuller(Drawer* d, PFN_vkCmdDrawIndexedIndirectCountKHR drawIndirectCount);
+        ~GpuCuller();
+
+        /* Once per frame on the render thread, outside any pass and before the passes that draw the results.
+         * A null frustum keeps everything. passes gets one id per frustum for draw.
+         */
+        void cull(const std::vector<DrawBatch>& batches, const std::vector<const Frustum*>& frusta, std::vector<uint32_t>& passes);
+        /* Runs found by this frame's cull */
+        uint32_t runCount() const;
+        /* run below runCount. Any recording thread. */
+        void draw(DrawContext& context, uint32_t run, uint32_t pass, bool bindMaterial);
+
+        bool countsDraws() const;
+        /* Batch descriptions the last cull copied to the GPU */
+        uint32_t uploadedBatches() const;
+
+        /* For testGpuCulling, after cull in the same frame. Copies pass's commands, one per instance of the culled batches,
+         * and its counts, one per run, to the start of the two buffers.
+         */
+        void copyResults(uint32_t pass, VkBuffer commands, VkBuffer counts);
+
+    private:
+        /* std430, matches cull.comp. Instances are counted from the first batch's, so a batch reads the same every frame it doesn't change. */
+        struct CullBatch {
+            glm::vec4 boundsMin;
+            glm::vec4 boundsMax;
+            /* First instance, run, first instance of the run */
+            glm::uvec4 info;
+            /* Index count, first index, vertex offset */
+            glm::uvec4 draw;
+        };
+
+        struct CullConstants {
+            glm::vec4 planes[6];
+            uint32_t objectCount;
+            uint32_t batchCount;
+            uint32_t instanceBase;
+            uint32_t commandBase;
+            uint32_t countBase;
+            uint32_t compact;
+        };
+
+        struct Pass {
+            uint32_t commandBase;
+            uint32_t countBase;
+        };
+
+        /* Batches drawn by one indirect call, bound through the first of them */
+        struct Run {
+            DrawBatch first;
+            uint32_t firstInstance;
+            uint32_t instanceCount;
+        };
+
+        /* Used by one frame in flight at a time, like everything else in FrameOrderEntry */
+        struct FrameBuffers {
+            /* The changed batch descriptions, copied into batchBuffer by the frame's command buffer */
+            VkBuffer upload = VK_NULL_HANDLE;
+            Allocation uploadAllocation;
+            uint32_t uploadCapacity = 0;
+            VkBuffer commands = VK_NULL_HANDLE;
+            Allocation commandAllocation;
+            uint32_t commandCapacity = 0;
+            VkBuffer counts = VK_NULL_HANDLE;
+            Allocation countAllocation;
+            uint32_t countCapacity = 0;
+            VkDescriptorSet set;
+            /* The batches' first instance */
+            uint32_t instanceBase = 0;
+            uint32_t objectCount = 0;
+            std::vector<Pass> passes;
+            std::vector<Run> runs;
+        };
+
+        Drawer* d;
+        PFN_vkCmdDrawIndexedIndirectCountKHR drawIndirectCount;
+
+        VkDescriptorSetLayout setLayout;
+        VkPipelineLayout layout;
+        VkPipeline pipeline;
+        std::vector<FrameBuffers> frames;
+
+        /* Shared by every frame in flight. Frames are submitted to the graphics queue in order, so the copies a frame records
+         * land after the previous frames' dispatches read it, and resident is what the GPU holds when this frame's dispatches run.
+         */
+        VkBuffer batchBuffer = VK_NULL_HANDLE;
+        Allocation batchAllocation;
+        uint32_t batchCapacity = 0;
+        std::vector<CullBatch> resident;
+        uint32_t uploaded = 0;
+
+        /* Replaces buffer with a bigger one when count doesn't fit */
+        void reserve(VkBuffer& buffer, Allocation& allocation, uint32_t& capacity, uint32_t count, VkDeviceSize stride, VkBufferUsageFlags usage, VkMemoryPropertyFlags required);
+    };
+};
+
+/* Culls random instances on a surfaceless Drawer and checks the commands and counts against Frustum::intersects.
+ * False when they differ, true when they match or the device can't cull.
+ */
+bool testGpuCulling();
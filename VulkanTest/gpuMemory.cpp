@@ -0,0 +1,430 @@
+#include "gpuMemory.h"
+
+#include <algorithm>
+#include <bit>
+#include <stdexcept>
+
+using namespace render;
+
+/* Smallest buddy, also the granularity every allocation is rounded to */
+const VkDeviceSize minAllocation = 256;
+const VkDeviceSize maxBlockSize = 64ull * 1024 * 1024;
+
+inline VkDeviceSize nextPowerOfTwo(VkDeviceSize v) {
+    VkDeviceSize r = 1;
+    while (r < v) r <<= 1;
+    return r;
+}
+
+inline uint32_t floorLog2(VkDeviceSize v) {
+    uint32_t r = 0;
+    while (v > 1) {
+        v >>= 1;
+        r++;
+    }
+    return r;
+}
+
+const char* render::categoryName(MemoryCategory category) {
+    switch (category) {
+    case MemoryCategory::Mesh: return "meshes";
+    case MemoryCategory::Texture: return "textures";
+    case MemoryCategory::Uniform: return "uniforms";
+    case MemoryCategory::Staging: return "staging";
+    case MemoryCategory::Attachment: return "attachments";
+    default: return "other";
+    }
+}
+
+GpuAllocator::GpuAllocator(VkDevice device, VkPhysicalDevice physicalDevice) {
+    this->device = device;
+    vkGetPhysicalDeviceMemoryProperties(physicalDevice, &memoryProperties);
+
+    /* Small heaps (BAR windows, integrated carve-outs) get smaller blocks so one block can't eat the heap */
+    for (uint32_t i = 0; i < memoryProperties.memoryHeapCount; i++)
+    {
+        VkDeviceSize size = maxBlockSize;
+        while (size > 1024 * 1024 && size > memoryProperties.memoryHeaps[i].size / 8) size >>= 1;
+        blockSizes[i] = size;
+    }
+
+    pools.resize(memoryProperties.memoryTypeCount * 2);
+}
+
+GpuAllocator::~GpuAllocator() {
+    for (size_t i = 0; i < pools.size(); i++)
+    {
+        for (size_t j = 0; j < pools[i].blocks.size(); j++)
+        {
+            if (pools[i].blocks[j] == nullptr) continue;
+            if (pools[i].blocks[j]->allocationCount != 0) {
+                std::cout << "GPU memory block destroyed with " << pools[i].blocks[j]->allocationCount << " live allocations\n";
+            }
+            destroyBlock(pools[i].blocks[j]);
+        }
+    }
+}
+
+GpuAllocator::Pool& GpuAllocator::pool(uint32_t memoryType, bool optimalImage) {
+    return pools[memoryType * 2 + (optimalImage ? 1 : 0)];
+}
+
+VkDeviceSize GpuAllocator::blockSize(uint32_t memoryType) const {
+    return blockSizes[memoryProperties.memoryTypes[memoryType].heapIndex];
+}
+
+uint32_t GpuAllocator::orderCount(uint32_t memoryType) const {
+    return floorLog2(blockSize(memoryType) / minAllocation) + 1;
+}
+
+uint32_t GpuAllocator::findMemoryType(uint32_t filter, VkMemoryPropertyFlags required, VkMemoryPropertyFlags preferred) const {
+    uint32_t best = UINT32_MAX;
+    int bestScore = -1;
+    for (uint32_t i = 0; i < memoryProperties.memoryTypeCount; i++)
+    {
+        VkMemoryPropertyFlags flags = memoryProperties.memoryTypes[i].propertyFlags;
+        if (!(filter & (1 << i)) || (flags & required) != required) continue;
+
+        /* Fewer unrequested flags breaks ties, so plain device local memory wins over the BAR window */
+        int score = std::popcount(flags & preferred) * 32 - std::popcount(flags & ~(required | preferred));
+        if (score > bestScore) {
+            bestScore = score;
+            best = i;
+        }
+    }
+
+    if (best == UINT32_MAX) {
+        throw std::runtime_error("Error finding memory type");
+    }
+    return best;
+}
+
+GpuAllocator::Block* GpuAllocator::createBlock(uint32_t memoryType) {
+    VkMemoryAllocateInfo allocInfo{};
+    allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+    allocInfo.allocationSize = blockSize(memoryType);
+    allocInfo.memoryTypeIndex = memoryType;
+
+    Block* block = new Block{};
+    if (vkAllocateMemory(device, &allocInfo, nullptr, &block->memory) != VK_SUCCESS) {
+        delete block;
+        return nullptr;
+    }
+
+    block->mapped = nullptr;
+    if (memoryProperties.memoryTypes[memoryType].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
+        void* mapped;
+        vkMapMemory(device, block->memory, 0, VK_WHOLE_SIZE, 0, &mapped);
+        block->mapped = static_cast<char*>(mapped);
+    }
+
+    uint32_t orders = orderCount(memoryType);
+    block->freeLists.resize(orders);
+    block->freeLists[orders - 1].insert(0);
+    return block;
+}
+
+void GpuAllocator::destroyBlock(Block* block) {
+    if (block->mapped != nullptr) vkUnmapMemory(device, block->memory);
+    vkFreeMemory(device, block->memory, nullptr);
+    delete block;
+}
+
+bool GpuAllocator::allocateFromBlock(Block* block, uint32_t memoryType, uint32_t order, VkDeviceSize& offset) {
+    uint32_t orders = static_cast<uint32_t>(block->freeLists.size());
+    uint32_t k = order;
+    while (k < orders && block->freeLists[k].empty()) k++;
+    if (k == orders) return false;
+
+    offset = *block->freeLists[k].begin();
+    block->freeLists[k].erase(block->freeLists[k].begin());
+
+    /* Split down to the requested order, the upper halves go back on the free lists */
+    while (k > order)
+    {
+        k--;
+        block->freeLists[k].insert(offset + (minAllocation << k));
+    }
+
+    block->used += minAllocation << order;
+    block->allocationCount++;
+    return true;
+}
+
+void GpuAllocator::freeToBlock(Block* block, uint32_t memoryType, VkDeviceSize offset, uint32_t order) {
+    block->used -= minAllocation << order;
+    block->allocationCount--;
+
+    uint32_t orders = static_cast<uint32_t>(block->freeLists.size());
+    while (order + 1 < orders)
+    {
+        VkDeviceSize buddy = offset ^ (minAllocation << order);
+        auto it = block->freeLists[order].find(buddy);
+        if (it == block->freeLists[order].end()) break;
+
+        block->freeLists[order].erase(it);
+        offset = std::min(offset, buddy);
+        order++;
+    }
+    block->freeLists[order].insert(offset);
+}
+
+bool GpuAllocator::allocateInPool(uint32_t memoryType, bool optimalImage, VkDeviceSize size, uint32_t skipBlock, bool allowNewBlock, Allocation& allocation) {
+    Pool& p = pool(memoryType, optimalImage);
+    uint32_t order = floorLog2(size / minAllocation);
+
+    for (uint32_t i = 0; i < p.blocks.size(); i++)
+    {
+        if (p.blocks[i] == nullptr || i == skipBlock) continue;
+
+        VkDeviceSize offset;
+        if (allocateFromBlock(p.blocks[i], memoryType, order, offset)) {
+            allocation.memory = p.blocks[i]->memory;
+            allocation.offset = offset;
+            allocation.mapped = p.blocks[i]->mapped != nullptr ? p.blocks[i]->mapped + offset : nullptr;
+            allocation.block = i;
+            return true;
+        }
+    }
+
+    if (!allowNewBlock) return false;
+
+    Block* block = createBlock(memoryType);
+    if (block == nullptr) return false;
+
+    uint32_t index = 0;
+    while (index < p.blocks.size() && p.blocks[index] != nullptr) index++;
+    if (index == p.blocks.size()) p.blocks.push_back(block);
+    else p.blocks[index] = block;
+
+    VkDeviceSize offset;
+    allocateFromBlock(block, memoryType, order, offset);
+    allocation.memory = block->memory;
+    allocation.offset = offset;
+    allocation.mapped = block->mapped != nullptr ? block->mapped + offset : nullptr;
+    allocation.block = index;
+    return true;
+}
+
+Allocation GpuAllocator::allocateDedicated(uint32_t memoryType, VkDeviceSize size) {
+    Allocation r{};
+    VkMemoryAllocateInfo allocInfo{};
+    allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+    allocInfo.allocationSize = size;
+    allocInfo.memoryTypeIndex = memoryType;
+
+    if (vkAllocateMemory(device, &allocInfo, nullptr, &r.memory) != VK_SUCCESS) {
+        throw std::runtime_error("Error allocating GPU memory");
+    }
+
+    if (memoryProperties.memoryTypes[memoryType].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
+        vkMapMemory(device, r.memory, 0, VK_WHOLE_SIZE, 0, &r.mapped);
+    }
+
+    r.size = size;
+    r.memoryType = memoryType;
+    r.block = dedicatedBlock;
+
+    uint32_t heap = memoryProperties.memoryTypes[memoryType].heapIndex;
+    dedicatedBytes[heap] += size;
+    dedicatedCount[heap]++;
+    return r;
+}
+
+Allocation GpuAllocator::allocate(const VkMemoryRequirements& requirements, VkMemoryPropertyFlags required, VkMemoryPropertyFlags preferred, bool optimalImage, MemoryCategory category) {
+    std::lock_guard<std::mutex> guard(lock);
+
+    uint32_t memoryType = findMemoryType(requirements.memoryTypeBits, required, preferred);
+    uint32_t heap = memoryProperties.memoryTypes[memoryType].heapIndex;
+
+    /* Buddies are aligned to their own size inside the block, so rounding up covers the alignment too */
+    VkDeviceSize size = nextPowerOfTwo(std::max({ requirements.size, requirements.alignment, minAllocation }));
+
+    /* Anything over half a block would waste most of it, those get their own memory */
+    if (size > blockSize(memoryType) / 2) {
+        Allocation r = allocateDedicated(memoryType, requirements.size);
+        r.optimalImage = optimalImage;
+        r.category = category;
+        categoryTotals[heap][static_cast<size_t>(category)] += r.size;
+        return r;
+    }
+
+    Allocation r{};
+    r.size = size;
+    r.memoryType = memoryType;
+    r.optimalImage = optimalImage;
+    r.category = category;
+    if (!allocateInPool(memoryType, optimalImage, size, dedicatedBlock, true, r)) {
+        throw std::runtime_error("Error allocating GPU memory");
+    }
+    categoryTotals[heap][static_cast<size_t>(category)] += r.size;
+    return r;
+}
+
+void GpuAllocator::free(Allocation& allocation) {
+    if (allocation.memory == VK_NULL_HANDLE) return;
+    std::lock_guard<std::mutex> guard(lock);
+
+    uint32_t heap = memoryProperties.memoryTypes[allocation.memoryType].heapIndex;
+    categoryTotals[heap][static_cast<size_t>(allocation.category)] -= allocation.size;
+
+    if (allocation.block == dedicatedBlock) {
+        dedicatedBytes[heap] -= allocation.size;
+        dedicatedCount[heap]--;
+        if (allocation.mapped != nullptr) vkUnmapMemory(device, allocation.memory);
+        vkFreeMemory(device, allocation.memory, nullptr);
+    }
+    else {
+        Pool& p = pool(allocation.memoryType, allocation.optimalImage);
+        Block* block = p.blocks[allocation.block];
+        freeToBlock(block, allocation.memoryType, allocation.offset, floorLog2(allocation.size / minAllocation));
+
+        /* Keep one block per pool around so a single buffer coming and going doesn't reallocate every time */
+        if (block->allocationCount == 0) {
+            size_t liveBlocks = 0;
+            for (size_t i = 0; i < p.blocks.size(); i++)
+            {
+                if (p.blocks[i] != nullptr) liveBlocks++;
+            }
+            if (liveBlocks > 1) {
+                destroyBlock(block);
+                p.blocks[allocation.block] = nullptr;
+            }
+        }
+    }
+
+    allocation = Allocation{};
+}
+
+void GpuAllocator::createBuffer(VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags memFlags, VkBuffer& buffer, Allocation& allocation, VkMemoryPropertyFlags preferred, MemoryCategory category, const std::vector<uint32_t>& sharedFamilies) {
+    std::vector<uint32_t> families;
+    for (size_t i = 0; i < sharedFamilies.size(); i++)
+    {
+        if (std::find(families.begin(), families.end(), sharedFamilies[i]) == families.end()) families.push_back(sharedFamilies[i]);
+    }
+
+    VkBufferCreateInfo info{};
+    info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    info.size = size;
+    info.usage = usage;
+    info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    if (families.size() > 1) {
+        info.sharingMode = VK_SHARING_MODE_CONCURRENT;
+        info.queueFamilyIndexCount = static_cast<uint32_t>(families.size());
+        info.pQueueFamilyIndices = families.data();
+    }
+
+    if (vkCreateBuffer(device, &info, nullptr, &buffer) != VK_SUCCESS) {
+        throw std::runtime_error("Error creating buffer");
+    }
+
+    VkMemoryRequirements requirements;
+    vkGetBufferMemoryRequirements(device, buffer, &requirements);
+
+    allocation = allocate(requirements, memFlags, preferred, false, category);
+    vkBindBufferMemory(device, buffer, allocation.memory, allocation.offset);
+}
+
+void GpuAllocator::destroyBuffer(VkBuffer buffer, Allocation& allocation) {
+    vkDestroyBuffer(device, buffer, nullptr);
+    free(allocation);
+}
+
+void GpuAllocator::createImage(const VkImageCreateInfo& info, VkMemoryPropertyFlags memFlags, VkImage& image, Allocation& allocation, MemoryCategory category) {
+    if (vkCreateImage(device, &info, nullptr, &image) != VK_SUCCESS) {
+        throw std::runtime_error("failed to create image!");
+    }
+
+    VkMemoryRequirements requirements;
+    vkGetImageMemoryRequirements(device, image, &requirements);
+
+    allocation = allocate(requirements, memFlags, 0, info.tiling == VK_IMAGE_TILING_OPTIMAL, category);
+    vkBindImageMemory(device, image, allocation.memory, allocation.offset);
+}
+
+void GpuAllocator::destroyImage(VkImage image, Allocation& allocation) {
+    vkDestroyImage(device, image, nullptr);
+    free(allocation);
+}
+
+void GpuAllocator::trackExternal(uint32_t memoryType, VkDeviceSize bytes, MemoryCategory category) {
+    std::lock_guard<std::mutex> guard(lock);
+    uint32_t heap = memoryProperties.memoryTypes[memoryType].heapIndex;
+    externalBytes[heap] += bytes;
+    categoryTotals[heap][static_cast<size_t>(category)] += bytes;
+}
+
+void GpuAllocator::untrackExternal(uint32_t memoryType, VkDeviceSize bytes, MemoryCategory category) {
+    std::lock_guard<std::mutex> guard(lock);
+    uint32_t heap = memoryProperties.memoryTypes[memoryType].heapIndex;
+    externalBytes[heap] -= bytes;
+    categoryTotals[heap][static_cast<size_t>(category)] -= bytes;
+}
+
+HeapStats GpuAllocator::heapStats(uint32_t heap) {
+    std::lock_guard<std::mutex> guard(lock);
+
+    HeapStats r{};
+    r.heapSize = memoryProperties.memoryHeaps[heap].size;
+    r.dedicatedBytes = dedicatedBytes[heap];
+    r.dedicatedCount = dedicatedCount[heap];
+    r.allocationCount = dedicatedCount[heap];
+    r.usedBytes = dedicatedBytes[heap];
+
+    for (uint32_t i = 0; i < pools.size(); i++)
+    {
+        uint32_t memoryType = i / 2;
+        if (memoryProperties.memoryTypes[memoryType].heapIndex != heap) continue;
+        for (size_t j = 0; j < pools[i].blocks.size(); j++)
+        {
+            Block* block = pools[i].blocks[j];
+            if (block == nullptr) continue;
+            r.blockCount++;
+            r.blockBytes += blockSize(memoryType);
+            r.usedBytes += block->used;
+            r.allocationCount += block->allocationCount;
+        }
+    }
+    return r;
+}
+
+uint32_t GpuAllocator::heapCount() const {
+    return memoryProperties.memoryHeapCount;
+}
+
+uint32_t GpuAllocator::heapIndex(uint32_t memoryType) const {
+    return memoryProperties.memoryTypes[memoryType].heapIndex;
+}
+
+const VkMemoryHeap& GpuAllocator::heap(uint32_t heap) const {
+    return memoryProperties.memoryHeaps[heap];
+}
+
+VkDeviceSize GpuAllocator::heapUsage(uint32_t heap) {
+    HeapStats s = heapStats(heap);
+    std::lock_guard<std::mutex> guard(lock);
+    return s.blockBytes + s.dedicatedBytes + externalBytes[heap];
+}
+
+VkDeviceSize GpuAllocator::categoryBytes(uint32_t heap, MemoryCategory category) {
+    std::lock_guard<std::mutex> guard(lock);
+    return categoryTotals[heap][static_cast<size_t>(category)];
+}
+
+void GpuAllocator::report(std::ostream& out) {
+    out << "GPU memory:\n";
+    for (uint32_t i = 0; i < memoryProperties.memoryHeapCount; i++)
+    {
+        HeapStats s = heapStats(i);
+        out << "\theap " << i << ((memoryProperties.memoryHeaps[i].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT) ? " (device local)" : "") << ": "
+            << s.usedBytes / 1024 << " KB used by " << s.allocationCount << " allocations, "
+            << s.blockCount << " blocks (" << s.blockBytes / 1024 << " KB), "
+            << s.dedicatedCount << " dedicated (" << s.dedicatedBytes / 1024 << " KB), heap " << s.heapSize / (1024 * 1024) << " MB\n";
+
+        for (size_t c = 0; c < static_cast<size_t>(MemoryCategory::Count); c++)
+        {
+            VkDeviceSize bytes = categoryBytes(i, static_cast<MemoryCategory>(c));
+            if (bytes != 0) out << "\t\t" << categoryName(static_cast<MemoryCategory>(c)) << ": " << bytes / 1024 << " KB\n";
+        }
+    }
+}
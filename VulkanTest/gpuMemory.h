@@ -0,0 +1,125 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+
+#include <cstdint>
+#include <iostream>
+#include <mutex>
+#include <set>
+#include <vector>
+
+namespace render
+{
+    /* What an allocation is for, GpuAllocator keeps per heap totals of each */
+    enum class MemoryCategory : uint8_t {
+        Mesh,
+        Texture,
+        Uniform,
+        Staging,
+        Attachment,
+        Other,
+        Count
+    };
+
+    const char* categoryName(MemoryCategory category);
+
+    /* A range of device memory handed out by GpuAllocator */
+    struct Allocation {
+        VkDeviceMemory memory = VK_NULL_HANDLE;
+        VkDeviceSize offset = 0;
+        VkDeviceSize size = 0;
+        /* Persistently mapped pointer to offset, null unless the memory is host visible */
+        void* mapped = nullptr;
+        uint32_t memoryType = 0;
+        /* Index into the owning pool, dedicatedBlock for allocations with their own VkDeviceMemory */
+        uint32_t block = 0;
+        bool optimalImage = false;
+        MemoryCategory category = MemoryCategory::Other;
+    };
+
+    struct HeapStats {
+        VkDeviceSize heapSize;
+        VkDeviceSize blockBytes;
+        VkDeviceSize usedBytes;
+        VkDeviceSize dedicatedBytes;
+        uint32_t blockCount;
+        uint32_t allocationCount;
+        uint32_t dedicatedCount;
+    };
+
+    /*
+     * Suballocates buffers and images out of large VkDeviceMemory blocks, one buddy allocator per block.
+     * Buffers and linear images never share a block with optimal images, so bufferImageGranularity can't be violated.
+     * Host visible blocks stay mapped for their whole lifetime.
+     */
+    class GpuAllocator {
+    public:
+        static const uint32_t dedicatedBlock = UINT32_MAX;
+
+        GpuAllocator(VkDevice device, VkPhysicalDevice physicalDevice);
+        ~GpuAllocator();
+
+        /* required flags must all be present, preferred ones pick between types that have them */
+        Allocation allocate(const VkMemoryRequirements& requirements, VkMemoryPropertyFlags required, VkMemoryPropertyFlags preferred, bool optimalImage, MemoryCategory category = MemoryCategory::Other);
+        void free(Allocation& allocation);
+
+        /* With two or more distinct sharedFamilies the buffer is VK_SHARING_MODE_CONCURRENT between them, and needs no ownership transfers */
+        void createBuffer(VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags memFlags, VkBuffer& buffer, Allocation& allocation, VkMemoryPropertyFlags preferred = 0, MemoryCategory category = MemoryCategory::Other, const std::vector<uint32_t>& sharedFamilies = {});
+        void destroyBuffer(VkBuffer buffer, Allocation& allocation);
+        void createImage(const VkImageCreateInfo& info, VkMemoryPropertyFlags memFlags, VkImage& image, Allocation& allocation, MemoryCategory category = MemoryCategory::Other);
+        void destroyImage(VkImage image, Allocation& allocation);
+
+        /* Memory allocated behind our back (ktxTexture2_VkUploadEx), only counted so the budget sees it */
+        void trackExternal(uint32_t memoryType, VkDeviceSize bytes, MemoryCategory category);
+        void untrackExternal(uint32_t memoryType, VkDeviceSize bytes, MemoryCategory category);
+
+        uint32_t findMemoryType(uint32_t filter, VkMemoryPropertyFlags required, VkMemoryPropertyFlags preferred) const;
+        HeapStats heapStats(uint32_t heap);
+        uint32_t heapCount() const;
+        uint32_t heapIndex(uint32_t memoryType) const;
+        const VkMemoryHeap& heap(uint32_t heap) const;
+        /* Everything this process got from the driver on the heap: whole blocks, dedicated and external allocations */
+        VkDeviceSize heapUsage(uint32_t heap);
+        /* Bytes handed out for the category on the heap, buddy rounding included */
+        VkDeviceSize categoryBytes(uint32_t heap, MemoryCategory category);
+        void report(std::ostream& out);
+
+    private:
+        struct Block {
+            VkDeviceMemory memory;
+            char* mapped;
+            VkDeviceSize used;
+            uint32_t allocationCount;
+            /* Free offsets per order, order 0 is minAllocation bytes */
+            std::vector<std::set<VkDeviceSize>> freeLists;
+        };
+
+        /* One per memory type and kind, the kind keeps optimal images apart from everything else */
+        struct Pool {
+            std::vector<Block*> blocks;
+        };
+
+        VkDevice device;
+        VkPhysicalDeviceMemoryProperties memoryProperties;
+        VkDeviceSize blockSizes[VK_MAX_MEMORY_HEAPS];
+        std::vector<Pool> pools;
+
+        VkDeviceSize dedicatedBytes[VK_MAX_MEMORY_HEAPS] = {};
+        uint32_t dedicatedCount[VK_MAX_MEMORY_HEAPS] = {};
+        VkDeviceSize externalBytes[VK_MAX_MEMORY_HEAPS] = {};
+        VkDeviceSize categoryTotals[VK_MAX_MEMORY_HEAPS][static_cast<size_t>(MemoryCategory::Count)] = {};
+
+        std::mutex lock;
+
+        Pool& pool(uint32_t memoryType, bool optimalImage);
+        VkDeviceSize blockSize(uint32_t memoryType) const;
+        uint32_t orderCount(uint32_t memoryType) const;
+
+        Block* createBlock(uint32_t memoryType);
+        void destroyBlock(Block* block);
+        bool allocateFromBlock(Block* block, uint32_t memoryType, uint32_t order, VkDeviceSize& offset);
+        void freeToBlock(Block* block, uint32_t memoryType, VkDeviceSize offset, uint32_t order);
+        bool allocateInPool(uint32_t memoryType, bool optimalImage, VkDeviceSize size, uint32_t skipBlock, bool allowNewBlock, Allocation& allocation);
+        Allocation allocateDedicated(uint32_t memoryType, VkDeviceSize size);
+    };
+};
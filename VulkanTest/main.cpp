@@ -19,15 +19,19 @@
 #include <algorithm>
 #include <optional>
 #include <random>
+#include <cstring>
 
 #include <stb_image.h>
 
 #include "render.h"
+#include "gpuCulling.h"
+#include "uploadBatch.h"
 #include "scene.h"
 #include "input.h"
 #include "objects.h"
 #include "threading.h"
 #include "bulletCustom.h"
+#include "terrain.h"
 
 
 const uint32_t WIDTH = 1600;
@@ -1754,22 +1758,38 @@ void debugAsyncFunc(void* v) {
     std::cout << "so true\n";
 }
 
-int main() {
-    render::Drawer* d = new render::Drawer();
+int main(int argc, char** argv) {
+    bool gpuCulling = false;
+    bool physicsReport = false;
+    for (int a = 1; a < argc; a++)
+    {
+        if (strcmp(argv[a], "--bench-snapshot") == 0) {
+            benchmarkPhysicsSnapshot(10000, 100);
+            return 0;
+        }
+        if (strcmp(argv[a], "--test-culling") == 0) return testGpuCulling() ? 0 : 1;
+        if (strcmp(argv[a], "--gpu-culling") == 0) gpuCulling = true;
+        if (strcmp(argv[a], "--physics-memory") == 0) physicsReport = true;
+    }
+
     Threading* t = new Threading();
+    render::Drawer* d = new render::Drawer(t);
     Scene* s = new Scene{t, d};
+    s->gpuCulling = gpuCulling;
     Input* i = new Input(d->window);
 
     std::cout << "Finished initialization\n";
 
-    uint16_t modelIndex;
-    d->loadMesh("textures/debug.obj", &modelIndex);
+    render::UploadBatch loads(d);
+    /* Host geometry so static renderers of it can be batched */
+    uint16_t modelIndex = loads.addMesh("textures/debug.obj", 0, true);
+    loads.commit();
     std::cout << d->registeredMeshes[modelIndex].vBufferSize;
 
-    btBoxShape box({ 20, 0.5, 20 });
-    btBoxShape box2({ 1, 1, 1 });
-    btCapsuleShape player(1, 2);
-    btSphereShape ball(1);
+    btBoxShape* box = s->shapes->box({ 20, 0.5, 20 });
+    btBoxShape* box2 = s->shapes->box({ 1, 1, 1 });
+    btCapsuleShape* player = s->shapes->capsule(1, 2);
+    btSphereShape* ball = s->shapes->sphere(1);
 
     {
         btTransform origin({ 0, 0, 0, 1 }, { 0, 10, 0.5 });
@@ -1780,7 +1800,7 @@ int main() {
         scale[2][2] = 1;
         scale[3][3] = 1;*/
         btCustomMotionState* state = new btCustomMotionState{ origin, btTransform::getIdentity(), scale };
-        s->addRigidBody(btRigidBody::btRigidBodyConstructionInfo{ mass, state, &box2, {1, 1, 1} });
+        s->addRigidBody(btRigidBody::btRigidBodyConstructionInfo{ mass, state, box2, {1, 1, 1} });
         s->attachRenderer(Renderer(&(d->registeredMeshes[modelIndex]), 1, state));
     }
 
@@ -1793,8 +1813,8 @@ int main() {
         scale[2][2] = 50;
         scale[3][3] = 1;
         btCustomMotionState* state = new btCustomMotionState{ origin, btTransform::getIdentity(), scale };
-        s->addRigidBody(btRigidBody::btRigidBodyConstructionInfo{ mass, state, &box, {1, 1, 1} });
-        s->attachRenderer(Renderer(&(d->registeredMeshes[0]), 1, state));
+        s->addRigidBody(btRigidBody::btRigidBodyConstructionInfo{ mass, state, box, {1, 1, 1} });
+        s->attachRenderer(Renderer(&(d->registeredMeshes[0]), 1, state, true));
     }
 
     {
@@ -1807,8 +1827,8 @@ int main() {
         scale[3][3] = 1;
         //btDefaultMotionState* state = new btDefaultMotionState(origin);
         btCustomMotionState* state = new btCustomMotionState{ origin, btTransform::getIdentity(), scale };
-        s->addRigidBody(btRigidBody::btRigidBodyConstructionInfo{ mass, state, &box2, {1, 1, 1} });
-        s->attachRenderer(Renderer(&(d->registeredMeshes[modelIndex]), 1, state));
+        s->addRigidBody(btRigidBody::btRigidBodyConstructionInfo{ mass, state, box2, {1, 1, 1} });
+        s->attachRenderer(Renderer(&(d->registeredMeshes[modelIndex]), 1, state, true));
     }
 
     {
@@ -1820,8 +1840,8 @@ int main() {
         scale[2][2] = 1;
         scale[3][3] = 1;
         btCustomMotionState* state = new btCustomMotionState{ origin, btTransform::getIdentity(), scale };
-        s->addRigidBody(btRigidBody::btRigidBodyConstructionInfo{ mass, state, &box2, {1, 1, 1} });
-        s->attachRenderer(Renderer(&(d->registeredMeshes[modelIndex]), 1, state));
+        s->addRigidBody(btRigidBody::btRigidBodyConstructionInfo{ mass, state, box2, {1, 1, 1} });
+        s->attachRenderer(Renderer(&(d->registeredMeshes[modelIndex]), 1, state, true));
     }
 
     btRigidBody* playerRigid;
@@ -1835,10 +1855,24 @@ int main() {
         scale[2][2] = 1;
         scale[3][3] = 1;
         playerState = new btCustomMotionState{ origin, btTransform::getIdentity(), scale };
-        playerRigid = s->addRigidBody(btRigidBody::btRigidBodyConstructionInfo{ mass, playerState, &ball, {1, 1, 1} });
+        playerRigid = s->addRigidBody(btRigidBody::btRigidBodyConstructionInfo{ mass, playerState, ball, {1, 1, 1} });
         s->attachRenderer(Renderer(&(d->registeredMeshes[modelIndex]), 1, playerState));
     }
 
+    {
+        TerrainCreateInfo terrainInfo{};
+        terrainInfo.height = [](float x, float z) {
+            return -6.0f + 4.0f * std::sin(x * 0.013f) * std::cos(z * 0.011f) + 1.5f * std::sin(x * 0.051f + z * 0.037f);
+        };
+        s->attachTerrain(new Terrain(d, s, terrainInfo));
+    }
+
+    s->buildStaticBatches();
+    /* End of the level load, before the first frame */
+    d->defragmentMeshes();
+
+    if (physicsReport) physicsMemory::report(std::cout);
+
     //playerControl control{};
 
     Input::ControlMode c(nullptr, mouseLook, GLFW_RAW_MOUSE_MOTION);
@@ -1888,8 +1922,9 @@ int main() {
         */
     }
 
-    delete d;
+    /* The scene frees terrain buffers, so it has to go before the device */
     delete s;
+    delete d;
     delete t;
 
     //TODO: flush cout to log
@@ -0,0 +1,177 @@
+#include "memoryBudget.h"
+
+#include <algorithm>
+
+using namespace render;
+
+MemoryBudget::MemoryBudget(VkInstance instance, VkPhysicalDevice physicalDevice, GpuAllocator* allocator, bool extensionEnabled, uint32_t releaseFrames) {
+    this->physicalDevice = physicalDevice;
+    this->allocator = allocator;
+    this->releaseFrames = releaseFrames;
+
+    if (extensionEnabled) {
+        getMemoryProperties2 = (PFN_vkGetPhysicalDeviceMemoryProperties2KHR)vkGetInstanceProcAddr(instance, "vkGetPhysicalDeviceMemoryProperties2KHR");
+    }
+    std::cout << "Memory budget from " << (getMemoryProperties2 != nullptr ? "VK_EXT_memory_budget" : "own accounting") << "\n";
+
+    heaps.resize(allocator->heapCount());
+    std::lock_guard<std::mutex> guard(lock);
+    refresh();
+}
+
+bool MemoryBudget::usesExtension() const {
+    return getMemoryProperties2 != nullptr;
+}
+
+void MemoryBudget::refresh() {
+    if (getMemoryProperties2 != nullptr) {
+        VkPhysicalDeviceMemoryBudgetPropertiesEXT budgetProperties{};
+        budgetProperties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_BUDGET_PROPERTIES_EXT;
+
+        VkPhysicalDeviceMemoryProperties2KHR properties{};
+        properties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_PROPERTIES_2_KHR;
+        properties.pNext = &budgetProperties;
+        getMemoryProperties2(physicalDevice, &properties);
+
+        for (uint32_t i = 0; i < heaps.size(); i++)
+        {
+            heaps[i].budget = budgetProperties.heapBudget[i];
+            heaps[i].usage = budgetProperties.heapUsage[i];
+        }
+    }
+    else {
+        for (uint32_t i = 0; i < heaps.size(); i++)
+        {
+            heaps[i].budget = static_cast<VkDeviceSize>(allocator->heap(i).size * fallbackBudget);
+            heaps[i].usage = allocator->heapUsage(i);
+        }
+    }
+
+    for (uint32_t i = 0; i < heaps.size(); i++)
+    {
+        /* usedBytes includes the dedicated allocations, which have no free space */
+        HeapStats s = allocator->heapStats(i);
+        heaps[i].reusable = s.blockBytes - (s.usedBytes - s.dedicatedBytes);
+    }
+}
+
+VkDeviceSize MemoryBudget::pendingRelease(uint32_t heap) const {
+    VkDeviceSize r = 0;
+    for (size_t i = 0; i < releasing.size(); i++)
+    {
+        if (releasing[i].heap == heap) r += releasing[i].bytes;
+    }
+    return r;
+}
+
+VkDeviceSize MemoryBudget::committed(uint32_t heap) const {
+    VkDeviceSize freed = heaps[heap].reusable + pendingRelease(heap);
+    return heaps[heap].usage - std::min(heaps[heap].usage, freed);
+}
+
+void MemoryBudget::update(uint64_t frame) {
+    std::vector<std::function<void()>> victims;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        this->frame = frame;
+        refresh();
+
+        for (size_t i = 0; i < releasing.size();)
+        {
+            if (releasing[i].frame + releaseFrames <= frame) {
+                releasing[i] = releasing.back();
+                releasing.pop_back();
+            }
+            else {
+                i++;
+            }
+        }
+
+        for (uint32_t h = 0; h < heaps.size(); h++)
+        {
+            VkDeviceSize limit = static_cast<VkDeviceSize>(heaps[h].budget * evictThreshold);
+            VkDeviceSize usage = committed(h);
+            if (usage <= limit) continue;
+
+            std::vector<std::pair<uint64_t, uint64_t>> candidates;
+            for (auto it = streamables.begin(); it != streamables.end(); it++)
+            {
+                if (it->second.heap == h && it->second.lastUsed + 1 < frame) candidates.push_back({ it->second.lastUsed, it->first });
+            }
+            std::sort(candidates.begin(), candidates.end());
+
+            for (size_t i = 0; i < candidates.size() && usage > limit; i++)
+            {
+                Streamable& s = streamables[candidates[i].second];
+                usage -= std::min(usage, s.bytes);
+                releasing.push_back({ h, s.bytes, frame });
+                victims.push_back(std::move(s.evict));
+                streamables.erase(candidates[i].second);
+            }
+
+            if (usage > limit) {
+                std::cout << "Heap " << h << " over budget: " << usage / (1024 * 1024) << " MB of " << heaps[h].budget / (1024 * 1024) << " MB, nothing left to evict\n";
+            }
+        }
+        evicted += victims.size();
+    }
+
+    /* Evicting frees resources, which can take other locks, so it happens unlocked */
+    for (size_t i = 0; i < victims.size(); i++)
+    {
+        victims[i]();
+    }
+}
+
+HeapBudget MemoryBudget::heap(uint32_t heap) {
+    std::lock_guard<std::mutex> guard(lock);
+    return heaps[heap];
+}
+
+bool MemoryBudget::hasRoom(uint32_t heap, VkDeviceSize bytes) {
+    std::lock_guard<std::mutex> guard(lock);
+    return committed(heap) + bytes <= static_cast<VkDeviceSize>(heaps[heap].budget * evictThreshold);
+}
+
+uint64_t MemoryBudget::addStreamable(uint32_t heap, VkDeviceSize bytes, std::function<void()> evict) {
+    std::lock_guard<std::mutex> guard(lock);
+    uint64_t id = nextId++;
+    streamables[id] = { heap, bytes, frame, std::move(evict) };
+    return id;
+}
+
+void MemoryBudget::removeStreamable(uint64_t id) {
+    std::lock_guard<std::mutex> guard(lock);
+    streamables.erase(id);
+}
+
+void MemoryBudget::touch(uint64_t id) {
+    std::lock_guard<std::mutex> guard(lock);
+    auto it = streamables.find(id);
+    if (it != streamables.end()) it->second.lastUsed = frame;
+}
+
+VkDeviceSize MemoryBudget::streamableBytes(uint32_t heap) {
+    std::lock_guard<std::mutex> guard(lock);
+    VkDeviceSize r = 0;
+    for (auto it = streamables.begin(); it != streamables.end(); it++)
+    {
+        if (it->second.heap == heap) r += it->second.bytes;
+    }
+    return r;
+}
+
+uint64_t MemoryBudget::evictions() {
+    std::lock_guard<std::mutex> guard(lock);
+    return evicted;
+}
+
+void MemoryBudget::report(std::ostream& out) {
+    out << "GPU memory budget (" << (usesExtension() ? "VK_EXT_memory_budget" : "own accounting") << "), " << evictions() << " evictions:\n";
+    for (uint32_t i = 0; i < heaps.size(); i++)
+    {
+        HeapBudget b = heap(i);
+        out << "\theap " << i << ": " << b.usage / (1024 * 1024) << " MB of " << b.budget / (1024 * 1024) << " MB, "
+            << streamableBytes(i) / 1024 << " KB streamable\n";
+    }
+}
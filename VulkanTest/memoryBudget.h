@@ -0,0 +1,102 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "gpuMemory.h"
+
+namespace render
+{
+    struct HeapBudget {
+        /* How much the process can use before the OS starts paging or allocations fail */
+        VkDeviceSize budget;
+        VkDeviceSize usage;
+        /* Free space inside GpuAllocator's blocks. usage counts whole blocks, but new allocations reuse this first */
+        VkDeviceSize reusable;
+    };
+
+    /*
+     * Keeps every heap under its budget.
+     * With VK_EXT_memory_budget the driver reports both numbers, which include memory other code in the process allocated.
+     * Without it usage is GpuAllocator's own accounting and the budget a fixed share of the heap.
+     *
+     * Streamable resources (terrain chunks, anything that can be loaded again later) register with an evict callback
+     * and get touched whenever they're used. When a heap goes over budget the least recently used ones are evicted.
+     * Evicted memory goes through the DeletionQueue, so it is counted as released straight away to avoid evicting twice for the same bytes.
+     * Freeing a suballocation doesn't give its block back, so the budget is checked against usage less the free space in the blocks,
+     * which is what an eviction actually lowers.
+     */
+    class MemoryBudget {
+    public:
+        /* Share of the heap budget update evicts down to */
+        static constexpr float evictThreshold = 0.9f;
+        /* Share of the heap size used as the budget without the extension, what Windows lets a process keep resident */
+        static constexpr float fallbackBudget = 0.8f;
+
+        /* extensionEnabled when VK_EXT_memory_budget and VK_KHR_get_physical_device_properties2 are both on.
+         * releaseFrames is how many updates it takes the deletion queue to really free evicted memory.
+         */
+        MemoryBudget(VkInstance instance, VkPhysicalDevice physicalDevice, GpuAllocator* allocator, bool extensionEnabled, uint32_t releaseFrames);
+
+        /* Once per frame from the render thread, refreshes the budgets and evicts until every heap is under evictThreshold.
+         * Resources touched this frame or the one before are never evicted.
+         */
+        void update(uint64_t frame);
+
+        HeapBudget heap(uint32_t heap);
+        /* Whether bytes more fit the heap without pushing it past evictThreshold */
+        bool hasRoom(uint32_t heap, VkDeviceSize bytes);
+        bool usesExtension() const;
+
+        /* evict runs on the render thread during update, with the resource already unregistered. Returns an id for touch. */
+        uint64_t addStreamable(uint32_t heap, VkDeviceSize bytes, std::function<void()> evict);
+        void removeStreamable(uint64_t id);
+        void touch(uint64_t id);
+
+        VkDeviceSize streamableBytes(uint32_t heap);
+        uint64_t evictions();
+        void report(std::ostream& out);
+
+    private:
+        struct Streamable {
+            uint32_t heap;
+            VkDeviceSize bytes;
+            uint64_t lastUsed;
+            std::function<void()> evict;
+        };
+
+        struct Release {
+            uint32_t heap;
+            VkDeviceSize bytes;
+            uint64_t frame;
+        };
+
+        VkPhysicalDevice physicalDevice;
+        GpuAllocator* allocator;
+        PFN_vkGetPhysicalDeviceMemoryProperties2KHR getMemoryProperties2 = nullptr;
+        uint32_t releaseFrames;
+
+        /* Guards everything below */
+        std::mutex lock;
+
+        uint64_t frame = 0;
+        std::vector<HeapBudget> heaps;
+        uint64_t nextId = 1;
+        std::unordered_map<uint64_t, Streamable> streamables;
+        /* Evicted bytes the deletion queue hasn't freed yet */
+        std::vector<Release> releasing;
+        uint64_t evicted = 0;
+
+        /* Expect lock to be held */
+        void refresh();
+        VkDeviceSize pendingRelease(uint32_t heap) const;
+        /* usage without the blocks' free space and the pending releases */
+        VkDeviceSize committed(uint32_t heap) const;
+    };
+};
@@ -0,0 +1,235 @@
+#include "meshPool.h"
+
+#include <algorithm>
+#include <iterator>
+#include <stdexcept>
+
+using namespace render;
+
+MeshPool::MeshPool(GpuAllocator* allocator, VkBufferUsageFlags usage, VkDeviceSize elementSize, uint32_t blockElements, const char* name, const std::vector<uint32_t>& sharedFamilies) {
+    this->allocator = allocator;
+    this->usage = usage;
+    this->stride = elementSize;
+    this->blockElements = blockElements;
+    this->name = name;
+    this->sharedFamilies = sharedFamilies;
+}
+
+MeshPool::~MeshPool() {
+    for (size_t i = 0; i < blocks.size(); i++)
+    {
+        if (blocks[i] == nullptr) continue;
+        allocator->destroyBuffer(blocks[i]->buffer, blocks[i]->allocation);
+        delete blocks[i];
+    }
+}
+
+bool MeshPool::allocateFromBlock(uint32_t index, uint32_t count, PoolRange& range) {
+    Block* block = blocks[index];
+    for (auto it = block->freeRanges.begin(); it != block->freeRanges.end(); it++)
+    {
+        if (it->second < count) continue;
+
+        range.buffer = block->buffer;
+        range.block = index;
+        range.offset = it->first;
+        range.count = count;
+
+        uint32_t left = it->second - count;
+        uint32_t after = it->first + count;
+        block->freeRanges.erase(it);
+        if (left != 0) block->freeRanges[after] = left;
+        block->used += count;
+        return true;
+    }
+    return false;
+}
+
+PoolRange MeshPool::allocate(uint32_t count) {
+    PoolRange range{};
+    if (count == 0) return range;
+
+    std::lock_guard<std::mutex> guard(lock);
+    uint32_t empty = static_cast<uint32_t>(blocks.size());
+    for (uint32_t i = 0; i < blocks.size(); i++)
+    {
+        if (blocks[i] == nullptr) {
+            empty = std::min(empty, i);
+            continue;
+        }
+        if (blocks[i]->capacity - blocks[i]->used < count) continue;
+        if (allocateFromBlock(i, count, range)) return range;
+    }
+
+    Block* block = new Block{};
+    block->capacity = std::max(blockElements, count);
+    block->used = 0;
+    block->freeRanges[0] = block->capacity;
+    allocator->createBuffer(stride * block->capacity, usage, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, block->buffer, block->allocation, 0, MemoryCategory::Mesh, sharedFamilies);
+    if (empty == blocks.size()) blocks.push_back(block);
+    else blocks[empty] = block;
+
+    allocateFromBlock(empty, count, range);
+    return range;
+}
+
+void MeshPool::free(const PoolRange& range) {
+    if (range.count == 0) return;
+
+    std::lock_guard<std::mutex> guard(lock);
+    freeRange(range);
+}
+
+void MeshPool::freeRange(const PoolRange& range) {
+    Block* block = blocks[range.block];
+    block->used -= range.count;
+
+    uint32_t offset = range.offset;
+    uint32_t count = range.count;
+
+    auto next = block->freeRanges.lower_bound(offset);
+    if (next != block->freeRanges.end() && offset + count == next->first) {
+        count += next->second;
+        next = block->freeRanges.erase(next);
+    }
+    if (next != block->freeRanges.begin()) {
+        auto previous = std::prev(next);
+        if (previous->first + previous->second == offset) {
+            previous->second += count;
+            return;
+        }
+    }
+    block->freeRanges[offset] = count;
+}
+
+VkDeviceSize MeshPool::elementSize() const {
+    return stride;
+}
+
+void MeshPool::compact(const std::vector<PoolRange*>& ranges, std::vector<PoolMove>& moves) {
+    std::lock_guard<std::mutex> guard(lock);
+
+    /* Listed elements per block, a block holding anything else can't be emptied */
+    std::vector<std::vector<PoolRange*>> listed(blocks.size());
+    std::vector<uint32_t> listedCount(blocks.size());
+    for (size_t i = 0; i < ranges.size(); i++)
+    {
+        if (ranges[i]->count == 0) continue;
+        listed[ranges[i]->block].push_back(ranges[i]);
+        listedCount[ranges[i]->block] += ranges[i]->count;
+    }
+
+    std::vector<uint32_t> order;
+    for (uint32_t i = 0; i < blocks.size(); i++)
+    {
+        if (blocks[i] != nullptr) order.push_back(i);
+    }
+    std::sort(order.begin(), order.end(), [this](uint32_t a, uint32_t b) { return blocks[a]->used < blocks[b]->used; });
+
+    /* Emptiest first, into the fullest blocks that aren't being drained */
+    std::vector<bool> draining(blocks.size());
+    for (size_t i = 0; i + 1 < order.size(); i++)
+    {
+        uint32_t b = order[i];
+        if (listedCount[b] != blocks[b]->used) continue;
+        draining[b] = true;
+
+        size_t first = moves.size();
+        bool fits = true;
+        for (size_t j = 0; j < listed[b].size() && fits; j++)
+        {
+            PoolMove move{ *listed[b][j] };
+            fits = false;
+            for (size_t k = order.size(); k-- > i + 1 && !fits;)
+            {
+                uint32_t target = order[k];
+                if (draining[target] || blocks[target]->capacity - blocks[target]->used < move.from.count) continue;
+                fits = allocateFromBlock(target, move.from.count, move.to);
+            }
+            if (fits) moves.push_back(move);
+        }
+
+        if (!fits) {
+            /* Everything after would only fit even worse */
+            for (size_t j = first; j < moves.size(); j++)
+            {
+                freeRange(moves[j].to);
+            }
+            moves.resize(first);
+            break;
+        }
+    }
+
+    /* The listed ranges only learn their new place once the whole plan stands */
+    for (size_t i = 0; i < ranges.size(); i++)
+    {
+        PoolRange* range = ranges[i];
+        if (range->count == 0 || !draining[range->block]) continue;
+        for (size_t j = 0; j < moves.size(); j++)
+        {
+            if (moves[j].from.block == range->block && moves[j].from.offset == range->offset) {
+                *range = moves[j].to;
+                break;
+            }
+        }
+    }
+}
+
+void MeshPool::release(const std::vector<PoolMove>& moves) {
+    std::lock_guard<std::mutex> guard(lock);
+    for (size_t i = 0; i < moves.size(); i++)
+    {
+        freeRange(moves[i].from);
+    }
+    moved += moves.size();
+
+    for (size_t i = 0; i < blocks.size(); i++)
+    {
+        if (blocks[i] == nullptr || blocks[i]->used != 0) continue;
+        allocator->destroyBuffer(blocks[i]->buffer, blocks[i]->allocation);
+        delete blocks[i];
+        blocks[i] = nullptr;
+        released++;
+    }
+}
+
+bool MeshPool::fragmented() {
+    std::lock_guard<std::mutex> guard(lock);
+    Block* emptiest = nullptr;
+    uint64_t free = 0;
+    size_t live = 0;
+    for (size_t i = 0; i < blocks.size(); i++)
+    {
+        if (blocks[i] == nullptr) continue;
+        live++;
+        free += blocks[i]->capacity - blocks[i]->used;
+        if (emptiest == nullptr || blocks[i]->used < emptiest->used) emptiest = blocks[i];
+    }
+    if (live < 2) return false;
+    return free - (emptiest->capacity - emptiest->used) >= emptiest->used;
+}
+
+size_t MeshPool::blockCount() {
+    std::lock_guard<std::mutex> guard(lock);
+    size_t r = 0;
+    for (size_t i = 0; i < blocks.size(); i++)
+    {
+        if (blocks[i] != nullptr) r++;
+    }
+    return r;
+}
+
+void MeshPool::report(std::ostream& out) {
+    std::lock_guard<std::mutex> guard(lock);
+    size_t live = 0;
+    for (size_t i = 0; i < blocks.size(); i++)
+    {
+        if (blocks[i] != nullptr) live++;
+    }
+    out << name << " pool: " << live << " blocks, " << moved << " ranges moved and " << released << " blocks released by compaction\n";
+    for (size_t i = 0; i < blocks.size(); i++)
+    {
+        if (blocks[i] == nullptr) continue;
+        out << "\tblock " << i << ": " << blocks[i]->used << "/" << blocks[i]->capacity << " elements, " << blocks[i]->freeRanges.size() << " free ranges\n";
+    }
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+
+#include <cstdint>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <vector>
+
+#include "gpuMemory.h"
+
+namespace render
+{
+    /* A stretch of one of MeshPool's buffers, in elements. count is 0 for an empty range. */
+    struct PoolRange {
+        VkBuffer buffer = VK_NULL_HANDLE;
+        uint32_t block = 0;
+        uint32_t offset = 0;
+        uint32_t count = 0;
+    };
+
+    /* A range compact moved, from still holds the contents until the caller copies them to to */
+    struct PoolMove {
+        PoolRange from;
+        PoolRange to;
+    };
+
+    /*
+     * Vertices or indices of many meshes suballocated out of a few large device local buffers,
+     * so draws of different meshes bind the same buffers and can be merged into one indirect call.
+     * Ranges are counted in elements, which is what vertexOffset and firstIndex take.
+     *
+     * First fit over each block's free list, freed ranges merge with their neighbours.
+     * A range that fits no block gets a new one, blockElements or the range's size, whichever is bigger.
+     * Blocks are kept and reused by later meshes until compact empties them.
+     *
+     * The transfer queue writes new ranges while the graphics queue draws from the rest of the block, so the blocks are
+     * shared concurrently between sharedFamilies instead of changing owner with every upload, see StagingRing::uploadBuffer.
+     *
+     * Any thread.
+     */
+    class MeshPool {
+    public:
+        MeshPool(GpuAllocator* allocator, VkBufferUsageFlags usage, VkDeviceSize elementSize, uint32_t blockElements, const char* name, const std::vector<uint32_t>& sharedFamilies);
+        ~MeshPool();
+
+        PoolRange allocate(uint32_t count);
+        /* Right away, ranges frames in flight could still read go through DeletionQueue::poolRange */
+        void free(const PoolRange& range);
+
+        /* Defragmentation, see Drawer::defragmentMeshes. Moves ranges out of the emptiest blocks into free space in fuller ones,
+         * a block is only drained when every range in it is listed and all of them fit elsewhere. The listed ranges are updated in place,
+         * anything else the pool handed out stays where it is. Nothing is freed until release, after the caller copied every move.
+         */
+        void compact(const std::vector<PoolRange*>& ranges, std::vector<PoolMove>& moves);
+        /* Frees the old places of moves and destroys the blocks left empty, nothing may still read them */
+        void release(const std::vector<PoolMove>& moves);
+        /* Whether the emptiest block's elements would fit in the other blocks' free space, so compact could release it */
+        bool fragmented();
+
+        VkDeviceSize elementSize() const;
+        size_t blockCount();
+        void report(std::ostream& out);
+
+    private:
+        struct Block {
+            VkBuffer buffer;
+            Allocation allocation;
+            uint32_t capacity;
+            uint32_t used;
+            /* Offset to count */
+            std::map<uint32_t, uint32_t> freeRanges;
+        };
+
+        GpuAllocator* allocator;
+        VkBufferUsageFlags usage;
+        VkDeviceSize stride;
+        uint32_t blockElements;
+        const char* name;
+        std::vector<uint32_t> sharedFamilies;
+
+        std::mutex lock;
+        /* Null where compact released a block, the index is reused by the next new one */
+        std::vector<Block*> blocks;
+        uint64_t moved = 0;
+        uint64_t released = 0;
+
+        /* Expect lock to be held */
+        bool allocateFromBlock(uint32_t index, uint32_t count, PoolRange& range);
+        void freeRange(const PoolRange& range);
+    };
+};
@@ -0,0 +1,181 @@
+#include "physicsMemory.h"
+
+#include <atomic>
+#include <mutex>
+#include <new>
+#include <vector>
+
+#include "LinearMath/btAlignedAllocator.h"
+
+using namespace physicsMemory;
+
+/* Every block starts with a header directly in front of the returned pointer */
+struct BlockHeader {
+	uint32_t size;
+	uint16_t offset; // from the start of the raw allocation
+	uint8_t category;
+	uint8_t sizeClass;
+	uint64_t padding;
+};
+static_assert(sizeof(BlockHeader) == 16, "header has to keep 16 byte alignment");
+
+const uint8_t largeBlock = 0xFF;
+const size_t sizeClassCount = 6;
+const size_t sizeClassSlots[sizeClassCount] = { 32, 64, 128, 256, 512, 1024 };
+const size_t poolPageSize = 64 * 1024;
+
+/* Fixed size slots carved out of pages that live until exit, one lock per class so threads rarely meet */
+struct SizeClassPool {
+	std::mutex lock;
+	void* freeList = nullptr;
+	std::vector<void*> pages;
+
+	void* allocate(size_t slotSize) {
+		std::lock_guard<std::mutex> guard(lock);
+		if (freeList == nullptr) {
+			char* page = static_cast<char*>(::operator new(poolPageSize, std::align_val_t(16)));
+			pages.push_back(page);
+			for (size_t i = 0; i + slotSize <= poolPageSize; i += slotSize)
+			{
+				*reinterpret_cast<void**>(page + i) = freeList;
+				freeList = page + i;
+			}
+		}
+		void* slot = freeList;
+		freeList = *reinterpret_cast<void**>(slot);
+		return slot;
+	}
+
+	void free(void* slot) {
+		std::lock_guard<std::mutex> guard(lock);
+		*reinterpret_cast<void**>(slot) = freeList;
+		freeList = slot;
+	}
+};
+
+struct CategoryCounters {
+	std::atomic<size_t> bytes{ 0 };
+	std::atomic<size_t> peakBytes{ 0 };
+	std::atomic<size_t> allocations{ 0 };
+	std::atomic<size_t> totalAllocations{ 0 };
+};
+
+static SizeClassPool pools[sizeClassCount];
+static CategoryCounters counters[CATEGORY_COUNT];
+static thread_local Category currentCategory = CATEGORY_OTHER;
+
+inline void countAllocation(Category category, size_t size) {
+	CategoryCounters& c = counters[category];
+	size_t bytes = c.bytes.fetch_add(size) + size;
+	size_t peak = c.peakBytes.load();
+	while (bytes > peak && !c.peakBytes.compare_exchange_weak(peak, bytes)) {}
+	c.allocations++;
+	c.totalAllocations++;
+}
+
+inline void countFree(Category category, size_t size) {
+	counters[category].bytes -= size;
+	counters[category].allocations--;
+}
+
+static void* alignedAlloc(size_t size, int alignment) {
+	size_t align = alignment > 16 ? static_cast<size_t>(alignment) : 16;
+	Category category = currentCategory;
+
+	char* user = nullptr;
+	BlockHeader header{};
+	header.size = static_cast<uint32_t>(size);
+	header.category = category;
+
+	size_t slotSize = size + sizeof(BlockHeader);
+	size_t sizeClass = 0;
+	while (sizeClass < sizeClassCount && sizeClassSlots[sizeClass] < slotSize) sizeClass++;
+
+	if (align == 16 && sizeClass < sizeClassCount) {
+		char* slot = static_cast<char*>(pools[sizeClass].allocate(sizeClassSlots[sizeClass]));
+		user = slot + sizeof(BlockHeader);
+		header.offset = sizeof(BlockHeader);
+		header.sizeClass = static_cast<uint8_t>(sizeClass);
+	}
+	else {
+		char* raw = static_cast<char*>(::operator new(size + sizeof(BlockHeader) + align, std::align_val_t(16)));
+		size_t address = reinterpret_cast<size_t>(raw + sizeof(BlockHeader));
+		user = reinterpret_cast<char*>((address + align - 1) & ~(align - 1));
+		header.offset = static_cast<uint16_t>(user - raw);
+		header.sizeClass = largeBlock;
+	}
+
+	*reinterpret_cast<BlockHeader*>(user - sizeof(BlockHeader)) = header;
+	countAllocation(category, size);
+	return user;
+}
+
+static void alignedFree(void* memblock) {
+	if (memblock == nullptr) return;
+
+	char* user = static_cast<char*>(memblock);
+	BlockHeader header = *reinterpret_cast<BlockHeader*>(user - sizeof(BlockHeader));
+	countFree(static_cast<Category>(header.category), header.size);
+
+	if (header.sizeClass == largeBlock) {
+		::operator delete(user - header.offset, std::align_val_t(16));
+	}
+	else {
+		pools[header.sizeClass].free(user - header.offset);
+	}
+}
+
+static void* unalignedAlloc(size_t size) {
+	return alignedAlloc(size, 16);
+}
+
+static void unalignedFree(void* memblock) {
+	alignedFree(memblock);
+}
+
+void physicsMemory::install() {
+	static bool installed = false;
+	if (installed) return;
+	installed = true;
+
+	btAlignedAllocSetCustom(unalignedAlloc, unalignedFree);
+	btAlignedAllocSetCustomAligned(alignedAlloc, alignedFree);
+}
+
+CategoryStats physicsMemory::stats(Category category) {
+	CategoryStats r{};
+	r.bytes = counters[category].bytes;
+	r.peakBytes = counters[category].peakBytes;
+	r.allocations = counters[category].allocations;
+	r.totalAllocations = counters[category].totalAllocations;
+	return r;
+}
+
+const char* physicsMemory::categoryName(Category category) {
+	switch (category) {
+	case CATEGORY_SHAPES: return "shapes";
+	case CATEGORY_BODIES: return "bodies";
+	case CATEGORY_MANIFOLDS: return "manifolds";
+	case CATEGORY_BROADPHASE: return "broadphase";
+	case CATEGORY_SOLVER: return "solver";
+	default: return "other";
+	}
+}
+
+void physicsMemory::report(std::ostream& out) {
+	out << "Physics memory:\n";
+	for (int i = 0; i < CATEGORY_COUNT; i++)
+	{
+		CategoryStats s = stats(static_cast<Category>(i));
+		out << '\t' << categoryName(static_cast<Category>(i)) << ": " << s.bytes << " bytes in " << s.allocations << " blocks (peak " << s.peakBytes << ", " << s.totalAllocations << " allocations total)\n";
+	}
+}
+
+Scope::Scope(Category category) {
+	previous = currentCategory;
+	currentCategory = category;
+}
+
+Scope::~Scope() {
+	currentCategory = previous;
+}
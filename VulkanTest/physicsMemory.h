@@ -0,0 +1,45 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+
+/*
+ * Allocation hooks for Bullet.
+ * Small blocks come from size class pools, everything is counted per category.
+ * The category is picked by the innermost Scope on the allocating thread.
+ */
+namespace physicsMemory {
+	enum Category : uint8_t {
+		CATEGORY_OTHER,
+		CATEGORY_SHAPES,
+		CATEGORY_BODIES,
+		CATEGORY_MANIFOLDS,
+		CATEGORY_BROADPHASE,
+		CATEGORY_SOLVER,
+		CATEGORY_COUNT
+	};
+
+	struct CategoryStats {
+		size_t bytes;
+		size_t peakBytes;
+		size_t allocations;
+		size_t totalAllocations;
+	};
+
+	/* Has to run before Bullet allocates anything, blocks from the default allocator can't be freed through the hooks */
+	void install();
+
+	CategoryStats stats(Category category);
+	const char* categoryName(Category category);
+	void report(std::ostream& out);
+
+	class Scope {
+	public:
+		Scope(Category category);
+		~Scope();
+
+	private:
+		Category previous;
+	};
+}
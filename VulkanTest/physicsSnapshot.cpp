@@ -0,0 +1,337 @@
+#include "physicsSnapshot.h"
+
+#include <chrono>
+#include <iostream>
+#include <stdexcept>
+
+PhysicsSnapshot::PhysicsSnapshot(btDiscreteDynamicsWorld* world, uint32_t frameCount, uint32_t maxBodies, uint32_t maxManifolds, bool captureContacts) {
+	if (frameCount == 0) {
+		throw std::runtime_error("Snapshot ring needs at least one frame");
+	}
+
+	this->world = world;
+	this->frameCount = frameCount;
+	this->maxBodies = maxBodies;
+	this->maxManifolds = captureContacts ? maxManifolds : 0;
+	this->captureContacts = captureContacts;
+
+	slots.resize(frameCount);
+	bodies.resize(static_cast<size_t>(frameCount) * maxBodies);
+	manifolds.resize(static_cast<size_t>(frameCount) * this->maxManifolds);
+	invalidate();
+
+	const btCollisionObjectArray& objects = world->getCollisionObjectArray();
+	for (int i = 0; i < objects.size(); i++)
+	{
+		track(objects[i]);
+	}
+}
+
+void PhysicsSnapshot::track(btCollisionObject* object) {
+	if (object->isStaticObject() || handles.count(object) != 0) return;
+
+	uint32_t handle;
+	if (!freeHandles.empty()) {
+		handle = freeHandles.back();
+		freeHandles.pop_back();
+	}
+	else {
+		if (tracked.size() == maxBodies) {
+			throw std::runtime_error("World has more bodies than the snapshot ring was sized for");
+		}
+		handle = static_cast<uint32_t>(tracked.size());
+		tracked.push_back(nullptr);
+		generations.push_back(0);
+	}
+	tracked[handle] = object;
+	generations[handle]++;
+	handles[object] = handle;
+}
+
+void PhysicsSnapshot::untrack(btCollisionObject* object) {
+	auto it = handles.find(object);
+	if (it == handles.end()) return;
+
+	tracked[it->second] = nullptr;
+	freeHandles.push_back(it->second);
+	handles.erase(it);
+	removals++;
+}
+
+size_t PhysicsSnapshot::BodyPairHash::operator()(const std::pair<const btCollisionObject*, const btCollisionObject*>& p) const {
+	return std::hash<const void*>()(p.first) ^ (std::hash<const void*>()(p.second) * 31);
+}
+
+void PhysicsSnapshot::invalidate() {
+	for (size_t i = 0; i < slots.size(); i++)
+	{
+		slots[i].valid = false;
+	}
+}
+
+bool PhysicsSnapshot::has(uint32_t frame) const {
+	const Slot& slot = slots[frame % frameCount];
+	return slot.valid && slot.frame == frame;
+}
+
+size_t PhysicsSnapshot::slotSize() const {
+	return maxBodies * sizeof(BodyState) + maxManifolds * sizeof(ManifoldState);
+}
+
+void PhysicsSnapshot::save(uint32_t frame) {
+	uint32_t index = frame % frameCount;
+	Slot& slot = slots[index];
+	slot.frame = frame;
+	slot.bodyCount = static_cast<uint32_t>(tracked.size());
+	slot.removals = removals;
+
+	BodyState* out = &bodies[static_cast<size_t>(index) * maxBodies];
+	for (uint32_t i = 0; i < slot.bodyCount; i++)
+	{
+		const btCollisionObject* object = tracked[i];
+		BodyState& state = out[i];
+		if (object == nullptr) {
+			state.generation = 0;
+			continue;
+		}
+		state.generation = generations[i];
+		state.worldTransform = object->getWorldTransform();
+		state.interpolationWorldTransform = object->getInterpolationWorldTransform();
+		state.interpolationLinearVelocity = object->getInterpolationLinearVelocity();
+		state.interpolationAngularVelocity = object->getInterpolationAngularVelocity();
+		state.deactivationTime = object->getDeactivationTime();
+		state.hitFraction = object->getHitFraction();
+		state.activationState = object->getActivationState();
+		state.islandTag = object->getIslandTag();
+
+		if (const btRigidBody* body = btRigidBody::upcast(object)) {
+			state.linearVelocity = body->getLinearVelocity();
+			state.angularVelocity = body->getAngularVelocity();
+			state.totalForce = body->getTotalForce();
+			state.totalTorque = body->getTotalTorque();
+		}
+		else {
+			state.linearVelocity.setZero();
+			state.angularVelocity.setZero();
+			state.totalForce.setZero();
+			state.totalTorque.setZero();
+		}
+	}
+
+	slot.solverSeed = 0;
+	if (world->getConstraintSolver()->getSolverType() == BT_SEQUENTIAL_IMPULSE_SOLVER) {
+		slot.solverSeed = static_cast<btSequentialImpulseConstraintSolver*>(world->getConstraintSolver())->getRandSeed();
+	}
+
+	slot.manifoldCount = 0;
+	if (captureContacts) {
+		saveContacts(slot, &manifolds[static_cast<size_t>(index) * maxManifolds]);
+	}
+
+	slot.valid = true;
+}
+
+bool PhysicsSnapshot::restore(uint32_t frame) {
+	if (!has(frame)) return false;
+
+	uint32_t index = frame % frameCount;
+	const Slot& slot = slots[index];
+
+	/* Plain field writes, the motion state and broadphase are the only calls that do work */
+	const BodyState* in = &bodies[static_cast<size_t>(index) * maxBodies];
+	for (uint32_t i = 0; i < slot.bodyCount; i++)
+	{
+		btCollisionObject* object = tracked[i];
+		const BodyState& state = in[i];
+		if (object == nullptr || state.generation != generations[i]) continue;
+		object->setWorldTransform(state.worldTransform);
+		object->setInterpolationWorldTransform(state.interpolationWorldTransform);
+		object->setInterpolationLinearVelocity(state.interpolationLinearVelocity);
+		object->setInterpolationAngularVelocity(state.interpolationAngularVelocity);
+		object->setDeactivationTime(state.deactivationTime);
+		object->setHitFraction(state.hitFraction);
+		object->forceActivationState(state.activationState);
+		object->setIslandTag(state.islandTag);
+
+		if (btRigidBody* body = btRigidBody::upcast(object)) {
+			body->setLinearVelocity(state.linearVelocity);
+			body->setAngularVelocity(state.angularVelocity);
+			/* The saved totals already have the linear and angular factors applied, reapplying them is a no-op for the usual 0/1 factors.
+			 * Between steps they are almost always zero.
+			 */
+			body->clearForces();
+			if (!state.totalForce.isZero()) body->applyCentralForce(state.totalForce);
+			if (!state.totalTorque.isZero()) body->applyTorque(state.totalTorque);
+
+			if (body->getMotionState() != nullptr) {
+				body->getMotionState()->setWorldTransform(state.interpolationWorldTransform);
+			}
+		}
+	}
+
+	if (world->getConstraintSolver()->getSolverType() == BT_SEQUENTIAL_IMPULSE_SOLVER) {
+		static_cast<btSequentialImpulseConstraintSolver*>(world->getConstraintSolver())->setRandSeed(slot.solverSeed);
+	}
+
+	if (captureContacts && slot.removals == removals) {
+		restoreContacts(slot, &manifolds[static_cast<size_t>(index) * maxManifolds]);
+	}
+
+	/* The broadphase still has the bounds from before the rewind. Static bodies didn't move, so unlike updateAabbs this skips them. */
+	for (uint32_t i = 0; i < slot.bodyCount; i++)
+	{
+		if (tracked[i] != nullptr && in[i].generation == generations[i]) world->updateSingleAabb(tracked[i]);
+	}
+
+	/* Anything saved after this frame describes a future that is about to be replaced */
+	for (size_t i = 0; i < slots.size(); i++)
+	{
+		if (slots[i].valid && slots[i].frame > frame) slots[i].valid = false;
+	}
+	return true;
+}
+
+void PhysicsSnapshot::saveContacts(Slot& slot, ManifoldState* out) {
+	btDispatcher* dispatcher = world->getDispatcher();
+	int count = dispatcher->getNumManifolds();
+	if (static_cast<uint32_t>(count) > maxManifolds) {
+		std::cout << "Snapshot dropped " << count - maxManifolds << " contact manifolds, raise maxManifolds\n";
+		count = static_cast<int>(maxManifolds);
+	}
+
+	for (int i = 0; i < count; i++)
+	{
+		const btPersistentManifold* manifold = dispatcher->getManifoldByIndexInternal(i);
+		ManifoldState& state = out[i];
+		state.body0 = manifold->getBody0();
+		state.body1 = manifold->getBody1();
+		state.index = i;
+		state.numPoints = manifold->getNumContacts();
+		for (int j = 0; j < state.numPoints; j++)
+		{
+			state.points[j] = manifold->getContactPoint(j);
+		}
+	}
+	slot.manifoldCount = static_cast<uint32_t>(count);
+}
+
+/* Manifolds are owned by the dispatcher and created by the broadphase, so they aren't recreated here.
+ * Every live manifold is emptied, the ones that still exist for a saved pair get their points back and the rest refill on the next step.
+ */
+void PhysicsSnapshot::restoreContacts(const Slot& slot, const ManifoldState* in) {
+	btDispatcher* dispatcher = world->getDispatcher();
+	int count = dispatcher->getNumManifolds();
+	for (int i = 0; i < count; i++)
+	{
+		dispatcher->getManifoldByIndexInternal(i)->clearManifold();
+	}
+
+	bool lookupBuilt = false;
+	for (uint32_t i = 0; i < slot.manifoldCount; i++)
+	{
+		const ManifoldState& state = in[i];
+
+		/* Usually nothing was added or removed in between and the manifold is still at its old index */
+		btPersistentManifold* manifold = nullptr;
+		if (state.index < count) {
+			btPersistentManifold* candidate = dispatcher->getManifoldByIndexInternal(state.index);
+			if (candidate->getBody0() == state.body0 && candidate->getBody1() == state.body1) {
+				manifold = candidate;
+			}
+		}
+
+		if (manifold == nullptr) {
+			if (!lookupBuilt) {
+				manifoldLookup.clear();
+				for (int j = 0; j < count; j++)
+				{
+					btPersistentManifold* m = dispatcher->getManifoldByIndexInternal(j);
+					manifoldLookup[{ m->getBody0(), m->getBody1() }] = m;
+				}
+				lookupBuilt = true;
+			}
+			auto it = manifoldLookup.find({ state.body0, state.body1 });
+			if (it == manifoldLookup.end()) continue;
+			manifold = it->second;
+		}
+
+		for (int j = 0; j < state.numPoints; j++)
+		{
+			btManifoldPoint point = state.points[j];
+			point.m_userPersistentData = nullptr;
+			manifold->addManifoldPoint(point);
+		}
+	}
+}
+
+void benchmarkPhysicsSnapshot(uint32_t bodyCount, uint32_t iterations) {
+	btDefaultCollisionConfiguration config;
+	btCollisionDispatcher dispatcher(&config);
+	btDbvtBroadphase broadphase;
+	btSequentialImpulseConstraintSolver solver;
+	btDiscreteDynamicsWorld world(&dispatcher, &broadphase, &solver, &config);
+	world.setGravity({ 0, -10, 0 });
+
+	btStaticPlaneShape ground({ 0, 1, 0 }, 0);
+	btSphereShape sphere(0.5);
+	btVector3 inertia;
+	sphere.calculateLocalInertia(1, inertia);
+
+	btRigidBody groundBody(btRigidBody::btRigidBodyConstructionInfo(0, nullptr, &ground));
+	world.addRigidBody(&groundBody);
+
+	/* A loose grid, the spheres settle on the plane so there are contacts to capture */
+	std::vector<btRigidBody*> spheres;
+	uint32_t side = 1;
+	while (side * side < bodyCount) side++;
+	for (uint32_t i = 0; i < bodyCount; i++)
+	{
+		btRigidBody::btRigidBodyConstructionInfo info(1, nullptr, &sphere, inertia);
+		info.m_startWorldTransform.setIdentity();
+		info.m_startWorldTransform.setOrigin({ static_cast<btScalar>(i % side) * 1.5f, 0.5f, static_cast<btScalar>(i / side) * 1.5f });
+		btRigidBody* body = new btRigidBody(info);
+		world.addRigidBody(body);
+		spheres.push_back(body);
+	}
+
+	for (int i = 0; i < 10; i++)
+	{
+		world.stepSimulation(1.0f / 60, 1, 1.0f / 60);
+	}
+
+	const uint32_t frames = 8;
+	uint32_t manifoldCount = static_cast<uint32_t>(dispatcher.getNumManifolds());
+	PhysicsSnapshot bodiesOnly(&world, frames, bodyCount + 1);
+	PhysicsSnapshot withContacts(&world, frames, bodyCount + 1, manifoldCount, true);
+
+	/* Restores are timed on their own, each one needs a fresh save since restoring drops the newer frames */
+	auto time = [iterations](PhysicsSnapshot& snapshot, bool restore) {
+		std::chrono::duration<double, std::micro> total{};
+		for (uint32_t i = 0; i < iterations; i++)
+		{
+			if (restore) snapshot.save(0);
+			auto start = std::chrono::high_resolution_clock::now();
+			if (restore) {
+				snapshot.restore(0);
+			}
+			else {
+				snapshot.save(i);
+			}
+			total += std::chrono::high_resolution_clock::now() - start;
+		}
+		return total.count() / iterations;
+	};
+
+	std::cout << "Snapshot benchmark, " << bodyCount << " bodies, " << manifoldCount << " manifolds\n";
+	std::cout << "\tsave: " << time(bodiesOnly, false) << " us, slot " << bodiesOnly.slotSize() / 1024 << " KB\n";
+	std::cout << "\tsave with contacts: " << time(withContacts, false) << " us, slot " << withContacts.slotSize() / 1024 << " KB\n";
+	std::cout << "\trestore: " << time(bodiesOnly, true) << " us\n";
+	std::cout << "\trestore with contacts: " << time(withContacts, true) << " us\n";
+
+	for (size_t i = 0; i < spheres.size(); i++)
+	{
+		world.removeRigidBody(spheres[i]);
+		delete spheres[i];
+	}
+	world.removeRigidBody(&groundBody);
+}
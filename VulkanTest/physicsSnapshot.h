@@ -0,0 +1,103 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <unordered_map>
+#include "btBulletDynamicsCommon.h"
+#include "btBulletCollisionCommon.h"
+
+/*
+ * Ring buffer of world states for rollback and replays.
+ * Every slot is allocated up front, saving and restoring only copies into and out of it.
+ * Only bodies that can move are saved. Each gets a handle when tracked, its column in every slot, so adding and removing bodies
+ * keeps the saved frames: a restore skips bodies added after the save, and bodies removed since stay removed.
+ */
+class PhysicsSnapshot {
+public:
+	/* frameCount is how far back a restore can reach, maxBodies and maxManifolds size every slot.
+	 * With captureContacts the contact points are saved too, so the solver restarts warm after a restore.
+	 */
+	PhysicsSnapshot(btDiscreteDynamicsWorld* world, uint32_t frameCount, uint32_t maxBodies, uint32_t maxManifolds = 0, bool captureContacts = false);
+
+	/* The world's bodies are tracked on construction, later ones have to be tracked as they are added and untracked before they are deleted.
+	 * Static bodies are ignored.
+	 */
+	void track(btCollisionObject* object);
+	void untrack(btCollisionObject* object);
+
+	void save(uint32_t frame);
+	/* False when the frame was never saved or has been overwritten since */
+	bool restore(uint32_t frame);
+	bool has(uint32_t frame) const;
+	void invalidate();
+
+	size_t slotSize() const;
+
+private:
+	struct BodyState {
+		btTransform worldTransform;
+		btTransform interpolationWorldTransform;
+		btVector3 linearVelocity;
+		btVector3 angularVelocity;
+		btVector3 interpolationLinearVelocity;
+		btVector3 interpolationAngularVelocity;
+		btVector3 totalForce;
+		btVector3 totalTorque;
+		btScalar deactivationTime;
+		btScalar hitFraction;
+		int activationState;
+		int islandTag;
+		/* Of the handle when saved, 0 when it was free */
+		uint32_t generation;
+	};
+
+	struct ManifoldState {
+		const btCollisionObject* body0;
+		const btCollisionObject* body1;
+		int index;
+		int numPoints;
+		btManifoldPoint points[MANIFOLD_CACHE_SIZE];
+	};
+
+	struct Slot {
+		uint32_t frame;
+		bool valid;
+		/* Handles in use when saved */
+		uint32_t bodyCount;
+		uint32_t manifoldCount;
+		/* The saved contacts can name bodies deleted since, they are only restored while this matches */
+		uint32_t removals;
+		unsigned long solverSeed;
+	};
+
+	struct BodyPairHash {
+		size_t operator()(const std::pair<const btCollisionObject*, const btCollisionObject*>& p) const;
+	};
+
+	btDiscreteDynamicsWorld* world;
+	uint32_t frameCount;
+	uint32_t maxBodies;
+	uint32_t maxManifolds;
+	bool captureContacts;
+
+	std::vector<Slot> slots;
+	/* maxBodies per slot, indexed by handle */
+	std::vector<BodyState> bodies;
+
+	/* Indexed by handle, null for free handles */
+	std::vector<btCollisionObject*> tracked;
+	std::vector<uint32_t> generations;
+	std::vector<uint32_t> freeHandles;
+	std::unordered_map<const btCollisionObject*, uint32_t> handles;
+	uint32_t removals = 0;
+	std::vector<ManifoldState> manifolds;
+
+	/* Only built when a manifold moved in the dispatcher's array since the save */
+	std::unordered_map<std::pair<const btCollisionObject*, const btCollisionObject*>, btPersistentManifold*, BodyPairHash> manifoldLookup;
+
+	void saveContacts(Slot& slot, ManifoldState* out);
+	void restoreContacts(const Slot& slot, const ManifoldState* in);
+};
+
+/* Times save and restore for a world of bodyCount resting spheres and prints the result */
+void benchmarkPhysicsSnapshot(uint32_t bodyCount, uint32_t iterations);
@@ -0,0 +1,304 @@
+#include "pipelineRegistry.h"
+
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+
+using namespace render;
+
+/* FNV-1a */
+static uint64_t hashBytes(const void* data, size_t size) {
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < size; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+static uint64_t floatBits(float value) {
+    uint32_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+void PipelineKey::add(uint64_t value) {
+    words.push_back(value);
+}
+
+void PipelineKey::add(const std::vector<char>& code) {
+    add(code.size());
+    add(hashBytes(code.data(), code.size()));
+}
+
+void PipelineKey::add(const VkPipelineVertexInputStateCreateInfo& info) {
+    add(info.vertexBindingDescriptionCount);
+    for (uint32_t i = 0; i < info.vertexBindingDescriptionCount; i++)
+    {
+        const VkVertexInputBindingDescription& b = info.pVertexBindingDescriptions[i];
+        add(b.binding);
+        add(b.stride);
+        add(b.inputRate);
+    }
+    add(info.vertexAttributeDescriptionCount);
+    for (uint32_t i = 0; i < info.vertexAttributeDescriptionCount; i++)
+    {
+        const VkVertexInputAttributeDescription& a = info.pVertexAttributeDescriptions[i];
+        add(a.location);
+        add(a.binding);
+        add(a.format);
+        add(a.offset);
+    }
+}
+
+void PipelineKey::add(const VkPipelineInputAssemblyStateCreateInfo& info) {
+    add(info.topology);
+    add(info.primitiveRestartEnable);
+}
+
+void PipelineKey::add(const VkPipelineRasterizationStateCreateInfo& info) {
+    add(info.depthClampEnable);
+    add(info.rasterizerDiscardEnable);
+    add(info.polygonMode);
+    add(info.cullMode);
+    add(info.frontFace);
+    add(info.depthBiasEnable);
+    add(floatBits(info.depthBiasConstantFactor));
+    add(floatBits(info.depthBiasClamp));
+    add(floatBits(info.depthBiasSlopeFactor));
+    add(floatBits(info.lineWidth));
+}
+
+void PipelineKey::add(const VkPipelineMultisampleStateCreateInfo& info) {
+    add(info.rasterizationSamples);
+    add(info.sampleShadingEnable);
+    add(floatBits(info.minSampleShading));
+    add(info.pSampleMask != nullptr ? info.pSampleMask[0] : ~0ull);
+    add(info.alphaToCoverageEnable);
+    add(info.alphaToOneEnable);
+}
+
+void PipelineKey::add(const VkPipelineDepthStencilStateCreateInfo& info) {
+    add(info.depthTestEnable);
+    add(info.depthWriteEnable);
+    add(info.depthCompareOp);
+    add(info.depthBoundsTestEnable);
+    add(info.stencilTestEnable);
+    const VkStencilOpState* faces[] = { &info.front, &info.back };
+    for (size_t i = 0; i < 2; i++)
+    {
+        add(faces[i]->failOp);
+        add(faces[i]->passOp);
+        add(faces[i]->depthFailOp);
+        add(faces[i]->compareOp);
+        add(faces[i]->compareMask);
+        add(faces[i]->writeMask);
+        add(faces[i]->reference);
+    }
+    add(floatBits(info.minDepthBounds));
+    add(floatBits(info.maxDepthBounds));
+}
+
+void PipelineKey::add(const VkPipelineColorBlendStateCreateInfo& info) {
+    add(info.logicOpEnable);
+    add(info.logicOp);
+    add(info.attachmentCount);
+    for (uint32_t i = 0; i < info.attachmentCount; i++)
+    {
+        const VkPipelineColorBlendAttachmentState& a = info.pAttachments[i];
+        add(a.blendEnable);
+        add(a.srcColorBlendFactor);
+        add(a.dstColorBlendFactor);
+        add(a.colorBlendOp);
+        add(a.srcAlphaBlendFactor);
+        add(a.dstAlphaBlendFactor);
+        add(a.alphaBlendOp);
+        add(a.colorWriteMask);
+    }
+    for (size_t i = 0; i < 4; i++)
+    {
+        add(floatBits(info.blendConstants[i]));
+    }
+}
+
+void PipelineKey::add(const VkPipelineDynamicStateCreateInfo& info) {
+    add(info.dynamicStateCount);
+    for (uint32_t i = 0; i < info.dynamicStateCount; i++)
+    {
+        add(info.pDynamicStates[i]);
+    }
+}
+
+void PipelineKey::add(const VkSpecializationInfo& info) {
+    add(info.mapEntryCount);
+    for (uint32_t i = 0; i < info.mapEntryCount; i++)
+    {
+        add(info.pMapEntries[i].constantID);
+        add(info.pMapEntries[i].offset);
+        add(info.pMapEntries[i].size);
+    }
+    add(info.dataSize);
+    add(hashBytes(info.pData, info.dataSize));
+}
+
+uint64_t PipelineKey::hash() const {
+    return hashBytes(words.data(), words.size() * sizeof(uint64_t));
+}
+
+bool PipelineKey::operator==(const PipelineKey& other) const {
+    return words == other.words;
+}
+
+PipelineRegistry::PipelineRegistry(VkDevice device, VkPhysicalDevice physicalDevice, const char* cachePath) {
+    this->device = device;
+    this->path = cachePath;
+    vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+
+    std::vector<char> data;
+    std::ifstream file(path, std::ios::ate | std::ios::binary);
+    if (file.is_open()) {
+        data.resize(static_cast<size_t>(file.tellg()));
+        file.seekg(0);
+        file.read(data.data(), data.size());
+        file.close();
+    }
+
+    /* A cache from another driver or GPU is dropped rather than handed to the driver */
+    if (!data.empty() && !validHeader(data)) {
+        std::cout << "Pipeline cache " << path << " is from another device, starting empty\n";
+        data.clear();
+    }
+    loadedBytes = data.size();
+
+    VkPipelineCacheCreateInfo cacheInfo{};
+    cacheInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+    cacheInfo.initialDataSize = data.size();
+    cacheInfo.pInitialData = data.empty() ? nullptr : data.data();
+
+    if (vkCreatePipelineCache(device, &cacheInfo, nullptr, &pipelineCache) != VK_SUCCESS) {
+        throw std::runtime_error("Error creating pipeline cache");
+    }
+}
+
+PipelineRegistry::~PipelineRegistry() {
+    save();
+    for (auto& entry : pipelines)
+    {
+        vkDestroyPipeline(device, entry.second, nullptr);
+    }
+    for (auto& entry : layouts)
+    {
+        vkDestroyPipelineLayout(device, entry.second, nullptr);
+    }
+    vkDestroyPipelineCache(device, pipelineCache, nullptr);
+}
+
+bool PipelineRegistry::validHeader(const std::vector<char>& data) const {
+    /* VkPipelineCacheHeaderVersionOne: length, version, vendorID, deviceID, pipelineCacheUUID */
+    const size_t headerSize = 16 + VK_UUID_SIZE;
+    if (data.size() < headerSize) return false;
+
+    uint32_t header[4];
+    std::memcpy(header, data.data(), sizeof(header));
+    if (header[0] < headerSize || header[1] != VK_PIPELINE_CACHE_HEADER_VERSION_ONE) return false;
+    if (header[2] != properties.vendorID || header[3] != properties.deviceID) return false;
+    return std::memcmp(data.data() + 16, properties.pipelineCacheUUID, VK_UUID_SIZE) == 0;
+}
+
+VkPipelineCache PipelineRegistry::cache() const {
+    return pipelineCache;
+}
+
+VkPipelineLayout PipelineRegistry::layout(const std::vector<VkDescriptorSetLayout>& setLayouts) {
+    PipelineKey key;
+    for (size_t i = 0; i < setLayouts.size(); i++)
+    {
+        key.addHandle(setLayouts[i]);
+    }
+
+    std::lock_guard<std::mutex> guard(lock);
+    auto found = layouts.find(key);
+    if (found != layouts.end()) return found->second;
+
+    VkPipelineLayoutCreateInfo layoutInfo{};
+    layoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    layoutInfo.setLayoutCount = static_cast<uint32_t>(setLayouts.size());
+    layoutInfo.pSetLayouts = setLayouts.data();
+
+    VkPipelineLayout layout;
+    if (vkCreatePipelineLayout(device, &layoutInfo, nullptr, &layout) != VK_SUCCESS) {
+        throw std::runtime_error("Error creating pipeline layout");
+    }
+    layouts[key] = layout;
+    return layout;
+}
+
+VkPipeline PipelineRegistry::find(const PipelineKey& key) {
+    std::lock_guard<std::mutex> guard(lock);
+    auto found = pipelines.find(key);
+    return found != pipelines.end() ? found->second : VK_NULL_HANDLE;
+}
+
+VkPipeline PipelineRegistry::pipeline(const PipelineKey& key, const std::function<VkPipeline(VkPipelineCache)>& build) {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        auto found = pipelines.find(key);
+        if (found != pipelines.end()) {
+            hits++;
+            return found->second;
+        }
+    }
+
+    /* Compiled unlocked so other threads can look up meanwhile, the cache is internally synchronized */
+    VkPipeline built = build(pipelineCache);
+
+    std::lock_guard<std::mutex> guard(lock);
+    auto found = pipelines.find(key);
+    if (found != pipelines.end()) {
+        /* Another thread built the same pipeline first */
+        vkDestroyPipeline(device, built, nullptr);
+        hits++;
+        return found->second;
+    }
+    misses++;
+    pipelines[key] = built;
+    return built;
+}
+
+void PipelineRegistry::save() {
+    size_t size = 0;
+    if (vkGetPipelineCacheData(device, pipelineCache, &size, nullptr) != VK_SUCCESS || size == 0) return;
+    std::vector<char> data(size);
+    if (vkGetPipelineCacheData(device, pipelineCache, &size, data.data()) != VK_SUCCESS) return;
+    data.resize(size);
+
+    /* Written aside and swapped in, a crash mid-write leaves the old cache intact */
+    std::string temporary = path + ".tmp";
+    std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+    if (!file.is_open()) {
+        std::cout << "Could not write pipeline cache " << temporary << "\n";
+        return;
+    }
+    file.write(data.data(), data.size());
+    file.close();
+    if (!file) {
+        std::cout << "Could not write pipeline cache " << temporary << "\n";
+        return;
+    }
+
+    /* Replaces the old file in one step, rename(2) on POSIX and MoveFileEx with REPLACE_EXISTING on Windows */
+    std::error_code error;
+    std::filesystem::rename(temporary, path, error);
+    if (error) {
+        std::cout << "Could not replace pipeline cache " << path << ": " << error.message() << "\n";
+    }
+}
+
+void PipelineRegistry::report(std::ostream& out) {
+    std::lock_guard<std::mutex> guard(lock);
+    out << "Pipelines: " << pipelines.size() << " built, " << hits << " shared, "
+        << layouts.size() << " layouts, cache loaded " << loadedBytes << " bytes\n";
+}
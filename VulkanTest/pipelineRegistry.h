@@ -0,0 +1,94 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace render
+{
+    /*
+     * Everything a pipeline is built from that can differ between two requests: shader code,
+     * render pass, layout and the fixed-function state. Structs are added field by field,
+     * pNext chains and the viewport (always dynamic here) are not part of the key.
+     */
+    class PipelineKey {
+    public:
+        void add(uint64_t value);
+        void add(const std::vector<char>& code);
+        void add(const VkPipelineVertexInputStateCreateInfo& info);
+        void add(const VkPipelineInputAssemblyStateCreateInfo& info);
+        void add(const VkPipelineRasterizationStateCreateInfo& info);
+        void add(const VkPipelineMultisampleStateCreateInfo& info);
+        void add(const VkPipelineDepthStencilStateCreateInfo& info);
+        void add(const VkPipelineColorBlendStateCreateInfo& info);
+        void add(const VkPipelineDynamicStateCreateInfo& info);
+        void add(const VkSpecializationInfo& info);
+
+        template<typename T>
+        void addHandle(T handle) {
+            add((uint64_t)handle);
+        }
+
+        uint64_t hash() const;
+        bool operator==(const PipelineKey& other) const;
+
+    private:
+        std::vector<uint64_t> words;
+    };
+
+    struct PipelineKeyHash {
+        size_t operator()(const PipelineKey& key) const {
+            return static_cast<size_t>(key.hash());
+        }
+    };
+
+    /*
+     * Owns every graphics pipeline and pipeline layout, one per distinct key, so materials
+     * built from the same shaders and state share one pipeline instead of each compiling its own.
+     * Also owns the VkPipelineCache all pipelines are compiled through. It is read from cachePath
+     * when the header matches this device (vendor, device and pipelineCacheUUID) and written back
+     * on destruction, so later runs skip most of the driver's compilation.
+     *
+     * Handles stay valid until the registry goes. Any thread.
+     */
+    class PipelineRegistry {
+    public:
+        PipelineRegistry(VkDevice device, VkPhysicalDevice physicalDevice, const char* cachePath);
+        /* Saves the cache, then destroys every pipeline and layout */
+        ~PipelineRegistry();
+
+        VkPipelineCache cache() const;
+
+        /* The layout made for the same set layouts before, or a new one */
+        VkPipelineLayout layout(const std::vector<VkDescriptorSetLayout>& setLayouts);
+        /* The pipeline built for an equal key, VK_NULL_HANDLE when there is none yet */
+        VkPipeline find(const PipelineKey& key);
+        /* The pipeline built for an equal key before, or the one build makes through the cache */
+        VkPipeline pipeline(const PipelineKey& key, const std::function<VkPipeline(VkPipelineCache)>& build);
+
+        void save();
+        void report(std::ostream& out);
+
+    private:
+        VkDevice device;
+        VkPhysicalDeviceProperties properties;
+        std::string path;
+        VkPipelineCache pipelineCache = VK_NULL_HANDLE;
+        size_t loadedBytes = 0;
+
+        std::mutex lock;
+        std::unordered_map<PipelineKey, VkPipeline, PipelineKeyHash> pipelines;
+        std::unordered_map<PipelineKey, VkPipelineLayout, PipelineKeyHash> layouts;
+        uint32_t hits = 0;
+        uint32_t misses = 0;
+
+        /* Whether data starts with a cache header this device wrote */
+        bool validHeader(const std::vector<char>& data) const;
+    };
+};
@@ -0,0 +1,69 @@
+#include "queueFunnel.h"
+
+#include <stdexcept>
+
+using namespace render;
+
+QueueFunnel::QueueFunnel(VkDevice device, const std::vector<VkQueue>& queues) {
+    this->device = device;
+
+    for (size_t i = 0; i < queues.size(); i++)
+    {
+        bool known = false;
+        for (size_t j = 0; j < entries.size(); j++)
+        {
+            if (entries[j].queue == queues[i]) known = true;
+        }
+        if (known) continue;
+
+        locks.push_back(new std::mutex());
+        entries.push_back({ queues[i], locks.back() });
+    }
+}
+
+QueueFunnel::~QueueFunnel() {
+    for (size_t i = 0; i < locks.size(); i++)
+    {
+        delete locks[i];
+    }
+}
+
+std::mutex& QueueFunnel::lockFor(VkQueue queue) {
+    for (size_t i = 0; i < entries.size(); i++)
+    {
+        if (entries[i].queue == queue) return *entries[i].lock;
+    }
+    throw std::runtime_error("Queue was not registered with the funnel");
+}
+
+VkResult QueueFunnel::submit(VkQueue queue, uint32_t count, const VkSubmitInfo* infos, VkFence fence) {
+    std::lock_guard<std::mutex> guard(lockFor(queue));
+    return vkQueueSubmit(queue, count, infos, fence);
+}
+
+VkResult QueueFunnel::present(VkQueue queue, const VkPresentInfoKHR* info) {
+    std::lock_guard<std::mutex> guard(lockFor(queue));
+    return vkQueuePresentKHR(queue, info);
+}
+
+void QueueFunnel::waitIdle(VkQueue queue) {
+    std::lock_guard<std::mutex> guard(lockFor(queue));
+    vkQueueWaitIdle(queue);
+}
+
+void QueueFunnel::waitDeviceIdle() {
+    /* Always in creation order so two callers can't deadlock */
+    for (size_t i = 0; i < locks.size(); i++)
+    {
+        locks[i]->lock();
+    }
+    vkDeviceWaitIdle(device);
+    for (size_t i = locks.size(); i > 0; i--)
+    {
+        locks[i - 1]->unlock();
+    }
+}
+
+std::unique_lock<std::mutex> QueueFunnel::hold(VkQueue queue) {
+    return std::unique_lock<std::mutex>(lockFor(queue));
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+
+#include <mutex>
+#include <vector>
+
+namespace render
+{
+    /*
+     * Every vkQueueSubmit, vkQueuePresentKHR and queue wait goes through here.
+     * Queues have to be externally synchronized and uploads can be submitted from any thread, so each queue gets a mutex.
+     * Queue handles that alias (graphics and present are often the same queue) share theirs.
+     */
+    class QueueFunnel {
+    public:
+        QueueFunnel(VkDevice device, const std::vector<VkQueue>& queues);
+        ~QueueFunnel();
+
+        VkResult submit(VkQueue queue, uint32_t count, const VkSubmitInfo* infos, VkFence fence);
+        VkResult present(VkQueue queue, const VkPresentInfoKHR* info);
+        void waitIdle(VkQueue queue);
+        /* vkDeviceWaitIdle, with every queue locked as it requires */
+        void waitDeviceIdle();
+
+        /* For code that submits to the queue itself, like ktxTexture2_VkUploadEx */
+        std::unique_lock<std::mutex> hold(VkQueue queue);
+
+    private:
+        struct Entry {
+            VkQueue queue;
+            std::mutex* lock;
+        };
+
+        VkDevice device;
+        std::vector<Entry> entries;
+        std::vector<std::mutex*> locks;
+
+        std::mutex& lockFor(VkQueue queue);
+    };
+};
@@ -1,4 +1,6 @@
 #include "render.h"
+#include "gpuCulling.h"
+#include "threading.h"
 #include "util.h"
 
 #define GLFW_INCLUDE_VULKAN
@@ -12,9 +14,12 @@
 #include <glm/gtc/matrix_transform.hpp>
 
 #include <chrono>
+#include <cmath>
 #include <fstream>
 #include <stdexcept>
+#include <cstddef>
 #include <cstdint>
+#include <cstring>
 #include <algorithm>
 #include <optional>
 #include <vector>
@@ -114,9 +119,9 @@ inline void createInstance(Drawer* d) {
     createInfo.pApplicationInfo = &info;
 
     uint32_t glfwExtensionCount = 0;
-    const char** glfwExtensions;
+    const char** glfwExtensions = nullptr;
 
-    glfwExtensions = glfwGetRequiredInstanceExtensions(&glfwExtensionCount);
+    if (!d->headless) glfwExtensions = glfwGetRequiredInstanceExtensions(&glfwExtensionCount);
 
     uint32_t extensionCount = 0;
     vkEnumerateInstanceExtensionProperties(nullptr, &extensionCount, nullptr);
@@ -140,8 +145,17 @@ inline void createInstance(Drawer* d) {
         std::cout << '\t' << extension.extensionName << '\n';
     }
 
-    createInfo.enabledExtensionCount = glfwExtensionCount;
-    createInfo.ppEnabledExtensionNames = glfwExtensions;
+    std::vector<const char*> instanceExtensions(glfwExtensions, glfwExtensions + glfwExtensionCount);
+    /* Needed to query VK_EXT_memory_budget on 1.0 */
+    for (const auto& extension : extensions) {
+        if (strcmp(extension.extensionName, VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME) == 0) {
+            instanceExtensions.push_back(VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME);
+            d->properties2Extension = true;
+        }
+    }
+
+    createInfo.enabledExtensionCount = static_cast<uint32_t>(instanceExtensions.size());
+    createInfo.ppEnabledExtensionNames = instanceExtensions.data();
 
     VkDebugUtilsMessengerCreateInfoEXT debugCreateInfo{};
     if (enableValidationLayers) {
@@ -164,9 +178,10 @@ inline void createInstance(Drawer* d) {
 
 inline bool isSuitable(VkPhysicalDevice d, VkSurfaceKHR s) {
     bool completeQueues = getQueueFamilies(d, s).isComplete();
-    bool extensionSupport = checkExtensionSupport(d);
-    bool swapchainSupport = false;
-    if (extensionSupport) {
+    /* Headless, nothing to present */
+    bool extensionSupport = s == VK_NULL_HANDLE || checkExtensionSupport(d);
+    bool swapchainSupport = s == VK_NULL_HANDLE;
+    if (extensionSupport && !swapchainSupport) {
         SwapchainSupportDetails ssd = getSwapchainSupportDetails(d, s);
         swapchainSupport = !ssd.formats.empty() && !ssd.modes.empty();
     }
@@ -209,7 +224,9 @@ inline void createLogicalDevice(Drawer* d) {
     RequiredFamilyIndices indices = getQueueFamilies(d->physicalDevice, d->surface);
 
     std::vector<VkDeviceQueueCreateInfo> queueCreateInfos;
-    std::set<uint32_t> uniqueQueueFamilies = { indices.graphicsFamily.value(), indices.presentFamily.value() };
+    d->graphicsFamily = indices.graphicsFamily.value();
+    d->transferFamily = indices.transferFamily.value_or(d->graphicsFamily);
+    std::set<uint32_t> uniqueQueueFamilies = { indices.graphicsFamily.value(), indices.presentFamily.value(), d->transferFamily };
 
     float queuePriority = 1.0f;
     for (uint32_t queueFamily : uniqueQueueFamilies) {
@@ -224,6 +241,19 @@ inline void createLogicalDevice(Drawer* d) {
     VkPhysicalDeviceFeatures dFeatures{};
     dFeatures.samplerAnisotropy = VK_TRUE;
 
+    /* GPU culling draws indirectly with the instance index in the command, and dispatches on the graphics queue */
+    VkPhysicalDeviceFeatures supported;
+    vkGetPhysicalDeviceFeatures(d->physicalDevice, &supported);
+    uint32_t familyCount = 0;
+    vkGetPhysicalDeviceQueueFamilyProperties(d->physicalDevice, &familyCount, nullptr);
+    std::vector<VkQueueFamilyProperties> families(familyCount);
+    vkGetPhysicalDeviceQueueFamilyProperties(d->physicalDevice, &familyCount, families.data());
+    if (supported.multiDrawIndirect && supported.drawIndirectFirstInstance && (families[d->graphicsFamily].queueFlags & VK_QUEUE_COMPUTE_BIT)) {
+        dFeatures.multiDrawIndirect = VK_TRUE;
+        dFeatures.drawIndirectFirstInstance = VK_TRUE;
+        d->indirectDrawing = true;
+    }
+
     VkDeviceCreateInfo dCreateInfo{};
     dCreateInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
     dCreateInfo.pQueueCreateInfos = queueCreateInfos.data();
@@ -231,8 +261,55 @@ inline void createLogicalDevice(Drawer* d) {
     dCreateInfo.queueCreateInfoCount = static_cast<uint32_t>(queueCreateInfos.size());
     dCreateInfo.pEnabledFeatures = &dFeatures;
 
-    dCreateInfo.enabledExtensionCount = static_cast<uint32_t>(deviceExtensions.size());
-    dCreateInfo.ppEnabledExtensionNames = deviceExtensions.data();
+    std::vector<const char*> extensions;
+    if (!d->headless) extensions = deviceExtensions;
+    if (d->properties2Extension && hasDeviceExtension(d->physicalDevice, VK_EXT_MEMORY_BUDGET_EXTENSION_NAME)) {
+        extensions.push_back(VK_EXT_MEMORY_BUDGET_EXTENSION_NAME);
+        d->memoryBudgetExtension = true;
+    }
+    if (d->indirectDrawing && hasDeviceExtension(d->physicalDevice, VK_KHR_DRAW_INDIRECT_COUNT_EXTENSION_NAME)) {
+        extensions.push_back(VK_KHR_DRAW_INDIRECT_COUNT_EXTENSION_NAME);
+        d->drawIndirectCountExtension = true;
+    }
+
+    /* Bindless materials, see Drawer::descriptorIndexing. Features and limits are only reachable through properties2 on 1.0 */
+    VkPhysicalDeviceDescriptorIndexingFeaturesEXT indexingFeatures{};
+    indexingFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_FEATURES_EXT;
+    if (d->properties2Extension && hasDeviceExtension(d->physicalDevice, VK_EXT_DESCRIPTOR_INDEXING_EXTENSION_NAME) && hasDeviceExtension(d->physicalDevice, VK_KHR_MAINTENANCE3_EXTENSION_NAME)) {
+        VkPhysicalDeviceDescriptorIndexingFeaturesEXT supportedIndexing{};
+        supportedIndexing.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_FEATURES_EXT;
+        VkPhysicalDeviceFeatures2KHR features2{};
+        features2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2_KHR;
+        features2.pNext = &supportedIndexing;
+        auto getFeatures2 = (PFN_vkGetPhysicalDeviceFeatures2KHR)vkGetInstanceProcAddr(d->instance, "vkGetPhysicalDeviceFeatures2KHR");
+        if (getFeatures2 != nullptr) getFeatures2(d->physicalDevice, &features2);
+
+        if (supportedIndexing.shaderSampledImageArrayNonUniformIndexing && supportedIndexing.runtimeDescriptorArray
+            && supportedIndexing.descriptorBindingPartiallyBound && supportedIndexing.descriptorBindingSampledImageUpdateAfterBind) {
+            indexingFeatures.shaderSampledImageArrayNonUniformIndexing = VK_TRUE;
+            indexingFeatures.runtimeDescriptorArray = VK_TRUE;
+            indexingFeatures.descriptorBindingPartiallyBound = VK_TRUE;
+            indexingFeatures.descriptorBindingSampledImageUpdateAfterBind = VK_TRUE;
+            dCreateInfo.pNext = &indexingFeatures;
+            extensions.push_back(VK_KHR_MAINTENANCE3_EXTENSION_NAME);
+            extensions.push_back(VK_EXT_DESCRIPTOR_INDEXING_EXTENSION_NAME);
+            d->descriptorIndexing = true;
+
+            VkPhysicalDeviceDescriptorIndexingPropertiesEXT indexingProperties{};
+            indexingProperties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_PROPERTIES_EXT;
+            VkPhysicalDeviceProperties2KHR properties2{};
+            properties2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2_KHR;
+            properties2.pNext = &indexingProperties;
+            auto getProperties2 = (PFN_vkGetPhysicalDeviceProperties2KHR)vkGetInstanceProcAddr(d->instance, "vkGetPhysicalDeviceProperties2KHR");
+            getProperties2(d->physicalDevice, &properties2);
+            d->maxBindlessTextures = std::min({ d->maxBindlessTextures, indexingProperties.maxPerStageDescriptorUpdateAfterBindSampledImages,
+                indexingProperties.maxDescriptorSetUpdateAfterBindSampledImages });
+            std::cout << "Bindless materials, " << d->maxBindlessTextures << " textures\n";
+        }
+    }
+
+    dCreateInfo.enabledExtensionCount = static_cast<uint32_t>(extensions.size());
+    dCreateInfo.ppEnabledExtensionNames = extensions.data();
 
     dCreateInfo.enabledLayerCount = 0;
 
@@ -242,6 +319,11 @@ inline void createLogicalDevice(Drawer* d) {
 
     vkGetDeviceQueue(d->device, indices.graphicsFamily.value(), 0, &(d->graphicsQueue));
     vkGetDeviceQueue(d->device, indices.presentFamily.value(), 0, &(d->presentQueue));
+    vkGetDeviceQueue(d->device, d->transferFamily, 0, &(d->transferQueue));
+
+    if (d->transferFamily != d->graphicsFamily) {
+        std::cout << "Uploading through transfer queue family " << d->transferFamily << "\n";
+    }
 }
 
 
@@ -346,7 +428,8 @@ inline void createRenderPass(Drawer* d) {
     colorAttachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
     colorAttachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
     colorAttachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-    colorAttachment.finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+    /* Headless devices don't enable VK_KHR_swapchain */
+    colorAttachment.finalLayout = d->headless ? VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL : VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
 
     VkAttachmentReference depthAttachmentRef{};
     depthAttachmentRef.attachment = 1;
@@ -459,11 +542,13 @@ inline void createDescriptorPool(Drawer* d) {
     poolSizes[1].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
     poolSizes[1].descriptorCount = static_cast<uint32_t>(10);
     poolSizes[2].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
-    poolSizes[2].descriptorCount = static_cast<uint32_t>(10);
+    /* GpuCuller takes four per frame, instance buffers one per frame and cache key, twice that while grown ones wait for deletion */
+    poolSizes[2].descriptorCount = static_cast<uint32_t>(10 + 4 * d->FRAMES_IN_FLIGHT + 6 * d->FRAMES_IN_FLIGHT);
 
     VkDescriptorPoolCreateInfo info{};
     info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
-    info.maxSets = 30;
+    info.flags = VK_DESCRIPTOR_POOL_CREATE_FREE_DESCRIPTOR_SET_BIT;
+    info.maxSets = 30 + 6 * d->FRAMES_IN_FLIGHT;
     info.poolSizeCount = static_cast<uint32_t>(poolSizes.size());
     info.pPoolSizes = poolSizes.data();
 
@@ -472,21 +557,36 @@ inline void createDescriptorPool(Drawer* d) {
     }
 }
 
-inline void createGraphicsPipeline(Drawer* d, std::vector<char> shaders[], Material* mat) {
-    VkShaderModule vShader = createShaderModule(d->device, shaders[0]);
-    VkShaderModule fShader = createShaderModule(d->device, shaders[1]);
+/* Shared through the registry when shaders, layout, features and state match an earlier request.
+ * Without compile only looks it up and returns VK_NULL_HANDLE if it is not built yet. Any thread.
+ */
+inline VkPipeline materialPipeline(Drawer* d, const std::vector<char> shaders[], VkPipelineLayout layout, const MaterialFeatures& features, bool compile = true) {
+    /* constant_id order, both stages get all of them and ignore the ones they do not declare */
+    VkSpecializationMapEntry featureEntries[] = {
+        { 0, offsetof(MaterialFeatures, receiveShadows), sizeof(VkBool32) },
+        { 1, offsetof(MaterialFeatures, vertexLighting), sizeof(VkBool32) },
+        { 2, offsetof(MaterialFeatures, maxVertexLights), sizeof(uint32_t) },
+        { 3, offsetof(MaterialFeatures, alphaTest), sizeof(VkBool32) },
+        { 4, offsetof(MaterialFeatures, alphaCutoff), sizeof(float) }
+    };
+
+    VkSpecializationInfo specialization{};
+    specialization.mapEntryCount = 5;
+    specialization.pMapEntries = featureEntries;
+    specialization.dataSize = sizeof(MaterialFeatures);
+    specialization.pData = &features;
 
     VkPipelineShaderStageCreateInfo vShaderStageInfo{};
     vShaderStageInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
     vShaderStageInfo.stage = VK_SHADER_STAGE_VERTEX_BIT;
-    vShaderStageInfo.module = vShader;
     vShaderStageInfo.pName = "main";
+    vShaderStageInfo.pSpecializationInfo = &specialization;
 
     VkPipelineShaderStageCreateInfo fShaderStageInfo{};
     fShaderStageInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
     fShaderStageInfo.stage = VK_SHADER_STAGE_FRAGMENT_BIT;
-    fShaderStageInfo.module = fShader;
     fShaderStageInfo.pName = "main";
+    fShaderStageInfo.pSpecializationInfo = &specialization;
 
     VkPipelineShaderStageCreateInfo shaderStages[] = { vShaderStageInfo, fShaderStageInfo };
 
@@ -514,10 +614,10 @@ inline void createGraphicsPipeline(Drawer* d, std::vector<char> shaders[], Mater
 
     VkPipelineVertexInputStateCreateInfo vertexInputInfo{};
     vertexInputInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
-    vertexInputInfo.vertexBindingDescriptionCount = 1;
-    auto desc = Vertex::getBindingDescription();
+    VkVertexInputBindingDescription desc[] = { Vertex::getBindingDescription() };
     auto attr = Vertex::getAttributeDescriptions();
-    vertexInputInfo.pVertexBindingDescriptions = &desc;
+    vertexInputInfo.vertexBindingDescriptionCount = 1;
+    vertexInputInfo.pVertexBindingDescriptions = desc;
     vertexInputInfo.vertexAttributeDescriptionCount = attr.size();
     vertexInputInfo.pVertexAttributeDescriptions = attr.data();
 
@@ -584,22 +684,20 @@ inline void createGraphicsPipeline(Drawer* d, std::vector<char> shaders[], Mater
     colorBlending.attachmentCount = 1;
     colorBlending.pAttachments = &colorBlendAttachment;
 
-    VkPushConstantRange pushConstantRange{};
-    pushConstantRange.offset = 0;
-    pushConstantRange.size = sizeof(PushConstant);
-    pushConstantRange.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
-
-    VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
-    pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
-    pipelineLayoutInfo.setLayoutCount = 2;
-    std::vector<VkDescriptorSetLayout> setLayouts = { d->frameDependantLayout, mat->descriptorLayout };
-    pipelineLayoutInfo.pSetLayouts = setLayouts.data();
-    pipelineLayoutInfo.pushConstantRangeCount = 1;
-    pipelineLayoutInfo.pPushConstantRanges = &pushConstantRange;
-
-    if (vkCreatePipelineLayout(d->device, &pipelineLayoutInfo, nullptr, &(mat->layout)) != VK_SUCCESS) {
-        throw std::runtime_error("Error creating pipeline layout");
-    }
+    PipelineKey key;
+    key.add(shaders[0]);
+    key.add(shaders[1]);
+    key.addHandle(d->renderPass);
+    key.addHandle(layout);
+    key.add(specialization);
+    key.add(vertexInputInfo);
+    key.add(inputAssembly);
+    key.add(rasterizer);
+    key.add(multisampling);
+    key.add(depthState);
+    key.add(colorBlending);
+    key.add(dynamicState);
+    if (!compile) return d->pipelines->find(key);
 
     VkGraphicsPipelineCreateInfo pipelineInfo{};
     pipelineInfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
@@ -613,36 +711,78 @@ inline void createGraphicsPipeline(Drawer* d, std::vector<char> shaders[], Mater
     pipelineInfo.pColorBlendState = &colorBlending;
     pipelineInfo.pDynamicState = &dynamicState;
     pipelineInfo.pDepthStencilState = &depthState;
-    pipelineInfo.layout = mat->layout;
+    pipelineInfo.layout = layout;
     pipelineInfo.renderPass = d->renderPass;
     pipelineInfo.subpass = 0;
     pipelineInfo.basePipelineHandle = VK_NULL_HANDLE;
 
-    if (vkCreateGraphicsPipelines(d->device, VK_NULL_HANDLE, 1, &pipelineInfo, nullptr, &(mat->pipeline)) != VK_SUCCESS) {
-        throw std::runtime_error("failed to create graphics pipeline!");
-    }
+    return d->pipelines->pipeline(key, [&](VkPipelineCache cache) {
+        shaderStages[0].module = createShaderModule(d->device, shaders[0]);
+        shaderStages[1].module = createShaderModule(d->device, shaders[1]);
 
-    vkDestroyShaderModule(d->device, vShader, nullptr);
-    vkDestroyShaderModule(d->device, fShader, nullptr);
+        VkPipeline pipeline;
+        if (vkCreateGraphicsPipelines(d->device, cache, 1, &pipelineInfo, nullptr, &pipeline) != VK_SUCCESS) {
+            throw std::runtime_error("failed to create graphics pipeline!");
+        }
+
+        vkDestroyShaderModule(d->device, shaderStages[0].module, nullptr);
+        vkDestroyShaderModule(d->device, shaderStages[1].module, nullptr);
+        return pipeline;
+    });
 }
 
-inline void createDepthOnlyPipeline(Drawer* d) {
-    std::vector<char> shaders[] = { getBytes("shaders/shadowmapv.spv"), getBytes("shaders/shadowmapf.spv") };
-    VkShaderModule vShader = createShaderModule(d->device, shaders[0]);
-    VkShaderModule fShader = createShaderModule(d->device, shaders[1]);
+inline VkPipelineLayout materialLayout(Drawer* d, VkDescriptorSetLayout descriptorLayout) {
+    std::vector<VkDescriptorSetLayout> setLayouts = { d->frameDependantLayout, descriptorLayout, d->instanceSetLayout };
+    return d->pipelines->layout(setLayouts);
+}
+
+/* The shaders a material draws with until its own pipeline is compiled, the plain ones of its descriptor layout */
+inline std::vector<char>* fallbackShaders(Drawer* d, Material* mat) {
+    if (d->descriptorIndexing && mat->descriptorLayout == d->bindlessLayout) return d->bindlessShaders;
+    return d->defaultShaders;
+}
+
+/* Every feature on, how the shaders behaved before they were specialized */
+inline MaterialFeatures fallbackFeatures(Drawer* d) {
+    MaterialFeatures features{};
+    features.maxVertexLights = static_cast<uint32_t>(d->maxVertLights);
+    return features;
+}
+
+/*
+ * For the material that will sit at materialIndex, specialized for mat->features.
+ * A pipeline not built yet compiles on d->threading, the material draws with the fallback shaders
+ * and features on its layout until collectPipelines swaps it in.
+ */
+inline void requestGraphicsPipeline(Drawer* d, std::vector<char> shaders[], Material* mat, size_t materialIndex) {
+    mat->layout = materialLayout(d, mat->descriptorLayout);
+    std::vector<char>* fallback = fallbackShaders(d, mat);
+    bool isFallback = shaders[0] == fallback[0] && shaders[1] == fallback[1] && mat->features == fallbackFeatures(d);
+
+    mat->pipeline = materialPipeline(d, shaders, mat->layout, mat->features, isFallback || d->threading == nullptr);
+    if (mat->pipeline != VK_NULL_HANDLE) return;
+    mat->pipeline = materialPipeline(d, fallback, mat->layout, fallbackFeatures(d));
+
+    std::vector<char> code[] = { shaders[0], shaders[1] };
+    VkPipelineLayout layout = mat->layout;
+    MaterialFeatures features = mat->features;
+    d->compilePipeline(
+        [d, code, layout, features]() { return materialPipeline(d, code, layout, features); },
+        [d, materialIndex](VkPipeline pipeline) {
+            d->registeredMaterials[materialIndex].pipeline = pipeline;
+            d->invalidateCachedSecondaries();
+        });
+}
+
+/* Any thread */
+inline VkPipeline depthOnlyPipeline(Drawer* d) {
+    std::vector<char> shaders[] = { getBytes("shaders/shadowmapv.spv") };
 
     VkPipelineShaderStageCreateInfo vShaderStageInfo{};
     vShaderStageInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
     vShaderStageInfo.stage = VK_SHADER_STAGE_VERTEX_BIT;
-    vShaderStageInfo.module = vShader;
     vShaderStageInfo.pName = "main";
 
-    VkPipelineShaderStageCreateInfo fShaderStageInfo{};
-    fShaderStageInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
-    fShaderStageInfo.stage = VK_SHADER_STAGE_FRAGMENT_BIT;
-    fShaderStageInfo.module = fShader;
-    fShaderStageInfo.pName = "main";
-
     VkPipelineShaderStageCreateInfo shaderStages[] = { vShaderStageInfo };
 
     std::vector<VkDynamicState> dynamicStates = {
@@ -671,10 +811,10 @@ inline void createDepthOnlyPipeline(Drawer* d) {
 
     VkPipelineVertexInputStateCreateInfo vertexInputInfo{};
     vertexInputInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
-    vertexInputInfo.vertexBindingDescriptionCount = 1;
-    auto desc = Vertex::getBindingDescription();
+    VkVertexInputBindingDescription desc[] = { Vertex::getBindingDescription() };
     auto attr = Vertex::getAttributeDescriptions();
-    vertexInputInfo.pVertexBindingDescriptions = &desc;
+    vertexInputInfo.vertexBindingDescriptionCount = 1;
+    vertexInputInfo.pVertexBindingDescriptions = desc;
     vertexInputInfo.vertexAttributeDescriptionCount = attr.size();
     vertexInputInfo.pVertexAttributeDescriptions = attr.data();
 
@@ -733,24 +873,17 @@ inline void createDepthOnlyPipeline(Drawer* d) {
     colorBlending.attachmentCount = 0;
     colorBlending.pAttachments = nullptr;
 
-    VkPushConstantRange pushConstantRange{};
-    pushConstantRange.offset = 0;
-    pushConstantRange.size = sizeof(PushConstant);
-    pushConstantRange.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
-
-    VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
-    pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
-    pipelineLayoutInfo.setLayoutCount = 1;
-    std::vector<VkDescriptorSetLayout> setLayouts = { d->shadowMappingLayout };
-    pipelineLayoutInfo.pSetLayouts = setLayouts.data();
-    pipelineLayoutInfo.pushConstantRangeCount = 1;
-    pipelineLayoutInfo.pPushConstantRanges = &pushConstantRange;
-
-    VkPipelineLayout pLayout{};
-    if (vkCreatePipelineLayout(d->device, &pipelineLayoutInfo, nullptr, &d->shadowPipelineLayout) != VK_SUCCESS) {
-        throw std::runtime_error("Error creating pipeline layout");
-    }
-    //d->shadowPipelineLayout = pLayout;
+    PipelineKey key;
+    key.add(shaders[0]);
+    key.addHandle(d->shadowPass);
+    key.addHandle(d->shadowPipelineLayout);
+    key.add(vertexInputInfo);
+    key.add(inputAssembly);
+    key.add(rasterizer);
+    key.add(multisampling);
+    key.add(depthState);
+    key.add(colorBlending);
+    key.add(dynamicState);
 
     VkGraphicsPipelineCreateInfo pipelineInfo{};
     pipelineInfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
@@ -769,13 +902,26 @@ inline void createDepthOnlyPipeline(Drawer* d) {
     pipelineInfo.subpass = 0;
     pipelineInfo.basePipelineHandle = VK_NULL_HANDLE;
 
-    if (vkCreateGraphicsPipelines(d->device, VK_NULL_HANDLE, 1, &pipelineInfo, nullptr, &(d->shadowPipeline)) != VK_SUCCESS) {
-        throw std::runtime_error("failed to create graphics pipeline!");
-    }
-    //d->shadowPipeline = shadowPipeline;
+    return d->pipelines->pipeline(key, [&](VkPipelineCache cache) {
+        shaderStages[0].module = createShaderModule(d->device, shaders[0]);
 
-    vkDestroyShaderModule(d->device, vShader, nullptr);
-    vkDestroyShaderModule(d->device, fShader, nullptr);
+        VkPipeline pipeline;
+        if (vkCreateGraphicsPipelines(d->device, cache, 1, &pipelineInfo, nullptr, &pipeline) != VK_SUCCESS) {
+            throw std::runtime_error("failed to create graphics pipeline!");
+        }
+
+        vkDestroyShaderModule(d->device, shaderStages[0].module, nullptr);
+        return pipeline;
+    });
+}
+
+/* Compiles alongside the rest of init, which waits for it at the end */
+inline void createDepthOnlyPipeline(Drawer* d) {
+    std::vector<VkDescriptorSetLayout> setLayouts = { d->shadowMappingLayout, d->instanceSetLayout };
+    d->shadowPipelineLayout = d->pipelines->layout(setLayouts);
+    d->compilePipeline(
+        [d]() { return depthOnlyPipeline(d); },
+        [d](VkPipeline pipeline) { d->shadowPipeline = pipeline; });
 }
 
 
@@ -818,6 +964,23 @@ inline void createShadowDescSetLayout(Drawer* d) {
     };
 }
 
+inline void createInstanceSetLayout(Drawer* d) {
+    VkDescriptorSetLayoutBinding binding{};
+    binding.binding = 0;
+    binding.descriptorCount = 1;
+    binding.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    binding.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+
+    VkDescriptorSetLayoutCreateInfo createInfo{};
+    createInfo.bindingCount = 1;
+    createInfo.pBindings = &binding;
+    createInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+
+    if (vkCreateDescriptorSetLayout(d->device, &createInfo, nullptr, &(d->instanceSetLayout)) != VK_SUCCESS) {
+        throw std::runtime_error("Error creating descriptor set layout");
+    };
+}
+
 inline void createFrameDescriptorSets(Drawer* d) {
     std::vector<VkDescriptorSetLayoutBinding> bindings;
     bindings.resize(4);
@@ -871,7 +1034,7 @@ inline void createFrameDescriptorSets(Drawer* d) {
         VkDescriptorBufferInfo b2Info{};
         b2Info.buffer = d->frameOrder[i].dLightBuffer;
         b2Info.offset = 0;
-        b2Info.range = (d->shadowMapSize * d->shadowMapSize * sizeof(LightBufferObject)) + sizeof(glm::vec4);
+        b2Info.range = sizeof(LightBufferObject);
 
         VkDescriptorImageInfo iInfo{};
         iInfo.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
@@ -881,7 +1044,7 @@ inline void createFrameDescriptorSets(Drawer* d) {
         VkDescriptorBufferInfo b3Info{};
         b3Info.buffer = d->frameOrder[i].vLightBuffer;
         b3Info.offset = 0;
-        b3Info.range = d->maxVertLights * sizeof(VertexLight);
+        b3Info.range = sizeof(glm::vec4) + d->maxVertLights * sizeof(VertexLight);
 
         std::vector<VkWriteDescriptorSet> descriptorWrites{};
         descriptorWrites.resize(4);
@@ -955,18 +1118,171 @@ inline void createDefaultDescriptorSet(Drawer* d, Material* mat, const render::T
 }
 
 
-inline void createDefaultMaterial(Drawer* d) {
+inline void createBindlessTables(Drawer* d) {
+    d->bindlessSlots = new SlotAllocator(d->maxBindlessTextures, "Bindless texture");
+
+    std::vector<VkDescriptorPoolSize> poolSizes{};
+    poolSizes.resize(2);
+    poolSizes[0].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    poolSizes[0].descriptorCount = d->maxBindlessTextures;
+    poolSizes[1].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    poolSizes[1].descriptorCount = 1;
+
+    VkDescriptorPoolCreateInfo poolInfo{};
+    poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    poolInfo.flags = VK_DESCRIPTOR_POOL_CREATE_UPDATE_AFTER_BIND_BIT_EXT;
+    poolInfo.maxSets = 1;
+    poolInfo.poolSizeCount = static_cast<uint32_t>(poolSizes.size());
+    poolInfo.pPoolSizes = poolSizes.data();
+
+    if (vkCreateDescriptorPool(d->device, &poolInfo, nullptr, &(d->bindlessPool)) != VK_SUCCESS) {
+        throw std::runtime_error("Error creating descriptor pool");
+    }
+
+    std::vector<VkDescriptorSetLayoutBinding> bindings;
+    bindings.resize(2);
+    bindings[0].binding = 0;
+    bindings[0].descriptorCount = d->maxBindlessTextures;
+    bindings[0].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    bindings[0].stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+
+    bindings[1].binding = 1;
+    bindings[1].descriptorCount = 1;
+    bindings[1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    bindings[1].stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+
+    /* Textures are added while frames that bound the set are still in flight, and only the ones added so far are valid */
+    VkDescriptorBindingFlagsEXT bindingFlags[] = { VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT_EXT | VK_DESCRIPTOR_BINDING_UPDATE_AFTER_BIND_BIT_EXT, 0 };
+    VkDescriptorSetLayoutBindingFlagsCreateInfoEXT flagsInfo{};
+    flagsInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_BINDING_FLAGS_CREATE_INFO_EXT;
+    flagsInfo.bindingCount = 2;
+    flagsInfo.pBindingFlags = bindingFlags;
+
+    VkDescriptorSetLayoutCreateInfo createInfo{};
+    createInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    createInfo.pNext = &flagsInfo;
+    createInfo.flags = VK_DESCRIPTOR_SET_LAYOUT_CREATE_UPDATE_AFTER_BIND_POOL_BIT_EXT;
+    createInfo.bindingCount = static_cast<uint32_t>(bindings.size());
+    createInfo.pBindings = bindings.data();
+
+    if (vkCreateDescriptorSetLayout(d->device, &createInfo, nullptr, &(d->bindlessLayout)) != VK_SUCCESS) {
+        throw std::runtime_error("Error creating descriptor set layout");
+    }
+
+    VkDescriptorSetAllocateInfo allocInfo{};
+    allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    allocInfo.descriptorPool = d->bindlessPool;
+    allocInfo.descriptorSetCount = 1;
+    allocInfo.pSetLayouts = &(d->bindlessLayout);
+
+    if (vkAllocateDescriptorSets(d->device, &allocInfo, &(d->bindlessSet)) != VK_SUCCESS) {
+        throw std::runtime_error("failed to allocate descriptor sets!");
+    }
+
+    /* Entries are only ever added, never rewritten, so the frames in flight can keep reading */
+    d->memory->createBuffer(sizeof(MaterialParams) * d->maxBindlessMaterials, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, d->materialParamBuffer, d->materialParamAllocation,
+        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, MemoryCategory::Uniform);
+
+    VkDescriptorBufferInfo bufferInfo{};
+    bufferInfo.buffer = d->materialParamBuffer;
+    bufferInfo.offset = 0;
+    bufferInfo.range = VK_WHOLE_SIZE;
+
+    VkWriteDescriptorSet write{};
+    write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    write.dstSet = d->bindlessSet;
+    write.dstBinding = 1;
+    write.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    write.descriptorCount = 1;
+    write.pBufferInfo = &bufferInfo;
+    vkUpdateDescriptorSets(d->device, 1, &write, 0, nullptr);
+}
+
+/* material becomes the next entry of registeredMaterials */
+inline void registerBindlessMaterial(Drawer* d, Material* mat, render::Texture& tex) {
+    if (d->registeredMaterials.size() >= d->maxBindlessMaterials) {
+        throw std::runtime_error("Bindless material table is full");
+    }
+    tex.bindlessSlot = d->bindlessSlots->allocate();
+    mat->textureIndex = tex.bindlessSlot;
+    mat->descriptorLayout = d->bindlessLayout;
+    mat->materialDescriptor = d->bindlessSet;
+
+    VkDescriptorImageInfo imgInfo{};
+    imgInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+    imgInfo.imageView = tex.textureView;
+    imgInfo.sampler = tex.sampler;
+
+    VkWriteDescriptorSet write{};
+    write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    write.dstSet = d->bindlessSet;
+    write.dstBinding = 0;
+    write.dstArrayElement = mat->textureIndex;
+    write.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    write.descriptorCount = 1;
+    write.pImageInfo = &imgInfo;
+    vkUpdateDescriptorSets(d->device, 1, &write, 0, nullptr);
+
+    MaterialParams* params = static_cast<MaterialParams*>(d->materialParamAllocation.mapped);
+    params[d->registeredMaterials.size()] = MaterialParams{ mat->color, mat->textureIndex };
+
+    /* Every bindless material asks for the same pipeline, the registry builds it once */
+    requestGraphicsPipeline(d, d->bindlessShaders, mat, d->registeredMaterials.size());
+}
+
+uint16_t Drawer::addMaterial(const char* texturePath, glm::vec4 color, MaterialFeatures features) {
     Material material{};
-    render::Texture texture(d, "textures/oad.ktx2", VK_IMAGE_VIEW_TYPE_2D);
+    material.color = color;
+    material.features = features;
+    material.features.maxVertexLights = std::min(features.maxVertexLights, static_cast<uint32_t>(maxVertLights));
+    render::Texture texture(this, texturePath, VK_IMAGE_VIEW_TYPE_2D);
 
+    if (descriptorIndexing) {
+        registerBindlessMaterial(this, &material, texture);
+    }
+    else {
+        material.descriptorLayout = defaultMaterialLayout;
+        createDefaultDescriptorSet(this, &material, texture);
+        requestGraphicsPipeline(this, defaultShaders, &material, registeredMaterials.size());
+    }
+    registeredTextures.push_back(texture);
+    registeredMaterials.push_back(material);
+    invalidateCachedSecondaries();
+    return static_cast<uint16_t>(registeredMaterials.size() - 1);
+}
+
+inline void createDefaultMaterial(Drawer* d) {
     createDefaultDescSetLayout(d);
-    material.descriptorLayout = d->defaultMaterialLayout;
-    createDefaultDescriptorSet(d, &material, texture);
+    if (d->descriptorIndexing) createBindlessTables(d);
+    d->defaultShaders[0] = getBytes("shaders/vert.spv");
+    d->defaultShaders[1] = getBytes("shaders/frag.spv");
+    if (d->descriptorIndexing) {
+        d->bindlessShaders[0] = d->defaultShaders[0];
+        d->bindlessShaders[1] = getBytes("shaders/fragBindless.spv");
+    }
+    d->addMaterial("textures/oad.ktx2");
+}
 
-    std::vector<char> shaders[] = {getBytes("shaders/vert.spv"), getBytes("shaders/frag.spv")};
-    createGraphicsPipeline(d, shaders, &material);
-    d->registeredTextures.push_back(texture);
-    d->registeredMaterials.push_back(material);
+void Drawer::precompileMaterialVariants() {
+    VkDescriptorSetLayout descriptorLayout = descriptorIndexing ? bindlessLayout : defaultMaterialLayout;
+    std::vector<char>* code = descriptorIndexing ? bindlessShaders : defaultShaders;
+    VkPipelineLayout layout = materialLayout(this, descriptorLayout);
+
+    for (uint32_t bits = 0; bits < 8; bits++)
+    {
+        MaterialFeatures features = fallbackFeatures(this);
+        features.receiveShadows = (bits & 1) ? VK_TRUE : VK_FALSE;
+        features.vertexLighting = (bits & 2) ? VK_TRUE : VK_FALSE;
+        features.alphaTest = (bits & 4) ? VK_TRUE : VK_FALSE;
+        /* Built with the default material already */
+        if (features == fallbackFeatures(this)) continue;
+
+        /* Kept by the registry, nothing to apply */
+        compilePipeline(
+            [this, code, layout, features]() { return materialPipeline(this, code, layout, features); },
+            [](VkPipeline pipeline) {});
+    }
 }
 
 inline void createDefaultMesh(Drawer* d) {
@@ -976,7 +1292,8 @@ inline void createDefaultMesh(Drawer* d) {
         d,
         d->defaultBox.data(),
         d->defaultBox.size(),
-        sub);
+        sub,
+        true);
     d->registeredMeshes.push_back(mesh);
 }
 
@@ -988,9 +1305,10 @@ inline void createSkybox(Drawer* d) {
     createDefaultDescriptorSet(d, &material, texture);
 
     std::vector<char> shaders[] = { getBytes("shaders/skyboxv.spv"), getBytes("shaders/skyboxf.spv") };
-    createGraphicsPipeline(d, shaders, &material);
+    requestGraphicsPipeline(d, shaders, &material, d->registeredMaterials.size());
     d->registeredTextures.push_back(texture);
     d->registeredMaterials.push_back(material);
+    d->invalidateCachedSecondaries();
 }
 
 
@@ -1014,7 +1332,7 @@ inline void createDepthStuff(Drawer* d) {
         { VK_FORMAT_D32_SFLOAT, VK_FORMAT_D32_SFLOAT_S8_UINT, VK_FORMAT_D24_UNORM_S8_UINT },
         VK_IMAGE_TILING_OPTIMAL,
         VK_FORMAT_FEATURE_DEPTH_STENCIL_ATTACHMENT_BIT);
-    createImage(d->device, d->physicalDevice, d->extent.width, d->extent.height, 1, depthFormat, VK_IMAGE_TILING_OPTIMAL, 0, VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, d->depthImage, d->depthMemory);
+    createImage(d->memory, d->extent.width, d->extent.height, 1, depthFormat, VK_IMAGE_TILING_OPTIMAL, 0, VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, d->depthImage, d->depthAllocation, MemoryCategory::Attachment);
     d->depthView = createImageView(d->device, d->depthImage, VK_IMAGE_VIEW_TYPE_2D, depthFormat, VK_IMAGE_ASPECT_DEPTH_BIT);
     VkSamplerCreateInfo depthSamplerCreateInfo{};
     depthSamplerCreateInfo.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
@@ -1045,7 +1363,7 @@ inline void createShadowAtlas(Drawer* d) {
     VkFormat format = findDepthSamplerFormat(d->physicalDevice);
     std::cout << format << "\n";
     int iSize = d->shadowMapDetail * d->shadowMapSize;
-    createImage(d->device, d->physicalDevice, iSize, iSize, 1, format, VK_IMAGE_TILING_OPTIMAL, 0, VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, d->shadowAtlas, d->shadowMapMemory);
+    createImage(d->memory, iSize, iSize, 1, format, VK_IMAGE_TILING_OPTIMAL, 0, VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, d->shadowAtlas, d->shadowMapAllocation, MemoryCategory::Attachment);
     d->shadowView = createImageView(d->device, d->shadowAtlas, VK_IMAGE_VIEW_TYPE_2D, format, VK_IMAGE_ASPECT_DEPTH_BIT);
 
     VkSamplerCreateInfo samplerInfo{};
@@ -1136,17 +1454,23 @@ inline void createShadowAtlas(Drawer* d) {
 inline void createUniformBuffers(Drawer* d) {
     VkDeviceSize size = sizeof(UniformBufferObject);
     VkDeviceSize size2 = sizeof(LightBufferObject);
-    VkDeviceSize size3 = sizeof(VertexLight) * d->maxVertLights;
+    VkDeviceSize size3 = sizeof(glm::vec4) + sizeof(VertexLight) * d->maxVertLights;
+
+    /* Written by the CPU every frame and read straight from the mapping, device local when the BAR allows it */
+    VkMemoryPropertyFlags required = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+    VkMemoryPropertyFlags preferred = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
 
     for (size_t i = 0; i < d->FRAMES_IN_FLIGHT; i++)
     {
-        createBuffer(d->device, d->physicalDevice, size, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, d->frameOrder[i].uniformBuffer, d->frameOrder[i].uniformBufferMemory);
-        vkMapMemory(d->device, d->frameOrder[i].uniformBufferMemory, 0, size, 0, &(d->frameOrder[i].uniformMappedMemory));
+        d->memory->createBuffer(size, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, required, d->frameOrder[i].uniformBuffer, d->frameOrder[i].uniformAllocation, preferred, MemoryCategory::Uniform);
+        d->frameOrder[i].uniformMappedMemory = d->frameOrder[i].uniformAllocation.mapped;
 
-        createBuffer(d->device, d->physicalDevice, size2, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, d->frameOrder[i].dLightBuffer, d->frameOrder[i].dLightBufferMemory);
-        vkMapMemory(d->device, d->frameOrder[i].dLightBufferMemory, 0, size2, 0, &(d->frameOrder[i].lightMappedMemory));
+        d->memory->createBuffer(size2, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, required, d->frameOrder[i].dLightBuffer, d->frameOrder[i].dLightAllocation, preferred, MemoryCategory::Uniform);
+        d->frameOrder[i].lightMappedMemory = d->frameOrder[i].dLightAllocation.mapped;
 
-        createBuffer(d->device, d->physicalDevice, size3, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, d->frameOrder[i].vLightBuffer, d->frameOrder[i].vLightMemory);
+        d->memory->createBuffer(size3, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, required, d->frameOrder[i].vLightBuffer, d->frameOrder[i].vLightAllocation, preferred, MemoryCategory::Uniform);
+        d->frameOrder[i].vLightMappedMemory = d->frameOrder[i].vLightAllocation.mapped;
+        d->frameOrder[i].vLightDirty.mark(0, sizeof(glm::vec4));
     }
 }
 
@@ -1195,7 +1519,16 @@ inline void createSyncObjects(Drawer* d) {
 }
 
 inline void createKTXstuff(Drawer* d) {
-    d->ktxVulkanInfo = ktxVulkanDeviceInfo_CreateEx(d->instance, d->physicalDevice, d->device, d->graphicsQueue, d->commandPool, nullptr, nullptr);
+    /* Not the frame pool, that one is only touched by the render thread */
+    VkCommandPoolCreateInfo poolInfo{};
+    poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    poolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+    poolInfo.queueFamilyIndex = d->graphicsFamily;
+    if (vkCreateCommandPool(d->device, &poolInfo, nullptr, &d->ktxCommandPool) != VK_SUCCESS) {
+        throw std::runtime_error("failed to create command pool!");
+    }
+
+    d->ktxVulkanInfo = ktxVulkanDeviceInfo_CreateEx(d->instance, d->physicalDevice, d->device, d->graphicsQueue, d->ktxCommandPool, nullptr, nullptr);
 }
 
 inline void test(Drawer* d) {
@@ -1227,18 +1560,104 @@ Drawer::Drawer() {
     this->init();
 }
 
+Drawer::Drawer(Threading* threading, bool headless) {
+    this->threading = threading;
+    this->headless = headless;
+    this->init();
+}
+
+/* A pipeline compiling on a worker, see Drawer::compilePipeline */
+struct render::PendingPipeline {
+    std::function<VkPipeline()> build;
+    std::function<void(VkPipeline)> apply;
+    VkPipeline pipeline = VK_NULL_HANDLE;
+    Work work;
+
+    PendingPipeline(std::function<VkPipeline()> build, std::function<void(VkPipeline)> apply)
+        : build(build), apply(apply), work(this, [](void* args) {
+            PendingPipeline* pending = static_cast<PendingPipeline*>(args);
+            /* A throw would take the worker down, a failed pipeline leaves the fallback in place */
+            try {
+                pending->pipeline = pending->build();
+            }
+            catch (const std::exception& e) {
+                std::cout << "Pipeline compilation failed: " << e.what() << "\n";
+            }
+        }) {
+    }
+};
+
+void Drawer::compilePipeline(std::function<VkPipeline()> build, std::function<void(VkPipeline)> apply) {
+    if (threading == nullptr) {
+        apply(build());
+        return;
+    }
+    PendingPipeline* pending = new PendingPipeline(build, apply);
+    pendingPipelines.push_back(pending);
+    threading->addBackgroundWork(&pending->work);
+}
+
+void Drawer::collectPipelines() {
+    if (pendingPipelines.empty()) return;
+
+    bool anyDone = false;
+    for (size_t i = 0; i < pendingPipelines.size(); i++)
+    {
+        anyDone |= pendingPipelines[i]->work.completion.load();
+    }
+    if (!anyDone) return;
+    /* Drops finished work from the schedule before it is freed */
+    threading->update();
+
+    for (size_t i = 0; i < pendingPipelines.size();)
+    {
+        PendingPipeline* pending = pendingPipelines[i];
+        if (!pending->work.completion) {
+            i++;
+            continue;
+        }
+        /* The worker may still be releasing ownership after flagging completion */
+        { std::lock_guard<std::mutex> wait(pending->work.ownership); }
+
+        if (pending->pipeline != VK_NULL_HANDLE) pending->apply(pending->pipeline);
+        delete pending;
+        pendingPipelines.erase(pendingPipelines.begin() + i);
+    }
+}
+
+void Drawer::finishPipelines() {
+    for (size_t i = 0; i < pendingPipelines.size(); i++)
+    {
+        /* Compiles it here when no worker has claimed it yet */
+        Work& w = pendingPipelines[i]->work;
+        if (!w.completion && w.ownership.try_lock()) {
+            if (!w.completion) {
+                w.func(w.args);
+                w.completion = true;
+            }
+            w.ownership.unlock();
+        }
+        while (!w.completion) {
+            std::this_thread::yield();
+        }
+    }
+    collectPipelines();
+}
+
 void Drawer::init() {
-    glfwInit();
-    glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
-    glfwWindowHint(GLFW_RESIZABLE, GLFW_FALSE);
+    if (!headless) {
+        glfwInit();
+        glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
+        glfwWindowHint(GLFW_RESIZABLE, GLFW_FALSE);
 
-    window = glfwCreateWindow(WIDTH, HEIGHT, "Vulkan", nullptr, nullptr);
-    glfwSetWindowUserPointer(window, this);
-    glfwSetFramebufferSizeCallback(window, resizeCallback);
+        window = glfwCreateWindow(WIDTH, HEIGHT, "Vulkan", nullptr, nullptr);
+        glfwSetWindowUserPointer(window, this);
+        glfwSetFramebufferSizeCallback(window, resizeCallback);
+    }
 
     createInstance(this);
 
-    if (glfwCreateWindowSurface(instance, window, nullptr, &surface) != VK_SUCCESS) {
+    if (!headless && glfwCreateWindowSurface(instance, window, nullptr, &surface) != VK_SUCCESS) {
         throw std::runtime_error("failed to create window surface!");
     }
 
@@ -1246,18 +1665,34 @@ void Drawer::init() {
 
     pickDevice(this);
     createLogicalDevice(this);
-    createSwapchain(this); //frames resized here
-    createImageViews(this);
+    memory = new GpuAllocator(device, physicalDevice);
+    queues = new QueueFunnel(device, { graphicsQueue, presentQueue, transferQueue });
+    deletions = new DeletionQueue(device, memory);
+    pipelines = new PipelineRegistry(device, physicalDevice, pipelineCachePath);
+    vertexPool = new MeshPool(memory, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, sizeof(Vertex), vertexBlockElements, "Vertex", { graphicsFamily, transferFamily });
+    indexPool = new MeshPool(memory, VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, sizeof(uint16_t), indexBlockElements, "Index", { graphicsFamily, transferFamily });
+    budget = new MemoryBudget(instance, physicalDevice, memory, memoryBudgetExtension, FRAMES_IN_FLIGHT + 1);
+    if (headless) {
+        /* No frames, so no framebuffers, the render pass is still made for the pipelines */
+        format = VK_FORMAT_B8G8R8A8_SRGB;
+        extent = { WIDTH, HEIGHT };
+    }
+    else {
+        createSwapchain(this); //frames resized here
+        createImageViews(this);
+    }
     createRenderPass(this);
     createDepthOnlyPass(this);
     createDepthStuff(this);
     createFramebuffers(this);
     std::cout << "Creating buffers and pools...\n";
     createCommandPool(this);
+    staging = new StagingRing(device, physicalDevice, memory, queues, transferQueue, transferFamily, graphicsQueue, graphicsFamily, stagingRingSize);
     createDescriptorPool(this);
     createUniformBuffers(this);
     createCommandBuffers(this);
     createShadowDescSetLayout(this);
+    createInstanceSetLayout(this);
     createShadowAtlas(this);
     mainLight = new Light(this, glm::mat4(10.0), 60, true);
 
@@ -1270,15 +1705,88 @@ void Drawer::init() {
     //createSkybox(this);
     std::cout << "Creating sync objects...\n";
     createSyncObjects(this);
+    /* The shadow pipeline has no fallback */
+    finishPipelines();
+    if (shadowPipeline == VK_NULL_HANDLE) {
+        throw std::runtime_error("failed to create graphics pipeline!");
+    }
+    /* In the background, frames start drawing meanwhile */
+    precompileMaterialVariants();
 
-    vkUtil::init(device, physicalDevice, graphicsQueue);
-
-    vertexLights.push_back({{10, 10, 1, 0}, {1, 0, 1, 0}});
+    addVertexLight({{10, 10, 1, 0}, {1, 0, 1, 0}});
 
     //glfw
 }
 
-void Drawer::loadMesh(const char* dir, uint16_t* index, uint16_t materialIndex) {
+GpuCuller* Drawer::enableGpuCulling() {
+    if (culler == nullptr && indirectDrawing) {
+        PFN_vkCmdDrawIndexedIndirectCountKHR drawIndirectCount = nullptr;
+        if (drawIndirectCountExtension) drawIndirectCount = (PFN_vkCmdDrawIndexedIndirectCountKHR)vkGetDeviceProcAddr(device, "vkCmdDrawIndexedIndirectCountKHR");
+        culler = new GpuCuller(this, drawIndirectCount);
+    }
+    return culler;
+}
+
+void DirtyRange::mark(size_t from, size_t to) {
+    begin = std::min(begin, from);
+    end = std::max(end, to);
+}
+
+bool DirtyRange::empty() const {
+    return begin >= end;
+}
+
+void DirtyRange::clear() {
+    begin = SIZE_MAX;
+    end = 0;
+}
+
+inline void markVertexLights(Drawer* d, size_t from, size_t to) {
+    for (size_t i = 0; i < d->frameOrder.size(); i++)
+    {
+        d->frameOrder[i].vLightDirty.mark(from, to);
+    }
+}
+
+inline size_t vertexLightOffset(uint32_t index) {
+    return sizeof(glm::vec4) + index * sizeof(VertexLight);
+}
+
+uint32_t Drawer::addVertexLight(const VertexLight& light) {
+    if (vertexLights.size() >= maxVertLights) {
+        throw std::runtime_error("Too many vertex lights");
+    }
+
+    uint32_t index = static_cast<uint32_t>(vertexLights.size());
+    vertexLights.push_back(light);
+    markVertexLights(this, 0, sizeof(glm::vec4));
+    markVertexLights(this, vertexLightOffset(index), vertexLightOffset(index + 1));
+    return index;
+}
+
+void Drawer::setVertexLight(uint32_t index, const VertexLight& light) {
+    if (index >= vertexLights.size()) {
+        throw std::runtime_error("Vertex light index out of range");
+    }
+
+    vertexLights[index] = light;
+    markVertexLights(this, vertexLightOffset(index), vertexLightOffset(index + 1));
+}
+
+void Drawer::removeVertexLight(uint32_t index) {
+    if (index >= vertexLights.size()) {
+        throw std::runtime_error("Vertex light index out of range");
+    }
+
+    vertexLights[index] = vertexLights.back();
+    vertexLights.pop_back();
+    markVertexLights(this, 0, sizeof(glm::vec4));
+    if (index < vertexLights.size()) {
+        markVertexLights(this, vertexLightOffset(index), vertexLightOffset(index + 1));
+    }
+}
+
+void Drawer::loadMesh(const char* dir, uint16_t* index, uint16_t materialIndex, bool keepHostGeometry) {
     tinyobj::attrib_t attributes;
     std::vector<tinyobj::shape_t> shapes;
     std::vector<tinyobj::material_t> materials;
@@ -1310,20 +1818,87 @@ void Drawer::loadMesh(const char* dir, uint16_t* index, uint16_t materialIndex)
 
     submeshes.push_back(Submesh::SubmeshCreateInfo(submeshIndices.data(), submeshIndices.size(), materialIndex));
 
-    Mesh m(this, vertices.data(), vertices.size(), submeshes);
+    Mesh m(this, vertices.data(), vertices.size(), submeshes, keepHostGeometry);
     registeredMeshes.push_back(m);
     *index = registeredMeshes.size() - 1;
 }
 
-void Drawer::beginPass(std::vector<VkClearValue> clearValues) {
-    beginPass(frames[currentSwapchainIndex].framebuffer, renderPass, clearValues, extent);
+inline void copyPoolMoves(VkCommandBuffer cmdBuffer, const std::vector<PoolMove>& moves, VkDeviceSize stride) {
+    for (size_t i = 0; i < moves.size(); i++)
+    {
+        VkBufferCopy copy{};
+        copy.srcOffset = moves[i].from.offset * stride;
+        copy.dstOffset = moves[i].to.offset * stride;
+        copy.size = moves[i].from.count * stride;
+        vkCmdCopyBuffer(cmdBuffer, moves[i].from.buffer, moves[i].to.buffer, 1, &copy);
+    }
+}
+
+void Drawer::defragmentMeshes() {
+    if (!vertexPool->fragmented() && !indexPool->fragmented()) return;
+
+    staging->flush();
+    queues->waitDeviceIdle();
+
+    std::vector<PoolRange*> vertexRanges;
+    std::vector<PoolRange*> indexRanges;
+    for (size_t i = 0; i < registeredMeshes.size(); i++)
+    {
+        Mesh& m = registeredMeshes[i];
+        if (!m.ownBuffers) vertexRanges.push_back(&m.vertexRange);
+        for (size_t j = 0; j < m.submeshes.size(); j++)
+        {
+            if (!m.submeshes[j].ownBuffer) indexRanges.push_back(&m.submeshes[j].indexRange);
+        }
+    }
+
+    std::vector<PoolMove> vertexMoves;
+    std::vector<PoolMove> indexMoves;
+    vertexPool->compact(vertexRanges, vertexMoves);
+    indexPool->compact(indexRanges, indexMoves);
+    if (vertexMoves.empty() && indexMoves.empty()) return;
+
+    /* One submit for every copy, moves never overlap so they need no barriers between them */
+    VkCommandBuffer cmdBuffer = beginSimpleCommands(device, commandPool);
+    copyPoolMoves(cmdBuffer, vertexMoves, vertexPool->elementSize());
+    copyPoolMoves(cmdBuffer, indexMoves, indexPool->elementSize());
+    endSimpleCommands(device, commandPool, cmdBuffer, queues, graphicsQueue);
+
+    vertexPool->release(vertexMoves);
+    indexPool->release(indexMoves);
+
+    for (size_t i = 0; i < registeredMeshes.size(); i++)
+    {
+        Mesh& m = registeredMeshes[i];
+        if (!m.ownBuffers && m.vertexRange.count != 0) {
+            m.vertexBuffer = m.vertexRange.buffer;
+            m.vertexOffset = m.vertexRange.offset;
+        }
+        for (size_t j = 0; j < m.submeshes.size(); j++)
+        {
+            Submesh& s = m.submeshes[j];
+            if (s.ownBuffer || s.indexRange.count == 0) continue;
+            s.indexBuffer = s.indexRange.buffer;
+            s.firstIndex = s.indexRange.offset;
+        }
+    }
+    /* They bound the old buffers and offsets */
+    invalidateCachedSecondaries();
+}
+
+void Drawer::beginPass(std::vector<VkClearValue> clearValues, VkSubpassContents contents) {
+    beginPass(frames[currentSwapchainIndex].framebuffer, renderPass, clearValues, extent, contents);
 };
 
-void Drawer::beginPass(VkFramebuffer frame, VkRenderPass pass, std::vector<VkClearValue> clearValues, VkExtent2D ext) {
-    Drawer::beginPass(frame, pass, clearValues, ext, { 0, 0 });
+void Drawer::beginPass(VkFramebuffer frame, VkRenderPass pass, std::vector<VkClearValue> clearValues, VkExtent2D ext, VkSubpassContents contents) {
+    Drawer::beginPass(frame, pass, clearValues, ext, { 0, 0 }, contents);
 }
 
-void Drawer::beginPass(VkFramebuffer frame, VkRenderPass pass, std::vector<VkClearValue> clearValues, VkExtent2D ext, VkOffset2D offset) {
+void Drawer::beginPass(VkFramebuffer frame, VkRenderPass pass, std::vector<VkClearValue> clearValues, VkExtent2D ext, VkOffset2D offset, VkSubpassContents contents) {
+    activePass = pass;
+    activeFramebuffer = frame;
+    activeExtent = ext;
+
     VkRenderPassBeginInfo renderPassInfo{};
     renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
     renderPassInfo.renderPass = pass;
@@ -1338,7 +1913,10 @@ void Drawer::beginPass(VkFramebuffer frame, VkRenderPass pass, std::vector<VkCle
     std::cout << "Beginning render pass...\n";
 #endif
 
-    vkCmdBeginRenderPass(frameOrder[currentFrame].frameCommandBuffer, &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
+    vkCmdBeginRenderPass(frameOrder[currentFrame].frameCommandBuffer, &renderPassInfo, contents);
+
+    /* Secondaries don't inherit dynamic state, beginSecondary sets it in each of them */
+    if (contents == VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS) return;
 
     VkViewport viewport{};
     viewport.x = 0.0f;
@@ -1355,11 +1933,16 @@ void Drawer::beginPass(VkFramebuffer frame, VkRenderPass pass, std::vector<VkCle
     vkCmdSetScissor(frameOrder[currentFrame].frameCommandBuffer, 0, 1, &scissor);
 }
 
+glm::mat4 Drawer::cameraProjection(double FOV) const {
+    glm::mat4 proj = glm::perspective(glm::radians(FOV), extent.width / (double)extent.height, 0.1, 10000.0);
+    proj[1][1] *= -1;
+    return proj;
+}
+
 inline void updateUBOs(Drawer* d, int frame, glm::mat4 cameraView, double FOV, std::vector<glm::mat4> lightViews, std::vector<double> lightFOVs) {
     UniformBufferObject ubo{};
     ubo.view = cameraView;
-    ubo.proj = glm::perspective(glm::radians(FOV), d->extent.width / (double)d->extent.height, 0.1, 10000.0);
-    ubo.proj[1][1] *= -1;
+    ubo.proj = d->cameraProjection(FOV);
     memcpy(d->frameOrder[frame].uniformMappedMemory, &ubo, sizeof(ubo));
 
     LightBufferObject lbo{};
@@ -1388,21 +1971,22 @@ inline void updateUBOs(Drawer* d, int frame, glm::mat4 cameraView, double FOV, s
     sad.projs = projs.data();
     memcpy(d->frameOrder[frame].lightMappedMemory, &sad, sizeof(sad));
 
-    vkUtil::begincpy(d->device, d->commandPool);
-    VkBufferCopy cpy1{};
-    cpy1.dstOffset = 0;
-    cpy1.srcOffset = 0;
-    cpy1.size = sizeof(glm::vec4);
-    glm::vec4 data;
-    data.x = static_cast<float>(d->vertexLights.size());
-    vkUtil::gpumemcpy(d->device, d->physicalDevice, d->graphicsQueue, d->commandPool, d->frameOrder[frame].vLightBuffer, &data, cpy1);
-
-    VkBufferCopy cpy2{};
-    cpy2.dstOffset = sizeof(glm::vec4);
-    cpy2.srcOffset = 0;
-    cpy2.size = sizeof(VertexLight) * d->vertexLights.size();
-    vkUtil::gpumemcpy(d->device, d->physicalDevice, d->graphicsQueue, d->commandPool, d->frameOrder[frame].vLightBuffer, d->vertexLights.data(), cpy2);
-    vkUtil::endcpy(d->device, d->commandPool, d->graphicsQueue);
+    /* The frame's fence has signaled, nothing reads its buffers until it is submitted again */
+    FrameOrderEntry& f = d->frameOrder[frame];
+    if (!f.vLightDirty.empty()) {
+        char* dst = static_cast<char*>(f.vLightMappedMemory);
+        if (f.vLightDirty.begin < sizeof(glm::vec4)) {
+            glm::vec4 header(static_cast<float>(d->vertexLights.size()), 0, 0, 0);
+            memcpy(dst, &header, sizeof(header));
+        }
+
+        size_t from = std::max(f.vLightDirty.begin, sizeof(glm::vec4));
+        size_t to = std::min(f.vLightDirty.end, sizeof(glm::vec4) + d->vertexLights.size() * sizeof(VertexLight));
+        if (from < to) {
+            memcpy(dst + from, reinterpret_cast<const char*>(d->vertexLights.data()) + (from - sizeof(glm::vec4)), to - from);
+        }
+        f.vLightDirty.clear();
+    }
 
 #ifdef DEBUG_GRAPHICS
     std::cout << lbo.proj[0][0] << " " << lbo.proj[0][1] << " " << lbo.proj[0][2] << " " << lbo.proj[0][3] << "\n";
@@ -1440,11 +2024,16 @@ void Drawer::beginFrame(glm::mat4 cameraView, double FOV, std::vector<glm::mat4>
     ubo.proj[1][1] *= -1;
     memcpy(frameOrder[currentFrame].uniformMappedMemory, &ubo, sizeof(ubo));*/
 
-    updateUBOs(this, currentFrame, cameraView, FOV, lightViews, lightFOVs);
-
     vkWaitForFences(device, 1, &frameOrder[currentFrame].fence, true, UINT64_MAX);
+    /* Queue submission order means every frame up to the one that last used this entry is done */
+    deletions->retire(frameOrder[currentFrame].frameNumber);
+    collectPipelines();
+
+    updateUBOs(this, currentFrame, cameraView, FOV, lightViews, lightFOVs);
+    previousViewProjection = viewProjection;
+    viewProjection = cameraProjection(FOV) * cameraView;
 
-    VkResult result = vkAcquireNextImageKHR(device, presentSwapchain, UINT64_MAX, frameOrder[currentFrame].imageAvailable, VK_NULL_HANDLE, &currentSwapchainIndex);
+    VkResult result = headless ? VK_SUCCESS : vkAcquireNextImageKHR(device, presentSwapchain, UINT64_MAX, frameOrder[currentFrame].imageAvailable, VK_NULL_HANDLE, &currentSwapchainIndex);
 
     if (result == VK_ERROR_OUT_OF_DATE_KHR) {
         recreateSwapchain();
@@ -1455,8 +2044,16 @@ void Drawer::beginFrame(glm::mat4 cameraView, double FOV, std::vector<glm::mat4>
     }
 
     vkResetFences(device, 1, &frameOrder[currentFrame].fence);
+    frameOrder[currentFrame].frameNumber = deletions->nextFrame();
+    budget->update(frameOrder[currentFrame].frameNumber);
 
     vkResetCommandBuffer(frameOrder[currentFrame].frameCommandBuffer, 0);
+    for (size_t i = 0; i < frameOrder[currentFrame].recordingSlots.size(); i++)
+    {
+        RecordingSlot& slot = frameOrder[currentFrame].recordingSlots[i];
+        vkResetCommandPool(device, slot.pool, 0);
+        slot.used = 0;
+    }
 
     VkCommandBufferBeginInfo beginInfo{};
     beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
@@ -1464,11 +2061,22 @@ void Drawer::beginFrame(glm::mat4 cameraView, double FOV, std::vector<glm::mat4>
     if (vkBeginCommandBuffer(frameOrder[currentFrame].frameCommandBuffer, &beginInfo) != VK_SUCCESS) {
         throw std::runtime_error("failed to begin recording command buffer!");
     }
+    frameOrder[currentFrame].context = DrawContext{};
+    frameOrder[currentFrame].context.commandBuffer = frameOrder[currentFrame].frameCommandBuffer;
+    frameOrder[currentFrame].instances.used = 0;
+
+    std::lock_guard<std::mutex> guard(statsLock);
+    lastFrameStats = frameStats;
+    frameStats = DrawStats{};
 }
 
 void Drawer::bindShadowPassPipeline() {
-    vkCmdBindPipeline(frameOrder[currentFrame].frameCommandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, shadowPipeline);
-    vkCmdBindDescriptorSets(frameOrder[currentFrame].frameCommandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, shadowPipelineLayout, 0, 1, &(frameOrder[currentFrame].frameDescSet), 0, nullptr);
+    bindShadowPassPipeline(frameOrder[currentFrame].context);
+}
+
+void Drawer::bindShadowPassPipeline(DrawContext& context) {
+    context.bindPipeline(shadowPipeline, shadowPipelineLayout);
+    context.bindDescriptorSets(shadowPipelineLayout, 0, 1, &(frameOrder[currentFrame].frameDescSet));
 }
 
 /* Record the command buffer with all the draw commands */
@@ -1479,39 +2087,426 @@ void Drawer::draw(Sprite* s) {
 
 }
 void Drawer::draw(Mesh* m, Submesh* s, Material* mat, glm::mat4 modelMatrix, glm::vec4 data, bool bindMaterial) {
-    if ((frameOrder[currentFrame].boundMaterial == nullptr || mat != frameOrder[currentFrame].boundMaterial) && bindMaterial) {
 #ifdef DEBUG_GRAPHICS
-        std::cout << "Binding new material...\n";
+    std::cout << "Beginning draw...\n";
+    std::cout << "Index count: " << s->iBufferSize << "\n";
 #endif
-        frameOrder[currentFrame].boundMaterial = mat;
-        vkCmdBindPipeline(frameOrder[currentFrame].frameCommandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, mat->pipeline);
-        std::vector<VkDescriptorSet> sets = { frameOrder[currentFrame].frameDescSet, (mat->materialDescriptor) };
-        vkCmdBindDescriptorSets(frameOrder[currentFrame].frameCommandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, mat->layout, 0, sets.size(), sets.data(), 0, nullptr);
+    draw(frameOrder[currentFrame].context, DrawItem{ m, s, mat, modelMatrix, data }, bindMaterial);
+}
+void Drawer::draw(Mesh* m, Submesh* s, Material* mat, glm::mat4 modelMatrix, bool bindMaterial) {
+    draw(m, s, mat, modelMatrix, glm::vec4(0), bindMaterial);
+}
+
+/* Draws recorded before the buffer grows keep the old one and its set, so the new one starts empty rather than with a copy */
+inline InstanceData* reserveInstances(Drawer* d, InstanceBuffer& target, uint32_t count, uint32_t& firstInstance) {
+    if (target.used + count > target.capacity) {
+        if (target.buffer != VK_NULL_HANDLE) {
+            d->deletions->buffer(target.buffer, target.allocation);
+            d->deletions->descriptorSet(d->descPool, target.set);
+        }
+
+        target.capacity = std::max({ target.capacity * 2, count, 256u });
+        target.used = 0;
+        d->memory->createBuffer(sizeof(InstanceData) * target.capacity, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, target.buffer, target.allocation,
+            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, MemoryCategory::Uniform);
+        target.mapped = static_cast<InstanceData*>(target.allocation.mapped);
+
+        VkDescriptorSetAllocateInfo allocInfo{};
+        allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+        allocInfo.descriptorPool = d->descPool;
+        allocInfo.descriptorSetCount = 1;
+        allocInfo.pSetLayouts = &d->instanceSetLayout;
+
+        if (vkAllocateDescriptorSets(d->device, &allocInfo, &target.set) != VK_SUCCESS) {
+            throw std::runtime_error("failed to allocate descriptor sets!");
+        }
+
+        VkDescriptorBufferInfo bufferInfo{};
+        bufferInfo.buffer = target.buffer;
+        bufferInfo.offset = 0;
+        bufferInfo.range = VK_WHOLE_SIZE;
+
+        VkWriteDescriptorSet write{};
+        write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        write.dstSet = target.set;
+        write.dstBinding = 0;
+        write.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        write.descriptorCount = 1;
+        write.pBufferInfo = &bufferInfo;
+        vkUpdateDescriptorSets(d->device, 1, &write, 0, nullptr);
+    }
+
+    firstInstance = target.used;
+    target.used += count;
+    return target.mapped + firstInstance;
+}
+
+void Drawer::draw(DrawContext& context, const DrawItem& item, bool bindMaterial) {
+    InstanceBuffer& instances = frameOrder[currentFrame].instances;
+    uint32_t firstInstance;
+    InstanceData* instance = reserveInstances(this, instances, 1, firstInstance);
+    writeInstances(&item, instance, 1);
+
+    draw(context, DrawBatch{ item.mesh, item.submesh, item.material, instances.buffer, instances.set, firstInstance, 1 }, bindMaterial);
+}
+
+uint32_t Drawer::materialIndex(const Material* material) const {
+    return static_cast<uint32_t>(material - registeredMaterials.data());
+}
+
+/* Below this the workers cost more than they save */
+const size_t instanceWriteGrain = 256;
+
+inline void writeInstanceRange(const Drawer* d, const DrawItem* items, InstanceData* instances, size_t begin, size_t end) {
+    for (size_t i = begin; i < end; i++)
+    {
+        InstanceData& instance = instances[i];
+        instance.model = items[i].model;
+        instance.mvp = d->viewProjection * items[i].model;
+        instance.previousMvp = d->previousViewProjection * items[i].model;
+        instance.data = items[i].data;
+        instance.materialIndex = d->materialIndex(items[i].material);
+    }
+}
+
+/* Instances kept across frames only need the camera part redone */
+inline void refreshInstances(Drawer* d, InstanceBuffer& instances) {
+    auto refresh = [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++)
+        {
+            InstanceData& instance = instances.mapped[i];
+            instance.mvp = d->viewProjection * instance.model;
+            instance.previousMvp = d->previousViewProjection * instance.model;
+        }
+    };
+    if (d->threading == nullptr || instances.used < 2 * instanceWriteGrain) refresh(0, instances.used);
+    else d->threading->parallelFor(instances.used, instanceWriteGrain, refresh);
+}
+
+void Drawer::writeInstances(const DrawItem* items, InstanceData* instances, size_t count) {
+    if (threading == nullptr || count < 2 * instanceWriteGrain) {
+        writeInstanceRange(this, items, instances, 0, count);
+        return;
+    }
+    threading->parallelFor(count, instanceWriteGrain, [&](size_t begin, size_t end) {
+        writeInstanceRange(this, items, instances, begin, end);
+    });
+}
+
+void Drawer::bindBatch(DrawContext& context, const DrawBatch& batch, bool bindMaterial) {
+    if (bindMaterial) {
+        context.bindPipeline(batch.material->pipeline, batch.material->layout);
+        VkDescriptorSet sets[] = { frameOrder[currentFrame].frameDescSet, batch.material->materialDescriptor, batch.instanceSet };
+        context.bindDescriptorSets(batch.material->layout, 0, 3, sets);
+    }
+    else {
+        /* The shadow pipeline has the light at set 0 and the instances right after */
+        context.bindDescriptorSets(shadowPipelineLayout, 1, 1, &batch.instanceSet);
+    }
+
+    context.bindVertexBuffer(0, batch.mesh->vertexBuffer, 0);
+    context.bindIndexBuffer(batch.submesh->indexBuffer, 0, VK_INDEX_TYPE_UINT16);
+}
+
+void Drawer::draw(DrawContext& context, const DrawBatch& batch, bool bindMaterial) {
+    bindBatch(context, batch, bindMaterial);
+    context.drawIndexed(static_cast<uint32_t>(batch.submesh->iBufferSize), batch.instanceCount, batch.submesh->firstIndex, static_cast<int32_t>(batch.mesh->vertexOffset), batch.firstInstance);
+}
+
+void Drawer::batchDraws(std::vector<DrawItem>& items, std::vector<DrawBatch>& batches, InstanceBuffer& instances) {
+    if (items.empty()) return;
+
+    /* Pipeline and material set first so batches that share them end up next to each other too.
+     * Bindless materials all share both, so their draws of a mesh sort together whatever the material.
+     */
+    std::sort(items.begin(), items.end(), [](const DrawItem& a, const DrawItem& b) {
+        if (a.material->pipeline != b.material->pipeline) return a.material->pipeline < b.material->pipeline;
+        if (a.material->materialDescriptor != b.material->materialDescriptor) return a.material->materialDescriptor < b.material->materialDescriptor;
+        if (a.mesh != b.mesh) return a.mesh < b.mesh;
+        if (a.submesh != b.submesh) return a.submesh < b.submesh;
+        return a.material < b.material;
+    });
+
+    /* One reservation for everything, so the whole pass shares one buffer */
+    uint32_t firstInstance;
+    InstanceData* mapped = reserveInstances(this, instances, static_cast<uint32_t>(items.size()), firstInstance);
+
+    writeInstances(items.data(), mapped, items.size());
+
+    for (size_t i = 0; i < items.size(); i++)
+    {
+        DrawBatch* last = batches.empty() ? nullptr : &batches.back();
+        if (i > 0 && last->mesh == items[i].mesh && last->submesh == items[i].submesh && last->material->sharesBindings(items[i].material)) {
+            last->instanceCount++;
+            continue;
+        }
+        batches.push_back({ items[i].mesh, items[i].submesh, items[i].material, instances.buffer, instances.set, firstInstance + static_cast<uint32_t>(i), 1 });
+    }
+}
+
+InstanceBuffer& Drawer::frameInstances() {
+    return frameOrder[currentFrame].instances;
+}
+
+InstanceBuffer& Drawer::cachedInstances(uint32_t key) {
+    return frameOrder[currentFrame].cachedSecondaries[key].instances;
+}
+
+void DrawStats::add(const DrawStats& other) {
+    pipelineBinds += other.pipelineBinds;
+    pipelineSkips += other.pipelineSkips;
+    descriptorBinds += other.descriptorBinds;
+    descriptorSkips += other.descriptorSkips;
+    vertexBufferBinds += other.vertexBufferBinds;
+    vertexBufferSkips += other.vertexBufferSkips;
+    indexBufferBinds += other.indexBufferBinds;
+    indexBufferSkips += other.indexBufferSkips;
+    draws += other.draws;
+}
+
+void DrawStats::report(std::ostream& out) const {
+    out << "Draws: " << draws << "\n";
+    out << "\tpipelines " << pipelineBinds << " bound, " << pipelineSkips << " skipped\n";
+    out << "\tdescriptor sets " << descriptorBinds << " bound, " << descriptorSkips << " skipped\n";
+    out << "\tvertex buffers " << vertexBufferBinds << " bound, " << vertexBufferSkips << " skipped\n";
+    out << "\tindex buffers " << indexBufferBinds << " bound, " << indexBufferSkips << " skipped\n";
+}
+
+void DrawContext::useLayout(VkPipelineLayout layout) {
+    if (layout == this->layout) return;
+    /* Every layout here is built the same way, but nothing guarantees it, so a new layout starts clean */
+    this->layout = layout;
+    for (uint32_t i = 0; i < maxSets; i++)
+    {
+        sets[i] = VK_NULL_HANDLE;
+    }
+}
+
+void DrawContext::bindPipeline(VkPipeline pipeline, VkPipelineLayout layout) {
+    if (pipeline == this->pipeline) {
+        stats.pipelineSkips++;
+        return;
     }
 #ifdef DEBUG_GRAPHICS
-    std::cout << "Beginning draw...\n";
-    std::cout << "Index count: " << s->iBufferSize << "\n";
+    std::cout << "Binding new pipeline...\n";
 #endif
+    this->pipeline = pipeline;
+    useLayout(layout);
+    vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline);
+    stats.pipelineBinds++;
+}
 
-    VkBuffer vertBuffers[] = { m->vertexBuffer };
-    VkDeviceSize offsets[] = { 0 };
-    PushConstant push{};
-    push.model = modelMatrix;
-    push.data = data;
+void DrawContext::bindDescriptorSets(VkPipelineLayout layout, uint32_t firstSet, uint32_t count, const VkDescriptorSet* sets) {
+    useLayout(layout);
 
-    //std::cout << modelMatrix[0][0] << " " << modelMatrix[1][0] << " " << modelMatrix[2][0] << " " << modelMatrix[3][0] << "\n";
-    //std::cout << modelMatrix[0][1] << " " << modelMatrix[1][1] << " " << modelMatrix[2][1] << " " << modelMatrix[3][1] << "\n";
-    //std::cout << modelMatrix[0][2] << " " << modelMatrix[1][2] << " " << modelMatrix[2][2] << " " << modelMatrix[3][2] << "\n";
-    //std::cout << modelMatrix[0][3] << " " << modelMatrix[1][3] << " " << modelMatrix[2][3] << " " << modelMatrix[3][3] << "\n";
+    /* Binding a set disturbs none of the others with a compatible layout, so only the changed range goes out */
+    uint32_t first = count;
+    uint32_t last = 0;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (this->sets[firstSet + i] == sets[i]) continue;
+        if (first == count) first = i;
+        last = i;
+    }
+    if (first == count) {
+        stats.descriptorSkips += count;
+        return;
+    }
 
-    vkCmdBindVertexBuffers(frameOrder[currentFrame].frameCommandBuffer, 0, 1, vertBuffers, offsets);
-    vkCmdBindIndexBuffer(frameOrder[currentFrame].frameCommandBuffer, s->indexBuffer, 0, VK_INDEX_TYPE_UINT16);
-    vkCmdPushConstants(frameOrder[currentFrame].frameCommandBuffer, mat->layout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(PushConstant), &push);
-    vkCmdDrawIndexed(frameOrder[currentFrame].frameCommandBuffer, static_cast<uint32_t>(s->iBufferSize), 1, 0, 0, 0);
-    //Pipeline not being bound?
+    for (uint32_t i = first; i <= last; i++)
+    {
+        this->sets[firstSet + i] = sets[i];
+    }
+    vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, layout, firstSet + first, last - first + 1, sets + first, 0, nullptr);
+    stats.descriptorBinds += last - first + 1;
+    stats.descriptorSkips += count - (last - first + 1);
 }
-void Drawer::draw(Mesh* m, Submesh* s, Material* mat, glm::mat4 modelMatrix, bool bindMaterial) {
-    draw(m, s, mat, modelMatrix, glm::vec4(0), bindMaterial);
+
+void DrawContext::bindVertexBuffer(uint32_t binding, VkBuffer buffer, VkDeviceSize offset) {
+    if (buffer == vertexBuffers[binding] && offset == vertexOffsets[binding]) {
+        stats.vertexBufferSkips++;
+        return;
+    }
+    vertexBuffers[binding] = buffer;
+    vertexOffsets[binding] = offset;
+    vkCmdBindVertexBuffers(commandBuffer, binding, 1, &buffer, &offset);
+    stats.vertexBufferBinds++;
+}
+
+void DrawContext::bindIndexBuffer(VkBuffer buffer, VkDeviceSize offset, VkIndexType type) {
+    if (buffer == indexBuffer && offset == indexOffset && type == indexType) {
+        stats.indexBufferSkips++;
+        return;
+    }
+    indexBuffer = buffer;
+    indexOffset = offset;
+    indexType = type;
+    vkCmdBindIndexBuffer(commandBuffer, buffer, offset, type);
+    stats.indexBufferBinds++;
+}
+
+void DrawContext::drawIndexed(uint32_t indexCount, uint32_t instanceCount, uint32_t firstIndex, int32_t vertexOffset, uint32_t firstInstance) {
+    vkCmdDrawIndexed(commandBuffer, indexCount, instanceCount, firstIndex, vertexOffset, firstInstance);
+    stats.draws++;
+}
+
+void DrawContext::forget() {
+    VkCommandBuffer buffer = commandBuffer;
+    DrawStats kept = stats;
+    *this = DrawContext{};
+    commandBuffer = buffer;
+    stats = kept;
+}
+
+void Drawer::reserveRecordingSlots(uint32_t count) {
+    for (size_t f = 0; f < frameOrder.size(); f++)
+    {
+        while (frameOrder[f].recordingSlots.size() < count) {
+            VkCommandPoolCreateInfo poolInfo{};
+            poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+            poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+            poolInfo.queueFamilyIndex = graphicsFamily;
+
+            RecordingSlot slot{};
+            if (vkCreateCommandPool(device, &poolInfo, nullptr, &slot.pool) != VK_SUCCESS) {
+                throw std::runtime_error("failed to create command pool!");
+            }
+            frameOrder[f].recordingSlots.push_back(slot);
+        }
+    }
+}
+
+inline VkCommandBuffer allocateSecondary(Drawer* d, VkCommandPool pool) {
+    VkCommandBufferAllocateInfo allocInfo{};
+    allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    allocInfo.commandPool = pool;
+    allocInfo.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY;
+    allocInfo.commandBufferCount = 1;
+
+    VkCommandBuffer buffer;
+    if (vkAllocateCommandBuffers(d->device, &allocInfo, &buffer) != VK_SUCCESS) {
+        throw std::runtime_error("failed to allocate command buffers!");
+    }
+    return buffer;
+}
+
+/* framebuffer may be null, which cached secondaries need since they outlive the swapchain image they were recorded for */
+inline void beginSecondaryRecording(Drawer* d, VkCommandBuffer buffer, VkFramebuffer framebuffer, VkCommandBufferUsageFlags usage) {
+    VkCommandBufferInheritanceInfo inheritance{};
+    inheritance.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+    inheritance.renderPass = d->activePass;
+    inheritance.subpass = 0;
+    inheritance.framebuffer = framebuffer;
+
+    VkCommandBufferBeginInfo beginInfo{};
+    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT | usage;
+    beginInfo.pInheritanceInfo = &inheritance;
+
+    if (vkBeginCommandBuffer(buffer, &beginInfo) != VK_SUCCESS) {
+        throw std::runtime_error("failed to begin recording command buffer!");
+    }
+
+    VkViewport viewport{};
+    viewport.width = static_cast<float>(d->activeExtent.width);
+    viewport.height = static_cast<float>(d->activeExtent.height);
+    viewport.minDepth = 0.0f;
+    viewport.maxDepth = 1.0f;
+    vkCmdSetViewport(buffer, 0, 1, &viewport);
+
+    VkRect2D scissor{};
+    scissor.extent = d->activeExtent;
+    vkCmdSetScissor(buffer, 0, 1, &scissor);
+}
+
+DrawContext Drawer::beginSecondary(uint32_t slot) {
+    RecordingSlot& s = frameOrder[currentFrame].recordingSlots[slot];
+    /* Buffers stay allocated across frames, resetting the pool in beginFrame resets them all */
+    if (s.used == s.buffers.size()) {
+        s.buffers.push_back(allocateSecondary(this, s.pool));
+    }
+
+    DrawContext context{};
+    context.commandBuffer = s.buffers[s.used++];
+    beginSecondaryRecording(this, context.commandBuffer, activeFramebuffer, VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT);
+    return context;
+}
+
+bool Drawer::beginCachedSecondary(uint32_t key, uint64_t version, DrawContext& context) {
+    std::vector<CachedSecondary>& cache = frameOrder[currentFrame].cachedSecondaries;
+    if (cache.size() <= key) cache.resize(key + 1);
+
+    CachedSecondary& c = cache[key];
+    context = DrawContext{};
+    if (c.buffer == VK_NULL_HANDLE) {
+        /* commandPool allows resetting single buffers, beginning one again resets it */
+        c.buffer = allocateSecondary(this, commandPool);
+    }
+    context.commandBuffer = c.buffer;
+
+    if (c.recorded && c.version == version && c.drawerVersion == cacheVersion) {
+        /* Nothing else reads them while this frame's fence is signaled */
+        refreshInstances(this, c.instances);
+        return false;
+    }
+
+    /* This frame's fence has signaled, so its copy isn't pending anywhere, and neither are its instances */
+    c.recorded = true;
+    c.instances.used = 0;
+    c.version = version;
+    c.drawerVersion = cacheVersion;
+    beginSecondaryRecording(this, c.buffer, VK_NULL_HANDLE, 0);
+    return true;
+}
+
+void Drawer::invalidateCachedSecondaries() {
+    cacheVersion++;
+}
+
+VkCommandBuffer Drawer::endSecondary(DrawContext& context) {
+    if (vkEndCommandBuffer(context.commandBuffer) != VK_SUCCESS) {
+        throw std::runtime_error("failed to record command buffer!");
+    }
+    std::lock_guard<std::mutex> guard(statsLock);
+    frameStats.add(context.stats);
+    return context.commandBuffer;
+}
+
+void Drawer::executeSecondaries(const std::vector<VkCommandBuffer>& buffers) {
+    if (buffers.empty()) return;
+    vkCmdExecuteCommands(frameOrder[currentFrame].frameCommandBuffer, static_cast<uint32_t>(buffers.size()), buffers.data());
+    /* Whatever the secondaries bound is undefined in the primary afterwards */
+    frameOrder[currentFrame].context.forget();
+}
+
+Frustum::Frustum(const glm::mat4& viewProjection) {
+    glm::mat4 m = glm::transpose(viewProjection);
+    planes[0] = m[3] + m[0];
+    planes[1] = m[3] - m[0];
+    planes[2] = m[3] + m[1];
+    planes[3] = m[3] - m[1];
+    /* w + z holds for both depth conventions, it is only looser than z >= 0 */
+    planes[4] = m[3] + m[2];
+    planes[5] = m[3] - m[2];
+}
+
+bool Frustum::intersects(const glm::vec3& boundsMin, const glm::vec3& boundsMax, const glm::mat4& model) const {
+    /* World space box around the transformed bounds */
+    glm::vec3 center = glm::vec3(model * glm::vec4((boundsMin + boundsMax) * 0.5f, 1.0f));
+    glm::vec3 half = (boundsMax - boundsMin) * 0.5f;
+    glm::vec3 extent(
+        std::abs(model[0][0]) * half.x + std::abs(model[1][0]) * half.y + std::abs(model[2][0]) * half.z,
+        std::abs(model[0][1]) * half.x + std::abs(model[1][1]) * half.y + std::abs(model[2][1]) * half.z,
+        std::abs(model[0][2]) * half.x + std::abs(model[1][2]) * half.y + std::abs(model[2][2]) * half.z);
+
+    for (int i = 0; i < 6; i++)
+    {
+        glm::vec3 n(planes[i]);
+        float r = std::abs(n.x) * extent.x + std::abs(n.y) * extent.y + std::abs(n.z) * extent.z;
+        if (glm::dot(n, center) + planes[i].w < -r) return false;
+    }
+    return true;
 }
 
 void Drawer::endPass() {
@@ -1520,33 +2515,45 @@ void Drawer::endPass() {
 
 /* Submit the recorded command buffer */
 void Drawer::submitDraws() {
+    /* Submitted ahead of the frame, which then runs after the copies */
+    staging->flush();
+
     if (vkEndCommandBuffer(frameOrder[currentFrame].frameCommandBuffer) != VK_SUCCESS) {
         throw std::runtime_error("failed to record command buffer!");
     }
+    {
+        std::lock_guard<std::mutex> guard(statsLock);
+        frameStats.add(frameOrder[currentFrame].context.stats);
+    }
 
     VkSubmitInfo submitInfo{};
     submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
 
     VkSemaphore waitSemaphores[] = { frameOrder[currentFrame].imageAvailable };
     VkPipelineStageFlags waitStages[] = { VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT };
-    submitInfo.waitSemaphoreCount = 1;
+    /* Headless frames acquire and present nothing */
+    submitInfo.waitSemaphoreCount = headless ? 0 : 1;
     submitInfo.pWaitSemaphores = waitSemaphores;
     submitInfo.pWaitDstStageMask = waitStages;
     submitInfo.commandBufferCount = 1;
     submitInfo.pCommandBuffers = &frameOrder[currentFrame].frameCommandBuffer;
 
     VkSemaphore signalSemaphores[] = { frameOrder[currentFrame].imageFinished };
-    submitInfo.signalSemaphoreCount = 1;
+    submitInfo.signalSemaphoreCount = headless ? 0 : 1;
     submitInfo.pSignalSemaphores = signalSemaphores;
 
-    if (vkQueueSubmit(graphicsQueue, 1, &submitInfo, frameOrder[currentFrame].fence) != VK_SUCCESS) {
+    if (queues->submit(graphicsQueue, 1, &submitInfo, frameOrder[currentFrame].fence) != VK_SUCCESS) {
         throw std::runtime_error("failed to submit draw command buffer!");
     }
 }
 
 /*Queue the presentation */
 void Drawer::endFrame() {
-    frameOrder[currentFrame].boundMaterial = nullptr;
+    if (headless) {
+        currentFrame++;
+        currentFrame %= FRAMES_IN_FLIGHT;
+        return;
+    }
 
     VkPresentInfoKHR presentInfo{};
     presentInfo.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
@@ -1563,7 +2570,7 @@ void Drawer::endFrame() {
 
     //std::cout << currentSwapchainIndex << " " << currentFrame << "\n";
 
-    VkResult result = vkQueuePresentKHR(presentQueue, &presentInfo);
+    VkResult result = queues->present(presentQueue, &presentInfo);
 
     if (result == VK_ERROR_OUT_OF_DATE_KHR) {
         recreateSwapchain();
@@ -1586,14 +2593,21 @@ void Drawer::recreateSwapchain() {
         glfwWaitEvents();
     }
 
-    vkDeviceWaitIdle(device);
+    queues->waitDeviceIdle();
 
     cleanupSwapchain();
 
+    vkDestroyImageView(device, depthView, nullptr);
+    memory->destroyImage(depthImage, depthAllocation);
+    vkDestroySampler(device, depthSampler, nullptr);
+
     createSwapchain(this);
     createImageViews(this);
     createDepthStuff(this);
     createFramebuffers(this);
+
+    /* The viewport is baked into them */
+    invalidateCachedSecondaries();
 }
 
 void Drawer::cleanupSwapchain() {
@@ -1604,11 +2618,15 @@ void Drawer::cleanupSwapchain() {
         vkDestroyImageView(device, frames[i].swapchainImageView, nullptr);
     }
     std::cout << "Destroying swapchain...\n";
-    vkDestroySwapchainKHR(device, presentSwapchain, nullptr);
+    if (presentSwapchain != VK_NULL_HANDLE) vkDestroySwapchainKHR(device, presentSwapchain, nullptr);
 }
 
 Drawer::~Drawer() {
-    vkDeviceWaitIdle(device);
+    finishPipelines();
+    queues->waitDeviceIdle();
+    /* Queued descriptor sets have to go before their pool */
+    deletions->flushAll();
+    delete culler;
     std::cout << "Cleaning up...\n";
 
     std::cout << "Destroying desc pool & layouts...\n";
@@ -1617,27 +2635,39 @@ Drawer::~Drawer() {
     vkDestroyDescriptorSetLayout(device, frameDependantLayout, nullptr);
     vkDestroyDescriptorSetLayout(device, defaultMaterialLayout, nullptr);
     vkDestroyDescriptorSetLayout(device, shadowMappingLayout, nullptr);
+    vkDestroyDescriptorSetLayout(device, instanceSetLayout, nullptr);
 
     std::cout << "Destroying uniform buffers & sync objects...\n";
     for (size_t i = 0; i < frameOrder.size(); i++)
     {
-        vkDestroyBuffer(device, frameOrder[i].uniformBuffer, nullptr);
-        vkFreeMemory(device, frameOrder[i].uniformBufferMemory, nullptr);
-
-        vkDestroyBuffer(device, frameOrder[i].dLightBuffer, nullptr);
-        vkFreeMemory(device, frameOrder[i].dLightBufferMemory, nullptr);
-
-        vkDestroyBuffer(device, frameOrder[i].vLightBuffer, nullptr);
-        vkFreeMemory(device, frameOrder[i].vLightMemory, nullptr);
+        memory->destroyBuffer(frameOrder[i].uniformBuffer, frameOrder[i].uniformAllocation);
+        memory->destroyBuffer(frameOrder[i].dLightBuffer, frameOrder[i].dLightAllocation);
+        memory->destroyBuffer(frameOrder[i].vLightBuffer, frameOrder[i].vLightAllocation);
+        if (frameOrder[i].instances.buffer != VK_NULL_HANDLE) memory->destroyBuffer(frameOrder[i].instances.buffer, frameOrder[i].instances.allocation);
+        for (size_t j = 0; j < frameOrder[i].cachedSecondaries.size(); j++)
+        {
+            InstanceBuffer& instances = frameOrder[i].cachedSecondaries[j].instances;
+            if (instances.buffer != VK_NULL_HANDLE) memory->destroyBuffer(instances.buffer, instances.allocation);
+        }
 
         vkDestroySemaphore(device, frameOrder[i].imageAvailable, nullptr);
         vkDestroySemaphore(device, frameOrder[i].imageFinished, nullptr);
         vkDestroyFence(device, frameOrder[i].fence, nullptr);
     }
-    vkUtil::free(device);
+    delete staging;
+    delete queues;
 
     std::cout << "Destroying command pool...\n";
     vkDestroyCommandPool(device, commandPool, nullptr);
+    for (size_t i = 0; i < frameOrder.size(); i++)
+    {
+        for (size_t j = 0; j < frameOrder[i].recordingSlots.size(); j++)
+        {
+            vkDestroyCommandPool(device, frameOrder[i].recordingSlots[j].pool, nullptr);
+        }
+    }
+    ktxVulkanDeviceInfo_Destroy(ktxVulkanInfo);
+    vkDestroyCommandPool(device, ktxCommandPool, nullptr);
 
     std::cout << "Destroying swapchain...\n";
     cleanupSwapchain();
@@ -1655,10 +2685,11 @@ Drawer::~Drawer() {
     }
 
     std::cout << "Destroying materials...\n";
-    for (size_t i = 0; i < registeredMaterials.size(); i++)
-    {
-        vkDestroyPipeline(device, registeredMaterials[i].pipeline, nullptr);
-        vkDestroyPipelineLayout(device, registeredMaterials[i].layout, nullptr);
+    /* Material pipelines and layouts belong to the registry, destroyed with it */
+    if (descriptorIndexing) {
+        vkDestroyDescriptorPool(device, bindlessPool, nullptr);
+        vkDestroyDescriptorSetLayout(device, bindlessLayout, nullptr);
+        memory->destroyBuffer(materialParamBuffer, materialParamAllocation);
     }
 
     std::cout << "Destroying lights...\n";
@@ -1667,16 +2698,39 @@ Drawer::~Drawer() {
     {
         registeredLights[i].free(this);
     }
-    vkDestroyPipeline(device, shadowPipeline, nullptr);
-    vkDestroyPipelineLayout(device, shadowPipelineLayout, nullptr);
 
     std::cout << "Freeing depth & stencil resources...\n";
-    vkDestroyImage(device, depthImage, nullptr);
     vkDestroyImageView(device, depthView, nullptr);
-    vkFreeMemory(device, depthMemory, nullptr);
+    memory->destroyImage(depthImage, depthAllocation);
     vkDestroySampler(device, depthSampler, nullptr);
 
+    std::cout << "Freeing shadow atlas...\n";
+    for (size_t i = 0; i < shadowFrames.size(); i++)
+    {
+        vkDestroyFramebuffer(device, shadowFrames[i], nullptr);
+    }
+    vkDestroySampler(device, shadowSampler, nullptr);
+    vkDestroyImageView(device, shadowView, nullptr);
+    memory->destroyImage(shadowAtlas, shadowMapAllocation);
+
+    /* Everything freed above */
+    deletions->flushAll();
+    delete deletions;
+
+    vertexPool->report(std::cout);
+    indexPool->report(std::cout);
+    delete vertexPool;
+    delete indexPool;
+    delete bindlessSlots;
+
+    budget->report(std::cout);
+    delete budget;
+    memory->report(std::cout);
+    delete memory;
+
     std::cout << "Destroying pipeline and render passes...\n";
+    pipelines->report(std::cout);
+    delete pipelines;
     vkDestroyRenderPass(device, renderPass, nullptr);
     vkDestroyRenderPass(device, shadowPass, nullptr);
 
@@ -1684,14 +2738,16 @@ Drawer::~Drawer() {
     vkDestroyDevice(device, nullptr);
 
     std::cout << "Destroying KHR surface and instance...\n";
-    vkDestroySurfaceKHR(instance, surface, nullptr);
+    if (surface != VK_NULL_HANDLE) vkDestroySurfaceKHR(instance, surface, nullptr);
     vkDestroyInstance(instance, nullptr);
 
-    std::cout << "Terminating GLFW...\n";
-    glfwTerminate();
+    if (!headless) {
+        std::cout << "Terminating GLFW...\n";
+        glfwTerminate();
+    }
 }
 
-inline void stbTextureLoad(Drawer* d, const char* dir, VkImage* imgBuffer, VkFormat format, int usage, VkImageAspectFlagBits aspect, VkImageLayout finalLayout, VkDeviceMemory* imgMemory, VkImageView* imgView, VkSamplerCreateInfo info, VkSampler* sampler) {
+inline void stbTextureLoad(Drawer* d, const char* dir, VkImage* imgBuffer, VkFormat format, int usage, VkImageAspectFlagBits aspect, VkImageLayout finalLayout, Allocation* imgAllocation, VkImageView* imgView, VkSamplerCreateInfo info, VkSampler* sampler) {
     int width, height;
 
     int texChannels;
@@ -1703,41 +2759,14 @@ inline void stbTextureLoad(Drawer* d, const char* dir, VkImage* imgBuffer, VkFor
         throw std::runtime_error("Failed to load image");
     }
 
-    VkBuffer staging;
-    VkDeviceMemory memory;
-    createBuffer(d->device, d->physicalDevice, size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_COHERENT_BIT | VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT, staging, memory);
-
-    void* data;
-    vkMapMemory(d->device, memory, 0, size, 0, &data);
-    memcpy(data, pixels, static_cast<uint32_t>(size));
-    vkUnmapMemory(d->device, memory);
+    createImage(d->memory, width, height, 1, format, VK_IMAGE_TILING_OPTIMAL, 0, VK_IMAGE_USAGE_TRANSFER_DST_BIT | usage, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, *imgBuffer, *imgAllocation, MemoryCategory::Texture);
 
+    /* Same as Mesh, submitted here unless an UploadBatch is open */
+    d->staging->beginBatch();
+    d->staging->uploadImage(*imgBuffer, aspect, static_cast<uint32_t>(width), static_cast<uint32_t>(height), pixels, size, finalLayout);
+    d->staging->endBatch();
     stbi_image_free(pixels);
 
-    createImage(d->device, d->physicalDevice, width, height, 1, format, VK_IMAGE_TILING_OPTIMAL, 0, VK_IMAGE_USAGE_TRANSFER_DST_BIT | usage, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, *imgBuffer, *imgMemory);
-
-    transitionImageLayout(d->device, d->graphicsQueue, d->commandPool, *imgBuffer, format, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, aspect);
-    VkCommandBuffer cmdBuffer = beginSimpleCommands(d->device, d->commandPool);
-
-    VkBufferImageCopy region{};
-    region.bufferRowLength = 0;
-    region.bufferImageHeight = 0;
-    region.bufferOffset = 0;
-    region.imageSubresource.aspectMask = aspect;
-    region.imageSubresource.mipLevel = 0;
-    region.imageSubresource.baseArrayLayer = 0;
-    region.imageSubresource.layerCount = 1;
-    region.imageExtent = { static_cast<uint32_t>(width), static_cast<uint32_t>(height), 1 };
-    region.imageOffset = { 0, 0, 0 };
-
-    vkCmdCopyBufferToImage(cmdBuffer, staging, *imgBuffer, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
-
-    endSimpleCommands(d->device, d->commandPool, cmdBuffer, d->graphicsQueue);
-    transitionImageLayout(d->device, d->graphicsQueue, d->commandPool, *imgBuffer, format, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, finalLayout, aspect);
-
-    vkDestroyBuffer(d->device, staging, nullptr);
-    vkFreeMemory(d->device, memory, nullptr);
-
     *imgView = createImageView(d->device, *imgBuffer, VK_IMAGE_VIEW_TYPE_2D, format, aspect);
 
     if (vkCreateSampler(d->device, &info, nullptr, sampler) != VK_SUCCESS) {
@@ -1765,15 +2794,30 @@ inline void ktxTextureLoad(Drawer* d, const char* dir, ktxTexture2* texture, ktx
     //std::cout << ktxTexture_GetVkFormat(texture) << "\n";
     //VK_FORMAT_R8G8B8A8_UNORM;
     std::cout << "Texture VkFormat:" << ktxTexture2_GetVkFormat(texture) << "\n"; 
-    ktxTexture2_VkUploadEx(texture, d->ktxVulkanInfo, dstTexture, VK_IMAGE_TILING_OPTIMAL, usageFlags, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+    {
+        std::lock_guard<std::mutex> guard(d->ktxLock);
+        std::unique_lock<std::mutex> queue = d->queues->hold(d->graphicsQueue);
+        ktxTexture2_VkUploadEx(texture, d->ktxVulkanInfo, dstTexture, VK_IMAGE_TILING_OPTIMAL, usageFlags, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+    }
 
     //std::cout << dstTexture->height << "\n";
 }
 
+/* ktx allocates the memory itself, the allocator is only told about it so the budget adds up */
+inline void trackKtxMemory(Drawer* d, VkImage image, bool add) {
+    VkMemoryRequirements requirements;
+    vkGetImageMemoryRequirements(d->device, image, &requirements);
+    uint32_t memoryType = d->memory->findMemoryType(requirements.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, 0);
+
+    if (add) d->memory->trackExternal(memoryType, requirements.size, MemoryCategory::Texture);
+    else d->memory->untrackExternal(memoryType, requirements.size, MemoryCategory::Texture);
+}
+
 Texture::Texture(Drawer* d, const char* dir, VkImageViewType imageType) {
     ktxTexture2* texPtr = &texture;
     ktxTextureLoad(d, dir, texPtr, &vkTexture, VK_IMAGE_USAGE_SAMPLED_BIT);
     texture = *texPtr;
+    trackKtxMemory(d, vkTexture.image, true);
     //std::cout << texture.baseHeight << "\n";
 
     textureView = createImageView(d->device, vkTexture.image, imageType, VK_FORMAT_R8G8B8A8_SRGB, VK_IMAGE_ASPECT_COLOR_BIT);
@@ -1805,10 +2849,13 @@ Texture::Texture(Drawer* d, const char* dir, VkImageViewType imageType) {
 }
 
 void Texture::free(Drawer* d) {
-    vkDestroySampler(d->device, sampler, nullptr);
-    vkDestroyImageView(d->device, textureView, nullptr);
-    vkDestroyImage(d->device, vkTexture.image, nullptr);
-    vkFreeMemory(d->device, vkTexture.deviceMemory, nullptr);
+    trackKtxMemory(d, vkTexture.image, false);
+    d->deletions->sampler(sampler);
+    d->deletions->imageView(textureView);
+    d->deletions->image(vkTexture.image, vkTexture.deviceMemory);
+    /* Frames in flight can still sample the slot, it is only rewritten once they are done */
+    if (d->bindlessSlots != nullptr) d->deletions->slot(d->bindlessSlots, bindlessSlot);
+    bindlessSlot = SlotAllocator::noSlot;
 }
 
 Light::Light(Drawer* d, glm::mat4 origin, float FOV, bool isDynamic) {
@@ -1820,7 +2867,7 @@ Light::Light(Drawer* d, glm::mat4 origin, float FOV, bool isDynamic) {
     /*
     VkFormat format = findDepthSamplerFormat(d->physicalDevice);
     std::cout << format << "\n";
-    createImage(d->device, d->physicalDevice, 512, 512, 1, format, VK_IMAGE_TILING_OPTIMAL, 0, VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, this->shMap, this->shMapMemory);
+    createImage(d->memory, 512, 512, 1, format, VK_IMAGE_TILING_OPTIMAL, 0, VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, this->shMap, this->shMapMemory);
     this->shMapView = createImageView(d->device, this->shMap, VK_IMAGE_VIEW_TYPE_2D, format, VK_IMAGE_ASPECT_DEPTH_BIT);
 
     VkSamplerCreateInfo samplerInfo{};
@@ -1910,14 +2957,18 @@ Light::Light(Drawer* d, glm::mat4 origin, float FOV, bool isDynamic) {
 };
 
 void Light::free(Drawer* d) {
-    /*kDestroyImage(d->device, shMap, nullptr);
-    vkDestroyImageView(d->device, shMapView, nullptr);
-    vkFreeMemory(d->device, shMapMemory, nullptr);
-    vkDestroySampler(d->device, shMapSampler, nullptr);
+    /*d->deletions->image(shMap, shMapMemory);
+    d->deletions->imageView(shMapView);
+    d->deletions->sampler(shMapSampler);
 
     for (size_t i = 0; i < frames.size(); i++)
     {
-        vkDestroyFramebuffer(d->device, frames[i], nullptr);
+        d->deletions->framebuffer(frames[i]);
+    }
+
+    for (size_t i = 0; i < frameSets.size(); i++)
+    {
+        d->deletions->descriptorSet(d->descPool, frameSets[i]);
     }
 
     for (size_t i = 0; i < framePositions.size(); i++)
@@ -1931,16 +2982,36 @@ Material::Material() {
 
 }
 
+bool Material::sharesBindings(const Material* other) const {
+    return pipeline == other->pipeline && layout == other->layout && materialDescriptor == other->materialDescriptor;
+}
+
 Submesh::Submesh() {
 
 }
 
-Submesh::Submesh(const Drawer* d, Submesh::SubmeshCreateInfo info) {
+Submesh::Submesh(const Drawer* d, Submesh::SubmeshCreateInfo info, bool ownBuffer) {
     this->materialIndex = info.materialIndex;
-    createBuffer(d->device, d->physicalDevice, info.count * sizeof(uint16_t), VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_HOST_COHERENT_BIT | VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT, indexBuffer, indexMemory);
+    this->ownBuffer = ownBuffer;
     iBufferSize = info.count;
-    vkUtil::staging istaging(d->device, d->physicalDevice, d->graphicsQueue);
-    istaging.transfer(info.count * sizeof(uint16_t), info.indices, &(indexBuffer), &(d->commandPool));
+    /* Submitted when the constructor returns unless an UploadBatch is open, a worker thread doesn't flush otherwise */
+    d->staging->beginBatch();
+    if (ownBuffer) {
+        createBuffer(d->memory, info.count * sizeof(uint16_t), VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, indexBuffer, indexAllocation, MemoryCategory::Mesh);
+        d->staging->uploadBuffer(indexBuffer, 0, info.indices, info.count * sizeof(uint16_t));
+    }
+    else {
+        indexRange = d->indexPool->allocate(info.count);
+        indexBuffer = indexRange.buffer;
+        firstIndex = indexRange.offset;
+        d->staging->uploadBuffer(indexBuffer, firstIndex * sizeof(uint16_t), info.indices, info.count * sizeof(uint16_t), true);
+    }
+    d->staging->endBatch();
+}
+
+void Submesh::free(Drawer* d) {
+    if (ownBuffer) d->deletions->buffer(indexBuffer, indexAllocation);
+    else d->deletions->poolRange(d->indexPool, indexRange);
 }
 
 Submesh::SubmeshCreateInfo::SubmeshCreateInfo(const uint16_t* indices, uint32_t count, uint16_t materialIndex) {
@@ -1949,29 +3020,54 @@ Submesh::SubmeshCreateInfo::SubmeshCreateInfo(const uint16_t* indices, uint32_t
     this->materialIndex = materialIndex;
 }
 
-render::Mesh::Mesh(const Drawer* d, const Vertex* vertices, const uint32_t vcount, const std::vector<Submesh::SubmeshCreateInfo> createInfos) {
+render::Mesh::Mesh(const Drawer* d, const Vertex* vertices, const uint32_t vcount, const std::vector<Submesh::SubmeshCreateInfo> createInfos, bool keepHostGeometry, bool ownBuffers) {
     std::vector<Submesh> s;
+    this->ownBuffers = ownBuffers;
+    /* The submeshes' uploads join this batch, everything goes out in one submit, see Submesh */
+    d->staging->beginBatch();
 
     for (size_t i = 0; i < createInfos.size(); i++)
     {
-        s.push_back(Submesh(d, createInfos[i]));
+        s.push_back(Submesh(d, createInfos[i], ownBuffers));
+        if (keepHostGeometry) {
+            s[i].hostIndices.assign(createInfos[i].indices, createInfos[i].indices + createInfos[i].count);
+        }
+    }
+
+    if (keepHostGeometry) {
+        hostVertices.assign(vertices, vertices + vcount);
+    }
+
+    boundsMin = vcount != 0 ? vertices[0].pos : glm::vec3(0);
+    boundsMax = boundsMin;
+    for (uint32_t i = 1; i < vcount; i++)
+    {
+        boundsMin = glm::min(boundsMin, vertices[i].pos);
+        boundsMax = glm::max(boundsMax, vertices[i].pos);
     }
 
     this->submeshes = s;
 
-    createBuffer(d->device, d->physicalDevice, vcount * sizeof(Vertex), VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, vertexBuffer, vertexMemory);
     vBufferSize = vcount;
-    vkUtil::staging vstaging(d->device, d->physicalDevice, d->graphicsQueue);
-    vstaging.transfer(vcount * sizeof(Vertex), vertices, &(Mesh::vertexBuffer), &(d->commandPool));
+    if (ownBuffers) {
+        createBuffer(d->memory, vcount * sizeof(Vertex), VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, vertexBuffer, vertexAllocation, MemoryCategory::Mesh);
+        d->staging->uploadBuffer(vertexBuffer, 0, vertices, vcount * sizeof(Vertex));
+    }
+    else {
+        vertexRange = d->vertexPool->allocate(vcount);
+        vertexBuffer = vertexRange.buffer;
+        vertexOffset = vertexRange.offset;
+        d->staging->uploadBuffer(vertexBuffer, vertexOffset * sizeof(Vertex), vertices, vcount * sizeof(Vertex), true);
+    }
+    d->staging->endBatch();
 }
 
 void Mesh::free(Drawer* d) {
-    vkDestroyBuffer(d->device, vertexBuffer, nullptr);
-    vkFreeMemory(d->device, vertexMemory, nullptr);
+    if (ownBuffers) d->deletions->buffer(vertexBuffer, vertexAllocation);
+    else d->deletions->poolRange(d->vertexPool, vertexRange);
 
     for (size_t i = 0; i < submeshes.size(); i++)
     {
-        vkDestroyBuffer(d->device, submeshes[i].indexBuffer, nullptr);
-        vkFreeMemory(d->device, submeshes[i].indexMemory, nullptr);
+        submeshes[i].free(d);
     }
 }
\ No newline at end of file
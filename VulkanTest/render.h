@@ -6,19 +6,35 @@
 
 #include <glm/glm.hpp>
 
+#include <cstdint>
+#include <functional>
+#include <mutex>
 #include <optional>
 #include <vector>
 
 #define KHRONOS_STATIC
 #include "ktxvulkan.h"
 
+#include "deletionQueue.h"
+#include "gpuMemory.h"
+#include "memoryBudget.h"
+#include "meshPool.h"
+#include "pipelineRegistry.h"
+#include "queueFunnel.h"
+#include "slotAllocator.h"
+#include "stagingRing.h"
+
+class Threading;
+
 namespace render
 {
     class Drawer;
+    class GpuCuller;
+    struct PendingPipeline;
 
     struct DeviceBuffer {
         VkBuffer buffer;
-        VkDeviceMemory memory;
+        Allocation allocation;
     };
 
     /* tutorial struct */
@@ -47,11 +63,6 @@ namespace render
         glm::vec4* colors;
     };
 
-    struct PushConstant {
-        glm::mat4 model;
-        glm::vec4 data;
-    };
-
     struct Vertex {
         glm::vec3 pos;
         glm::vec3 color;
@@ -98,6 +109,39 @@ namespace render
         }
     };
 
+    /* Per object data in a storage buffer, read by the vertex shaders at gl_InstanceIndex. std430, matches the shaders */
+    struct InstanceData {
+        glm::mat4 model;
+        /* The camera's view projection times model, and the same with last frame's camera */
+        glm::mat4 mvp;
+        glm::mat4 previousMvp;
+        glm::vec4 data;
+        /* Into Drawer::registeredMaterials */
+        uint32_t materialIndex;
+        uint32_t padding[3];
+    };
+
+    /* Drawer::materialParamBuffer holds one per registered material, std430, matches fragmentBindless.frag */
+    struct MaterialParams {
+        glm::vec4 color;
+        uint32_t textureIndex;
+        uint32_t padding[3];
+    };
+
+    /* What a material's shaders are specialized for, VkSpecializationInfo data in constant_id order.
+     * A feature turned off is compiled out of vertex.vert and the fragment shader instead of branched over.
+     */
+    struct MaterialFeatures {
+        VkBool32 receiveShadows = VK_TRUE;
+        VkBool32 vertexLighting = VK_TRUE;
+        /* Bound of the vertex light loop, lights past it are ignored. At most Drawer::maxVertLights */
+        uint32_t maxVertexLights = 40;
+        VkBool32 alphaTest = VK_FALSE;
+        float alphaCutoff = 0.5f;
+
+        bool operator==(const MaterialFeatures& other) const = default;
+    };
+
     class Material {
     public:
         Material();
@@ -106,6 +150,13 @@ namespace render
         VkDescriptorSetLayout descriptorLayout;
         VkPipeline pipeline;
         VkPipelineLayout layout;
+        glm::vec4 color = glm::vec4(1.0f);
+        /* Slot in the bindless texture table, unused without descriptor indexing */
+        uint32_t textureIndex = 0;
+        MaterialFeatures features;
+
+        /* Binding either binds the other too, so their draws can share a batch */
+        bool sharesBindings(const Material* other) const;
     };
 
     class AnimMaterial {
@@ -122,12 +173,15 @@ namespace render
     public:
         Texture(Drawer* d, const char* dir, VkImageViewType imageType);
 
+        /* Through the deletion queue, the bindless slot too */
         void free(Drawer* d);
 
         ktxVulkanTexture vkTexture;
         ktxTexture2 texture;
         VkImageView textureView;
         VkSampler sampler;
+        /* In Drawer::bindlessSlots, noSlot until a bindless material uses the texture */
+        uint32_t bindlessSlot = SlotAllocator::noSlot;
     };
 
     /* unused */
@@ -141,10 +195,18 @@ namespace render
     class Submesh {
     public:
         VkDeviceSize iBufferSize;
+        /* Drawer::indexPool's block unless the submesh owns its buffer */
         VkBuffer indexBuffer;
-        VkDeviceMemory indexMemory;
+        /* First index in indexBuffer, the firstIndex of every draw */
+        uint32_t firstIndex = 0;
+        bool ownBuffer = false;
+        Allocation indexAllocation;
+        PoolRange indexRange;
         uint16_t materialIndex;
 
+        /* Only filled when the mesh is created with keepHostGeometry */
+        std::vector<uint16_t> hostIndices;
+
         struct SubmeshCreateInfo {
             const uint16_t* indices;
             uint32_t count;
@@ -154,18 +216,35 @@ namespace render
         };
 
         Submesh();
-        Submesh(const Drawer* d, SubmeshCreateInfo info);
+        Submesh(const Drawer* d, SubmeshCreateInfo info, bool ownBuffer = false);
+
+        /* Through the deletion queue */
+        void free(Drawer* d);
     };
 
     class Mesh {
     public:
         VkDeviceSize vBufferSize;
+        /* Drawer::vertexPool's block unless the mesh owns its buffers */
         VkBuffer vertexBuffer;
-        VkDeviceMemory vertexMemory;
+        /* First vertex in vertexBuffer, the vertexOffset of every draw */
+        uint32_t vertexOffset = 0;
+        /* Streamed meshes (terrain chunks) keep buffers of their own, so evicting them gives the memory back */
+        bool ownBuffers = false;
+        Allocation vertexAllocation;
+        PoolRange vertexRange;
 
         std::vector<Submesh> submeshes;
 
-        Mesh(const Drawer* d, const Vertex* vertices, const uint32_t vcount, const std::vector<Submesh::SubmeshCreateInfo> createInfos);
+        /* CPU copy of the vertex data for collision and other offline use, empty unless requested */
+        std::vector<Vertex> hostVertices;
+
+        /* Object space bounds of every vertex, for culling */
+        glm::vec3 boundsMin;
+        glm::vec3 boundsMax;
+
+        /* Any thread. The uploads are submitted before this returns, or with the calling thread's open UploadBatch */
+        Mesh(const Drawer* d, const Vertex* vertices, const uint32_t vcount, const std::vector<Submesh::SubmeshCreateInfo> createInfos, bool keepHostGeometry = false, bool ownBuffers = false);
 
         void free(Drawer* d);
     };
@@ -204,6 +283,131 @@ namespace render
         glm::vec4 color;
     };
 
+    /* One draw, as handed to the recording threads */
+    struct DrawItem {
+        Mesh* mesh;
+        Submesh* submesh;
+        Material* material;
+        glm::mat4 model;
+        glm::vec4 data;
+    };
+
+    /* A persistently mapped buffer of InstanceData that batchDraws appends to, emptied when whatever owns it is recorded again.
+     * Grows by replacing the buffer and its set, draws recorded earlier keep the old ones until the deletion queue frees them.
+     */
+    struct InstanceBuffer {
+        VkBuffer buffer = VK_NULL_HANDLE;
+        Allocation allocation;
+        /* Drawer::instanceSetLayout, the buffer at binding 0 */
+        VkDescriptorSet set = VK_NULL_HANDLE;
+        InstanceData* mapped = nullptr;
+        uint32_t capacity = 0;
+        uint32_t used = 0;
+    };
+
+    /* DrawItems sharing a mesh, submesh and material bindings, drawn with one instanced draw.
+     * material is the first item's, bindless materials only differ in the InstanceData::materialIndex of each instance.
+     */
+    struct DrawBatch {
+        Mesh* mesh;
+        Submesh* submesh;
+        Material* material;
+        VkBuffer instanceBuffer;
+        VkDescriptorSet instanceSet;
+        uint32_t firstInstance;
+        uint32_t instanceCount;
+    };
+
+    /* vkCmd calls DrawContext issued and the ones it found redundant and skipped */
+    struct DrawStats {
+        uint64_t pipelineBinds = 0;
+        uint64_t pipelineSkips = 0;
+        uint64_t descriptorBinds = 0;
+        uint64_t descriptorSkips = 0;
+        uint64_t vertexBufferBinds = 0;
+        uint64_t vertexBufferSkips = 0;
+        uint64_t indexBufferBinds = 0;
+        uint64_t indexBufferSkips = 0;
+        uint64_t draws = 0;
+
+        void add(const DrawStats& other);
+        void report(std::ostream& out) const;
+    };
+
+    /* A command buffer being recorded and everything bound in it so far. State calls go through here and are dropped
+     * when they would bind what is already bound. Secondaries are recorded on several threads at once, each has its own.
+     */
+    class DrawContext {
+    public:
+        static const uint32_t maxSets = 4;
+        /* Vertices, instances come from a storage buffer */
+        static const uint32_t maxVertexBindings = 1;
+
+        VkCommandBuffer commandBuffer = VK_NULL_HANDLE;
+        DrawStats stats;
+
+        void bindPipeline(VkPipeline pipeline, VkPipelineLayout layout);
+        void bindDescriptorSets(VkPipelineLayout layout, uint32_t firstSet, uint32_t count, const VkDescriptorSet* sets);
+        void bindVertexBuffer(uint32_t binding, VkBuffer buffer, VkDeviceSize offset);
+        void bindIndexBuffer(VkBuffer buffer, VkDeviceSize offset, VkIndexType type);
+        void drawIndexed(uint32_t indexCount, uint32_t instanceCount, uint32_t firstIndex, int32_t vertexOffset, uint32_t firstInstance);
+
+        /* After anything that leaves the bound state undefined, like vkCmdExecuteCommands in a primary */
+        void forget();
+
+    private:
+        VkPipeline pipeline = VK_NULL_HANDLE;
+        /* Sets only survive binds with a compatible layout, any other layout forgets them */
+        VkPipelineLayout layout = VK_NULL_HANDLE;
+        VkDescriptorSet sets[maxSets] = {};
+        VkBuffer vertexBuffers[maxVertexBindings] = {};
+        VkDeviceSize vertexOffsets[maxVertexBindings] = {};
+        VkBuffer indexBuffer = VK_NULL_HANDLE;
+        VkDeviceSize indexOffset = 0;
+        VkIndexType indexType = VK_INDEX_TYPE_UINT16;
+
+        void useLayout(VkPipelineLayout layout);
+    };
+
+    /* The six planes of a view projection, pointing inwards */
+    struct Frustum {
+        glm::vec4 planes[6];
+
+        Frustum(const glm::mat4& viewProjection);
+        /* Object space bounds under model, conservative */
+        bool intersects(const glm::vec3& boundsMin, const glm::vec3& boundsMax, const glm::mat4& model) const;
+    };
+
+    /* Secondary command buffers for one recording slot of a frame. Only one thread records into a slot at a time,
+     * so the pool needs no lock. Reset with the frame.
+     */
+    struct RecordingSlot {
+        VkCommandPool pool;
+        std::vector<VkCommandBuffer> buffers;
+        uint32_t used = 0;
+    };
+
+    /* A secondary recorded once and executed every frame until what it was recorded from changes */
+    struct CachedSecondary {
+        VkCommandBuffer buffer = VK_NULL_HANDLE;
+        bool recorded = false;
+        /* The caller's version and Drawer::cacheVersion at the time of recording */
+        uint64_t version;
+        uint64_t drawerVersion;
+        /* Instances of the draws recorded into buffer, written once per recording */
+        InstanceBuffer instances;
+    };
+
+    /* Bytes of a persistently mapped buffer that changed since it was last written */
+    struct DirtyRange {
+        size_t begin = SIZE_MAX;
+        size_t end = 0;
+
+        void mark(size_t from, size_t to);
+        bool empty() const;
+        void clear();
+    };
+
     /* A struct for each image of the swapchain. Images from the swapchain could be retrieved out of order. */
     struct Frame {
     public:
@@ -219,20 +423,31 @@ namespace render
     struct FrameOrderEntry {
     public:
         VkCommandBuffer frameCommandBuffer;
-        Material* boundMaterial;
+        /* State of frameCommandBuffer, for the inline draw path */
+        DrawContext context;
         VkSemaphore imageFinished;
         VkSemaphore imageAvailable;
         VkFence fence;
 
         VkBuffer uniformBuffer;
-        VkDeviceMemory uniformBufferMemory;
+        Allocation uniformAllocation;
         VkBuffer vLightBuffer;
-        VkDeviceMemory vLightMemory;
+        Allocation vLightAllocation;
         VkBuffer dLightBuffer;
-        VkDeviceMemory dLightBufferMemory;
+        Allocation dLightAllocation;
         VkDescriptorSet frameDescSet;
         void* uniformMappedMemory;
         void* lightMappedMemory;
+        /* A vec4 holding the light count followed by maxVertLights VertexLights */
+        void* vLightMappedMemory;
+        DirtyRange vLightDirty;
+        /* DeletionQueue number of the last frame submitted with this entry */
+        uint64_t frameNumber = 0;
+        std::vector<RecordingSlot> recordingSlots;
+        /* Indexed by the key passed to beginCachedSecondary. Every frame in flight needs its own, they bind its descriptor set. */
+        std::vector<CachedSecondary> cachedSecondaries;
+        /* Instances of everything drawn this frame outside cached secondaries */
+        InstanceBuffer instances;
     };
 
     struct CameraFrameOrdered {
@@ -278,12 +493,19 @@ namespace render
         uint32_t currentSwapchainIndex = 0;
         bool framebufferResized;
 
+        /* The pass being recorded, secondaries inherit it */
+        VkRenderPass activePass;
+        VkFramebuffer activeFramebuffer;
+        VkExtent2D activeExtent;
+
         Material currentMaterial;
-        VkDeviceMemory depthMemory;
+        Allocation depthAllocation;
 
         VkDescriptorSetLayout frameDependantLayout;
         VkDescriptorSetLayout defaultMaterialLayout;
         VkDescriptorSetLayout shadowMappingLayout;
+        /* One storage buffer of InstanceData, set 2 of material pipelines and set 1 of the shadow pipeline */
+        VkDescriptorSetLayout instanceSetLayout;
         VkDescriptorPool descPool;
 
         VkFormat format;
@@ -298,9 +520,17 @@ namespace render
         VkDevice device;
 
         VkQueue graphicsQueue;
-
-        GLFWwindow* window;
-        VkSurfaceKHR surface;
+        /* Same as graphicsQueue and graphicsFamily when the device has no dedicated transfer family */
+        VkQueue transferQueue;
+        uint32_t graphicsFamily;
+        uint32_t transferFamily;
+        /* Every submit and present goes through here, see QueueFunnel */
+        QueueFunnel* queues;
+
+        /* No window, surface or swapchain. Frames record and submit but have nothing to draw into or present, for tests. */
+        bool headless = false;
+        GLFWwindow* window = nullptr;
+        VkSurfaceKHR surface = VK_NULL_HANDLE;
         VkQueue presentQueue;
 
         //VkImage testImage;
@@ -309,10 +539,10 @@ namespace render
 
         VkDebugUtilsMessengerEXT debugMessenger;
 
-        VkSwapchainKHR presentSwapchain;
+        VkSwapchainKHR presentSwapchain = VK_NULL_HANDLE;
         VkRenderPass renderPass;
         VkRenderPass shadowPass;
-        VkPipeline shadowPipeline;
+        VkPipeline shadowPipeline = VK_NULL_HANDLE;
         VkPipelineLayout shadowPipelineLayout;
         Light* mainLight;
 
@@ -321,6 +551,8 @@ namespace render
         VkCommandPool commandPool;
 
         Drawer();
+        /* Pipelines compile on threading's workers from init on */
+        Drawer(Threading* threading, bool headless = false);
         ~Drawer();
         void init();
 
@@ -331,7 +563,7 @@ namespace render
         VkImage shadowAtlas;
         VkImageView shadowView;
         VkSampler shadowSampler;
-        VkDeviceMemory shadowMapMemory;
+        Allocation shadowMapAllocation;
         std::vector<VkFramebuffer> shadowFrames;
         std::vector<DeviceBuffer> shadowFramePositions;
         std::vector<void*> shadowMappedMemory;
@@ -346,19 +578,102 @@ namespace render
         /* Registers */
 
         ktxVulkanDeviceInfo* ktxVulkanInfo;
+        /* KTX records into its own pool and submits to the graphics queue itself, one upload at a time */
+        VkCommandPool ktxCommandPool;
+        std::mutex ktxLock;
         std::vector<Mesh> registeredMeshes;
         std::vector<Light> registeredLights;
         size_t maxVertLights = 40;
+        /* Change through the functions below so every frame's buffer picks the change up */
         std::vector<VertexLight> vertexLights;
+        uint32_t addVertexLight(const VertexLight& light);
+        void setVertexLight(uint32_t index, const VertexLight& light);
+        /* Moves the last light into index */
+        void removeVertexLight(uint32_t index);
         VkBuffer vertexLightStorageBuffer;
         std::vector<render::Material> registeredMaterials;
         std::vector<render::Texture> registeredTextures;
+        /* Loads the texture and registers a material drawn with the default shaders, returns its index */
+        uint16_t addMaterial(const char* texturePath, glm::vec4 color = glm::vec4(1.0f), MaterialFeatures features = MaterialFeatures());
+        /* Queues every combination of the boolean MaterialFeatures on the default shaders, so materials asking for one later find it built */
+        void precompileMaterialVariants();
 
-        void loadMesh(const char* dir, uint16_t* index, uint16_t materialIndex = 0);
+        void loadMesh(const char* dir, uint16_t* index, uint16_t materialIndex = 0, bool keepHostGeometry = false);
         void loadMaterial();
 
         /* Memory */
 
+        /* Every buffer and image except KTX textures, which ktxTexture2_VkUploadEx allocates itself */
+        GpuAllocator* memory;
+
+        /* Every upload goes through here, flushed once per frame by submitDraws */
+        const VkDeviceSize stagingRingSize = 16ull * 1024 * 1024;
+        StagingRing* staging;
+
+        /* Mesh, Texture and Light free through here, their objects are destroyed once no frame in flight can use them */
+        DeletionQueue* deletions;
+        /* Owns material and shadow pipelines, created after the device and destroyed just before it */
+        PipelineRegistry* pipelines;
+        const char* pipelineCachePath = "pipeline.cache";
+        /* vert and frag, and vert and fragBindless with descriptor indexing. A material with other shaders draws with these
+         * on its layout while its own pipeline compiles.
+         */
+        std::vector<char> defaultShaders[2];
+        std::vector<char> bindlessShaders[2];
+
+        /* Runs build as background work on threading and hands the pipeline to apply on the calling thread once collectPipelines sees it done.
+         * Without threading both run right away. Main thread.
+         */
+        void compilePipeline(std::function<VkPipeline()> build, std::function<void(VkPipeline)> apply);
+        /* Applies the pipelines that finished compiling, beginFrame calls it */
+        void collectPipelines();
+        /* Helps compile and waits until nothing is pending */
+        void finishPipelines();
+        std::vector<PendingPipeline*> pendingPipelines;
+
+        /* Set while creating the instance and device, VK_EXT_memory_budget needs both */
+        bool properties2Extension = false;
+        bool memoryBudgetExtension = false;
+        /* Updated in beginFrame, evicts streamable resources when a heap goes over budget */
+        MemoryBudget* budget;
+
+        /* Set while creating the device. With VK_EXT_descriptor_indexing every material addMaterial makes shares one pipeline and one set,
+         * a table of textures and a MaterialParams buffer that the shaders index with InstanceData::materialIndex.
+         * Binding a material then costs nothing once the first is bound.
+         */
+        bool descriptorIndexing = false;
+        /* Lowered to what the device allows */
+        uint32_t maxBindlessTextures = 1024;
+        const uint32_t maxBindlessMaterials = 4096;
+        VkDescriptorPool bindlessPool;
+        VkDescriptorSetLayout bindlessLayout;
+        VkDescriptorSet bindlessSet;
+        VkBuffer materialParamBuffer;
+        Allocation materialParamAllocation;
+        /* Slots of the texture table, Texture::free hands them back. Null without descriptor indexing. */
+        SlotAllocator* bindlessSlots = nullptr;
+
+        /* Set while creating the device, see GpuCuller */
+        bool indirectDrawing = false;
+        bool drawIndirectCountExtension = false;
+        /* Null until enableGpuCulling, and after it when the device can't draw indirectly */
+        GpuCuller* culler = nullptr;
+        /* Creates the culler on first use. Outside a frame on the render thread. */
+        GpuCuller* enableGpuCulling();
+
+        /* Vertices and indices of every mesh that doesn't own its buffers */
+        const uint32_t vertexBlockElements = 1u << 20;
+        const uint32_t indexBlockElements = 1u << 22;
+        MeshPool* vertexPool;
+        MeshPool* indexPool;
+
+        /* Compacts the registered meshes' ranges in vertexPool and indexPool so emptied blocks go back to the allocator,
+         * other pool users (StaticBatch clusters) stay put. Waits for the device, call it between frames with no uploads
+         * in flight on other threads (level loads, after freeing a lot of meshes). Does nothing unless a pool is fragmented,
+         * MeshPool::report counts what it moved and released.
+         */
+        void defragmentMeshes();
+
         /* Draw Functions */
 
         /*const std::vector<Vertex> defaultBox = {
@@ -390,16 +705,69 @@ namespace render
         };
 
         void beginFrame(glm::mat4 cameraView, double FOV, std::vector<glm::mat4> lightViews, std::vector<double> lightFOVs);
-        void beginPass(std::vector<VkClearValue> clearValues);
-        void beginPass(VkFramebuffer frame, VkRenderPass pass, std::vector<VkClearValue> clearValues, VkExtent2D ext);
-        void beginPass(VkFramebuffer frame, VkRenderPass pass, std::vector<VkClearValue> clearValues, VkExtent2D ext, VkOffset2D offset);
+        /* With VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS the pass is recorded through beginSecondary and executeSecondaries */
+        void beginPass(std::vector<VkClearValue> clearValues, VkSubpassContents contents = VK_SUBPASS_CONTENTS_INLINE);
+        void beginPass(VkFramebuffer frame, VkRenderPass pass, std::vector<VkClearValue> clearValues, VkExtent2D ext, VkSubpassContents contents = VK_SUBPASS_CONTENTS_INLINE);
+        void beginPass(VkFramebuffer frame, VkRenderPass pass, std::vector<VkClearValue> clearValues, VkExtent2D ext, VkOffset2D offset, VkSubpassContents contents = VK_SUBPASS_CONTENTS_INLINE);
 
         void bindShadowPassPipeline();
+        void bindShadowPassPipeline(DrawContext& context);
 
         void draw();
         void draw(Sprite* m);
         void draw(Mesh* m, Submesh* s, Material* mat, glm::mat4 modelMatrix, bool bindMaterial);
         void draw(Mesh* m, Submesh* s, Material* mat, glm::mat4 modelMatrix, glm::vec4 data, bool bindMaterial);
+        /* Draws the item as a single instance out of the frame's instance buffer, render thread only */
+        void draw(DrawContext& context, const DrawItem& item, bool bindMaterial);
+        void draw(DrawContext& context, const DrawBatch& batch, bool bindMaterial);
+        /* Everything a draw of the batch needs bound, shared with the indirect path */
+        void bindBatch(DrawContext& context, const DrawBatch& batch, bool bindMaterial);
+
+        /* Sorts items so draws sharing a mesh, submesh and material are adjacent, writes their instances into instances
+         * and appends one batch per run. Render thread only, the batches can then be drawn from any recording thread.
+         */
+        void batchDraws(std::vector<DrawItem>& items, std::vector<DrawBatch>& batches, InstanceBuffer& instances);
+        /* Fills instances from items, split over threading when it is set */
+        void writeInstances(const DrawItem* items, InstanceData* instances, size_t count);
+        InstanceBuffer& frameInstances();
+        /* Only valid while recording the cached secondary for key */
+        InstanceBuffer& cachedInstances(uint32_t key);
+
+        /* Multithreaded recording. Inside a pass begun with secondary contents, every recording thread takes its own slot,
+         * records with beginSecondary, draw and endSecondary, and the render thread executes the results in order.
+         * Slots have to be reserved on the render thread before recording starts.
+         */
+        void reserveRecordingSlots(uint32_t count);
+        DrawContext beginSecondary(uint32_t slot);
+        VkCommandBuffer endSecondary(DrawContext& context);
+        void executeSecondaries(const std::vector<VkCommandBuffer>& buffers);
+
+        /* Secondaries for geometry that doesn't change between frames, one per key and frame in flight, recorded on the render thread.
+         * Returns true when the buffer has to be recorded again, because version changed or invalidateCachedSecondaries was called,
+         * context is then begun and the caller records into it and ends it with endSecondary.
+         * Either way context.commandBuffer is what to execute.
+         */
+        bool beginCachedSecondary(uint32_t key, uint64_t version, DrawContext& context);
+        /* Materials and the swapchain call this themselves */
+        void invalidateCachedSecondaries();
+        uint64_t cacheVersion = 0;
+
+        /* Summed over every context recorded in the frame, contexts add theirs when they end.
+         * lastFrameStats holds the previous frame's once beginFrame has run.
+         */
+        DrawStats frameStats;
+        DrawStats lastFrameStats;
+        std::mutex statsLock;
+
+        /* Same projection the frame uniforms get */
+        glm::mat4 cameraProjection(double FOV) const;
+        /* Set by beginFrame, every InstanceData::mvp of the frame is made from them */
+        glm::mat4 viewProjection = glm::mat4(1.0f);
+        glm::mat4 previousViewProjection = glm::mat4(1.0f);
+        /* Workers to write instances and compile pipelines on, optional */
+        Threading* threading = nullptr;
+        /* Index of a material in registeredMaterials */
+        uint32_t materialIndex(const Material* material) const;
 
         void endPass();
         void submitDraws();
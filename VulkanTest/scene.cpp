@@ -1,5 +1,6 @@
 #include "scene.h"
 #include "render.h"
+#include "gpuCulling.h"
 #include "threading.h"
 
 #include <GLFW/glfw3.h>
@@ -17,14 +18,18 @@
 
 #include "BulletCollision/btBulletCollisionCommon.h"
 #include "btBulletDynamicsCommon.h"
+#include "LinearMath/btTransformUtil.h"
 #include "bulletCustom.h"
+#include "terrain.h"
+#include "staticBatch.h"
 
 #include <stdio.h>
 
-Renderer::Renderer(render::Mesh* mesh, uint8_t count, btCustomMotionState* motionState) {
+Renderer::Renderer(render::Mesh* mesh, uint8_t count, btCustomMotionState* motionState, bool isStatic) {
 	this->motionState = motionState;
 	this->mesh = mesh;
 	this->count = count;
+	this->isStatic = isStatic;
 }
 
 Scene::Scene(Threading* threading, render::Drawer* drawer) {
@@ -32,26 +37,47 @@ Scene::Scene(Threading* threading, render::Drawer* drawer) {
 
 	//Scene::mainCamera = render::Camera();
 
-	auto defaultConfig = new btDefaultCollisionConfiguration();
+	physicsMemory::install();
 
-	auto dispatcher = new btCollisionDispatcher(defaultConfig);
+	btDefaultCollisionConfiguration* defaultConfig;
+	{
+		/* Mostly the manifold and collision algorithm pools */
+		physicsMemory::Scope scope(physicsMemory::CATEGORY_MANIFOLDS);
+		defaultConfig = new btDefaultCollisionConfiguration();
+	}
 
-	auto pairCache = new btDbvtBroadphase();
+	auto dispatcher = new btAccountedDispatcher(defaultConfig);
+
+	btDbvtBroadphase* pairCache;
+	{
+		physicsMemory::Scope scope(physicsMemory::CATEGORY_BROADPHASE);
+		pairCache = new btAccountedBroadphase();
+	}
 
-	auto solver = new btSequentialImpulseConstraintSolver();
+	btSequentialImpulseConstraintSolver* solver;
+	{
+		physicsMemory::Scope scope(physicsMemory::CATEGORY_SOLVER);
+		solver = new btSequentialImpulseConstraintSolver();
+	}
 
 	auto world = new btDiscreteDynamicsWorld(dispatcher, pairCache, solver, defaultConfig);
 
 	physics = {defaultConfig, dispatcher, pairCache, solver, world};
+	shapes = new ShapeRegistry(&physics.collisionShapes);
 
 	Scene::drawer = drawer;
+	Scene::threading = threading;
 
 	world->setGravity({ 0, -2, 0 });
 }
 
 void Scene::step() {
 	//world->getCollisionObjectArray()[0]->forceActivationState(4);
-	physics.world->stepSimulation(1);
+	{
+		/* Broadphase and narrowphase allocations retag themselves, see btAccountedDispatcher */
+		physicsMemory::Scope scope(physicsMemory::CATEGORY_SOLVER);
+		physics.world->stepSimulation(1);
+	}
 	//std::cout << synchronizedObjects.size() << "\n";
 	for (size_t i = 0; i < synchronizedObjects.size(); i++)
 	{
@@ -60,11 +86,28 @@ void Scene::step() {
 }
 
 btRigidBody* Scene::addRigidBody(btRigidBody::btRigidBodyConstructionInfo info) {
-	btRigidBody* body = new btRigidBody(info);
+	btRigidBody* body;
+	{
+		/* btRigidBody declares Bullet's aligned allocator, so this goes through the physicsMemory hooks */
+		physicsMemory::Scope scope(physicsMemory::CATEGORY_BODIES);
+		body = new btRigidBody(info);
+	}
 	physics.world->addRigidBody(body);
+	if (snapshots != nullptr) snapshots->track(body);
 	return body;
 }
 
+void Scene::removeRigidBody(btRigidBody* body) {
+	physics.world->removeRigidBody(body);
+	if (snapshots != nullptr) snapshots->untrack(body);
+	delete body;
+}
+
+void Scene::enableSnapshots(uint32_t frameCount, uint32_t maxBodies, uint32_t maxManifolds, bool captureContacts) {
+	delete snapshots;
+	snapshots = new PhysicsSnapshot(physics.world, frameCount, maxBodies, maxManifolds, captureContacts);
+}
+
 void Scene::addSyncObject(SyncFunc* o) {
 	synchronizedObjects.push_back(o);
 }
@@ -74,11 +117,32 @@ void Scene::addAsyncObject(AsyncFunc* o) {
 }
 
 void Scene::attachRenderer(Renderer component) {
+	if (component.isStatic) {
+		staticScene.push_back(component);
+		staticVersion++;
+		return;
+	}
 	renderedScene.push_back(component);
 
 	/* TODO: sorting function? */
 }
 
+void Scene::attachTerrain(Terrain* terrain) {
+	delete this->terrain;
+	this->terrain = terrain;
+}
+
+void Scene::buildStaticBatches(float clusterSize) {
+	std::vector<Renderer> sources = staticScene;
+	if (staticBatch != nullptr) sources.insert(sources.end(), staticBatch->sources().begin(), staticBatch->sources().end());
+	delete staticBatch;
+
+	/* Whatever can't be merged stays in the cached secondaries */
+	staticScene.clear();
+	staticBatch = new StaticBatch(drawer, sources, clusterSize, staticScene);
+	staticVersion++;
+}
+
 inline void drawSceneObjects(render::Drawer* d, std::vector<Renderer> o) {
 	for (size_t i = 0; i < o.size(); i++)
 	{
@@ -92,26 +156,106 @@ inline void drawSceneObjects(render::Drawer* d, std::vector<Renderer> o) {
 	}
 }
 
-void Scene::updateShadowMap(render::Light* l) {
-	//l.updateTransform(glm::mat4(1.0), drawer->currentFrame);
-	std::vector<VkClearValue> clearValues;
-	clearValues.resize(1);
-	clearValues[0].depthStencil = { 0.0, 0 };
+/* Fewer batches than this aren't worth a secondary of their own */
+const size_t minDrawsPerSecondary = 32;
 
-	drawer->beginPass(drawer->shadowFrames[drawer->currentSwapchainIndex], drawer->shadowPass, clearValues, {512, 512});
-	drawer->bindShadowPassPipeline();
-	//drawSceneObjects(drawer, renderedScene);
-	for (size_t i = 0; i < Scene::renderedScene.size(); i++)
+inline void gatherRenderers(render::Drawer* drawer, const std::vector<Renderer>& renderers, std::vector<render::DrawItem>& items, const render::Frustum* frustum) {
+	for (size_t i = 0; i < renderers.size(); i++)
 	{
 		glm::mat4 m{};
-		btTransform transform;
-		renderedScene[i].motionState->getGraphicsTransform(&m);
-		for (size_t j = 0; j < Scene::renderedScene[i].mesh->submeshes.size(); j++)
+		renderers[i].motionState->getGraphicsTransform(&m);
+		render::Mesh* mesh = renderers[i].mesh;
+		if (frustum != nullptr && !frustum->intersects(mesh->boundsMin, mesh->boundsMax, m)) continue;
+
+		for (size_t j = 0; j < mesh->submeshes.size(); j++)
+		{
+			items.push_back({ mesh, &mesh->submeshes[j], &(drawer->registeredMaterials[mesh->submeshes[j].materialIndex]), m, glm::vec4(0) });
+		}
+	}
+}
+
+void Scene::gatherDraws(std::vector<render::DrawItem>& items, const render::Frustum* frustum) {
+	gatherRenderers(drawer, renderedScene, items, frustum);
+	/* A few draws, and culling them beats recording them once */
+	if (staticBatch != nullptr) staticBatch->gatherDraws(items, frustum);
+	/* Chunks page in and out and change LOD all the time, so terrain stays dynamic */
+	if (terrain != nullptr) terrain->gatherDraws(items, frustum);
+}
+
+void Scene::gatherStaticDraws(std::vector<render::DrawItem>& items) {
+	gatherRenderers(drawer, staticScene, items, nullptr);
+}
+
+void Scene::recordPass(const std::vector<render::DrawBatch>& batches, bool shadowPass, uint32_t cullPass) {
+	/* Culled batches are drawn a run at a time */
+	size_t draws = cullPass == noCulling ? batches.size() : drawer->culler->runCount();
+	size_t slots = threading->workerCount() + 1;
+	size_t grain = std::max(minDrawsPerSecondary, (draws + slots - 1) / slots);
+	size_t chunks = (draws + grain - 1) / grain;
+
+	/* Static geometry goes first, the cache key is the pass */
+	uint32_t cacheKey = shadowPass ? 1 : 0;
+	std::vector<VkCommandBuffer> secondaries(1 + chunks);
+	render::DrawContext cached;
+	if (drawer->beginCachedSecondary(cacheKey, staticVersion, cached)) {
+		std::vector<render::DrawItem> statics;
+		std::vector<render::DrawBatch> staticBatches;
+		gatherStaticDraws(statics);
+		drawer->batchDraws(statics, staticBatches, drawer->cachedInstances(cacheKey));
+		if (shadowPass) drawer->bindShadowPassPipeline(cached);
+		for (size_t i = 0; i < staticBatches.size(); i++)
 		{
-			drawer->draw(Scene::renderedScene[i].mesh, &Scene::renderedScene[i].mesh->submeshes[j], &(drawer->registeredMaterials[Scene::renderedScene[i].mesh->submeshes[j].materialIndex]), m, false);
+			drawer->draw(cached, staticBatches[i], !shadowPass);
 		}
+		drawer->endSecondary(cached);
 	}
+	secondaries[0] = cached.commandBuffer;
+
+	/* Chunk begin / grain is unique per chunk, so every chunk records into its own slot and no pool is shared */
+	threading->parallelFor(draws, grain, [&](size_t begin, size_t end) {
+		uint32_t slot = static_cast<uint32_t>(begin / grain);
+		render::DrawContext context = drawer->beginSecondary(slot);
+		if (shadowPass) drawer->bindShadowPassPipeline(context);
+		for (size_t i = begin; i < end; i++)
+		{
+			if (cullPass == noCulling) drawer->draw(context, batches[i], !shadowPass);
+			else drawer->culler->draw(context, static_cast<uint32_t>(i), cullPass, !shadowPass);
+		}
+		secondaries[1 + slot] = drawer->endSecondary(context);
+	});
+	drawer->executeSecondaries(secondaries);
+}
+
+void Scene::recordShadowPass(const std::vector<render::DrawBatch>& batches, uint32_t cullPass) {
+	std::vector<VkClearValue> clearValues;
+	clearValues.resize(1);
+	clearValues[0].depthStencil = { 0.0, 0 };
+
+	drawer->beginPass(drawer->shadowFrames[drawer->currentSwapchainIndex], drawer->shadowPass, clearValues, {512, 512}, VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+	recordPass(batches, true, cullPass);
 	drawer->endPass();
+}
+
+void Scene::recordMainPass(const std::vector<render::DrawBatch>& batches, uint32_t cullPass) {
+	std::vector<VkClearValue> clearValues;
+	clearValues.resize(2);
+	clearValues[0].color = { 0.01f, 0.01f, 0.01f, 1.0f };
+	clearValues[1].depthStencil = {1.0, 0};
+
+	drawer->beginPass(clearValues, VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+	recordPass(batches, false, cullPass);
+	drawer->endPass();
+}
+
+void Scene::updateShadowMap(render::Light* l) {
+	//l.updateTransform(glm::mat4(1.0), drawer->currentFrame);
+
+	/* The light's frustum isn't known here yet, so the shadow pass draws everything */
+	std::vector<render::DrawItem> items;
+	std::vector<render::DrawBatch> batches;
+	gatherDraws(items, nullptr);
+	drawer->batchDraws(items, batches, drawer->frameInstances());
+	recordShadowPass(batches, noCulling);
 };
 
 
@@ -123,34 +267,178 @@ void Scene::drawObjects() {
 	lightViews.push_back(testView);
 	fovs.push_back(90);
 
+	/* Paging creates and frees buffers, so it happens before recording starts */
+	if (terrain != nullptr) terrain->update(glm::vec3(glm::inverse(mainCameraView)[3]));
+	/* Same for the culler's pipeline the first time */
+	render::GpuCuller* culler = gpuCulling ? drawer->enableGpuCulling() : nullptr;
+
 	drawer->beginFrame(mainCameraView, 90, lightViews, fovs);
-	/*for (size_t i = 0; i < drawer->registeredLights.size(); i++)
-	{
-		updateShadowMap(drawer->registeredLights[i]);
-	}*/
-	updateShadowMap(drawer->mainLight);
-	std::vector<VkClearValue> clearValues;
-	clearValues.resize(2);
-	clearValues[0].color = { 0.01f, 0.01f, 0.01f, 1.0f };
-	clearValues[1].depthStencil = {1.0, 0};
-	drawer->beginPass(clearValues);
-	for (size_t i = 0; i < Scene::renderedScene.size(); i++)
-	{
-		glm::mat4 m{};
-		btTransform transform;
-		renderedScene[i].motionState->getGraphicsTransform(&m);
-		for (size_t j = 0; j < Scene::renderedScene[i].mesh->submeshes.size(); j++)
+	/* One per thread parallelFor can run a chunk on */
+	drawer->reserveRecordingSlots(static_cast<uint32_t>(threading->workerCount() + 1));
+	render::Frustum frustum(drawer->cameraProjection(90) * mainCameraView);
+
+	if (culler != nullptr) {
+		/* Everything goes to the GPU once, both passes cull from the same batches */
+		std::vector<render::DrawItem> items;
+		std::vector<render::DrawBatch> batches;
+		gatherDraws(items, nullptr);
+		drawer->batchDraws(items, batches, drawer->frameInstances());
+
+		/* Same as the CPU path, the shadow pass keeps everything */
+		std::vector<uint32_t> passes;
+		culler->cull(batches, { nullptr, &frustum }, passes);
+		recordShadowPass(batches, passes[0]);
+		recordMainPass(batches, passes[1]);
+	}
+	else {
+		/*for (size_t i = 0; i < drawer->registeredLights.size(); i++)
 		{
-			drawer->draw(Scene::renderedScene[i].mesh, &Scene::renderedScene[i].mesh->submeshes[j], &(drawer->registeredMaterials[Scene::renderedScene[i].mesh->submeshes[j].materialIndex]), m, true);
-		}
+			updateShadowMap(drawer->registeredLights[i]);
+		}*/
+		updateShadowMap(drawer->mainLight);
+
+		std::vector<render::DrawItem> items;
+		std::vector<render::DrawBatch> batches;
+		gatherDraws(items, &frustum);
+		drawer->batchDraws(items, batches, drawer->frameInstances());
+		recordMainPass(batches, noCulling);
 	}
-	drawer->endPass();
 	drawer->submitDraws();
 	drawer->endFrame();
 	//
 	//
 }
 
+/* Queries per job, a query is cheap so small batches mostly cost scheduling overhead */
+const size_t queryGrainSize = 32;
+
+/* btDbvtBroadphase::rayTest shares one traversal stack unless Bullet is built with BT_THREADSAFE,
+ * so every job walks the broadphase trees with its own stack and tests the leaves directly.
+ */
+struct RayLeafCollide : btDbvt::ICollide {
+	btTransform from;
+	btTransform to;
+	btCollisionWorld::ClosestRayResultCallback* result;
+
+	void Process(const btDbvtNode* leaf) {
+		btBroadphaseProxy* proxy = static_cast<btBroadphaseProxy*>(leaf->data);
+		btCollisionObject* object = static_cast<btCollisionObject*>(proxy->m_clientObject);
+		if (result->needsCollision(object->getBroadphaseHandle())) {
+			btCollisionWorld::rayTestSingle(from, to, object, object->getCollisionShape(), object->getWorldTransform(), *result);
+		}
+	}
+};
+
+struct SweepLeafCollide : btDbvt::ICollide {
+	const btConvexShape* shape;
+	btTransform from;
+	btTransform to;
+	btScalar allowedPenetration;
+	btCollisionWorld::ClosestConvexResultCallback* result;
+
+	void Process(const btDbvtNode* leaf) {
+		btBroadphaseProxy* proxy = static_cast<btBroadphaseProxy*>(leaf->data);
+		btCollisionObject* object = static_cast<btCollisionObject*>(proxy->m_clientObject);
+		if (result->needsCollision(object->getBroadphaseHandle())) {
+			btCollisionWorld::objectQuerySingle(shape, from, to, object, object->getCollisionShape(), object->getWorldTransform(), *result, allowedPenetration);
+		}
+	}
+};
+
+inline void traverseBroadphase(btDbvtBroadphase* broadphase, btVector3 from, btVector3 to, btVector3 aabbMin, btVector3 aabbMax, btAlignedObjectArray<const btDbvtNode*>& stack, btDbvt::ICollide& policy) {
+	btVector3 direction = to - from;
+	btScalar length = direction.length();
+	if (length > SIMD_EPSILON) direction /= length;
+
+	btVector3 directionInverse;
+	unsigned int signs[3];
+	for (int i = 0; i < 3; i++)
+	{
+		directionInverse[i] = direction[i] == btScalar(0.0) ? btScalar(BT_LARGE_FLOAT) : btScalar(1.0) / direction[i];
+		signs[i] = directionInverse[i] < 0.0;
+	}
+
+	/* m_sets[0] holds the dynamic proxies, m_sets[1] the static ones */
+	for (int i = 0; i < 2; i++)
+	{
+		broadphase->m_sets[i].rayTestInternal(broadphase->m_sets[i].m_root, from, to, directionInverse, signs, length, aabbMin, aabbMax, stack, policy);
+	}
+}
+
+void Scene::raycast(const std::vector<RayQuery>& rays, std::vector<QueryHit>& hits) const {
+	hits.resize(rays.size());
+	btDbvtBroadphase* broadphase = physics.pairCache;
+
+	threading->parallelFor(rays.size(), queryGrainSize, [&rays, &hits, broadphase](size_t begin, size_t end) {
+		btAlignedObjectArray<const btDbvtNode*> stack;
+		for (size_t i = begin; i < end; i++)
+		{
+			const RayQuery& ray = rays[i];
+			btCollisionWorld::ClosestRayResultCallback result(ray.from, ray.to);
+			result.m_collisionFilterGroup = ray.collisionFilterGroup;
+			result.m_collisionFilterMask = ray.collisionFilterMask;
+
+			RayLeafCollide collide;
+			collide.from.setIdentity();
+			collide.from.setOrigin(ray.from);
+			collide.to.setIdentity();
+			collide.to.setOrigin(ray.to);
+			collide.result = &result;
+
+			traverseBroadphase(broadphase, ray.from, ray.to, btVector3(0, 0, 0), btVector3(0, 0, 0), stack, collide);
+
+			hits[i].hit = result.hasHit();
+			hits[i].fraction = result.m_closestHitFraction;
+			hits[i].point = result.m_hitPointWorld;
+			hits[i].normal = result.m_hitNormalWorld;
+			hits[i].object = result.m_collisionObject;
+		}
+	});
+}
+
+void Scene::sweep(const std::vector<SweepQuery>& sweeps, std::vector<QueryHit>& hits) const {
+	hits.resize(sweeps.size());
+	btDbvtBroadphase* broadphase = physics.pairCache;
+	btScalar allowedPenetration = physics.world->getDispatchInfo().m_allowedCcdPenetration;
+
+	threading->parallelFor(sweeps.size(), queryGrainSize, [&sweeps, &hits, broadphase, allowedPenetration](size_t begin, size_t end) {
+		btAlignedObjectArray<const btDbvtNode*> stack;
+		for (size_t i = begin; i < end; i++)
+		{
+			const SweepQuery& query = sweeps[i];
+			btCollisionWorld::ClosestConvexResultCallback result(query.from.getOrigin(), query.to.getOrigin());
+			result.m_collisionFilterGroup = query.collisionFilterGroup;
+			result.m_collisionFilterMask = query.collisionFilterMask;
+
+			/* Same swept bounds btCollisionWorld::convexSweepTest uses, covering the rotation along the sweep */
+			btVector3 aabbMin, aabbMax;
+			{
+				btVector3 linVel, angVel;
+				btTransformUtil::calculateVelocity(query.from, query.to, 1.0f, linVel, angVel);
+				btTransform rotation;
+				rotation.setIdentity();
+				rotation.setRotation(query.from.getRotation());
+				query.shape->calculateTemporalAabb(rotation, btVector3(0, 0, 0), angVel, 1.0f, aabbMin, aabbMax);
+			}
+
+			SweepLeafCollide collide;
+			collide.shape = query.shape;
+			collide.from = query.from;
+			collide.to = query.to;
+			collide.allowedPenetration = allowedPenetration;
+			collide.result = &result;
+
+			traverseBroadphase(broadphase, query.from.getOrigin(), query.to.getOrigin(), aabbMin, aabbMax, stack, collide);
+
+			hits[i].hit = result.hasHit();
+			hits[i].fraction = result.m_closestHitFraction;
+			hits[i].point = result.m_hitPointWorld;
+			hits[i].normal = result.m_hitNormalWorld;
+			hits[i].object = result.m_hitCollisionObject;
+		}
+	});
+}
+
 void Scene::changeView(glm::mat4 view) {
 	mainCameraView = view;
 }
@@ -160,9 +448,32 @@ Scene::~Scene() {
 	{
 		delete renderedScene[i].motionState;
 	}
+	for (size_t i = 0; i < staticScene.size(); i++)
+	{
+		delete staticScene[i].motionState;
+	}
+	/* The batch only keeps its renderers to rebuild from, their motion states are still the scene's */
+	if (staticBatch != nullptr) {
+		const std::vector<Renderer>& merged = staticBatch->sources();
+		for (size_t i = 0; i < merged.size(); i++)
+		{
+			delete merged[i].motionState;
+		}
+	}
+	delete staticBatch;
+	/* Terrain chunks take their bodies out of the world */
+	delete terrain;
+	delete snapshots;
 	delete physics.world;
 	delete physics.solver;
 	delete physics.pairCache;
 	delete physics.dispatcher;
 	delete physics.defaultConfig;
+
+	for (int i = 0; i < physics.collisionShapes.size(); i++)
+	{
+		delete physics.collisionShapes[i];
+	}
+	physics.collisionShapes.clear();
+	delete shapes;
 }
\ No newline at end of file
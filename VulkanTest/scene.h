@@ -6,16 +6,46 @@
 #include "btBulletDynamicsCommon.h"
 #include "btBulletCollisionCommon.h"
 #include "bulletCustom.h"
+#include "shapeRegistry.h"
+#include "physicsSnapshot.h"
 
 class SyncFunc;
 class AsyncFunc;
+class Terrain;
+class StaticBatch;
 
 struct Renderer {
 	btCustomMotionState* motionState;
 	render::Mesh* mesh;
 	uint8_t count;
+	/* Never moves (mass 0 bodies), recorded once into a cached secondary instead of every frame */
+	bool isStatic;
 
-	Renderer(render::Mesh* mesh, uint8_t count, btCustomMotionState* motionState);
+	Renderer(render::Mesh* mesh, uint8_t count, btCustomMotionState* motionState, bool isStatic = false);
+};
+
+/* Batched collision queries, see Scene::raycast and Scene::sweep */
+struct RayQuery {
+	btVector3 from;
+	btVector3 to;
+	int collisionFilterGroup = btBroadphaseProxy::DefaultFilter;
+	int collisionFilterMask = btBroadphaseProxy::AllFilter;
+};
+
+struct SweepQuery {
+	const btConvexShape* shape;
+	btTransform from;
+	btTransform to;
+	int collisionFilterGroup = btBroadphaseProxy::DefaultFilter;
+	int collisionFilterMask = btBroadphaseProxy::AllFilter;
+};
+
+struct QueryHit {
+	bool hit;
+	btScalar fraction;
+	btVector3 point;
+	btVector3 normal;
+	const btCollisionObject* object;
 };
 
 class Scene {
@@ -24,21 +54,52 @@ public:
 
 	void step();
 	btRigidBody* addRigidBody(btRigidBody::btRigidBodyConstructionInfo info);
+	/* Takes the body out of the world and deletes it, the shape and motion state stay with the caller */
+	void removeRigidBody(btRigidBody* body);
 	void attachRenderer(Renderer component);
+	/* The scene owns the terrain from here on, it is paged and drawn with the rest of the scene */
+	void attachTerrain(Terrain* terrain);
+	/* Merges the static renderers into world space clusters, see StaticBatch. Call once they are all attached,
+	 * calling again rebuilds from every static renderer including the ones merged before.
+	 */
+	void buildStaticBatches(float clusterSize = 64.0f);
 	void addSyncObject(SyncFunc* o);
 	void addAsyncObject(AsyncFunc* o);
 	void updateShadowMap(render::Light* l);
 	void changeView(glm::mat4 view);
+	/* Records both passes into secondary command buffers on the worker threads */
 	void drawObjects();
 
+	/* Frustum culls the dynamic scene on the GPU and draws it indirectly, when the device supports it (Drawer::enableGpuCulling).
+	 * Worth it once there are far more objects than meshes. Off by default, main.cpp turns it on with --gpu-culling.
+	 */
+	bool gpuCulling = false;
+	static const uint32_t noCulling = UINT32_MAX;
+
+	/* Closest hit for every query, run in parallel on the worker threads.
+	 * Only call between steps, the world is read without locking.
+	 */
+	void raycast(const std::vector<RayQuery>& rays, std::vector<QueryHit>& hits) const;
+	void sweep(const std::vector<SweepQuery>& sweeps, std::vector<QueryHit>& hits) const;
+
+	/* Sets up the rollback ring, see PhysicsSnapshot. Bodies added and removed through the scene keep it up to date,
+	 * and static ones such as terrain chunks don't take slots. maxBodies only counts bodies that can move.
+	 */
+	void enableSnapshots(uint32_t frameCount, uint32_t maxBodies, uint32_t maxManifolds = 0, bool captureContacts = false);
+
 	~Scene();
 
+	/* Shared collision shapes, owned by the scene */
+	ShapeRegistry* shapes;
+	/* Null until enableSnapshots */
+	PhysicsSnapshot* snapshots = nullptr;
+
 	struct Physics {
 		btDefaultCollisionConfiguration* defaultConfig;
 
 		btCollisionDispatcher* dispatcher;
 
-		btBroadphaseInterface* pairCache;
+		btDbvtBroadphase* pairCache;
 
 		btSequentialImpulseConstraintSolver* solver;
 
@@ -61,8 +122,25 @@ private:
 	Threading* threading;
 
 	std::vector<Renderer> renderedScene;
+	std::vector<Renderer> staticScene;
+	/* Bumped whenever staticScene changes, the cached secondaries are recorded again */
+	uint64_t staticVersion = 0;
+	/* Static renderers merged by buildStaticBatches, drawn and culled with the dynamic scene */
+	StaticBatch* staticBatch = nullptr;
+	Terrain* terrain = nullptr;
 	std::vector<SyncFunc*> synchronizedObjects;
 	std::vector<AsyncFunc*> threadedObjects;
+
+	/* Every dynamic renderer submesh, static cluster and terrain chunk, only the ones inside frustum unless it is null */
+	void gatherDraws(std::vector<render::DrawItem>& items, const render::Frustum* frustum);
+	/* Every static renderer submesh, unculled since the result is recorded once */
+	void gatherStaticDraws(std::vector<render::DrawItem>& items);
+	/* Executes the pass's cached static secondary, then splits batches into one secondary per recording slot.
+	 * Called inside a pass begun with secondary contents. cullPass is the GpuCuller pass to draw through, or noCulling.
+	 */
+	void recordPass(const std::vector<render::DrawBatch>& batches, bool shadowPass, uint32_t cullPass);
+	void recordShadowPass(const std::vector<render::DrawBatch>& batches, uint32_t cullPass);
+	void recordMainPass(const std::vector<render::DrawBatch>& batches, uint32_t cullPass);
 };
 
 typedef void (*AsyncMessage)(Scene* scene);
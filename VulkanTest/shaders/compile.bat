@@ -1,7 +1,9 @@
 C:/VulkanSDK/1.3.239.0/Bin/glslc.exe vertex.vert -o vert.spv
 C:/VulkanSDK/1.3.239.0/Bin/glslc.exe fragment.frag -o frag.spv
+C:/VulkanSDK/1.3.239.0/Bin/glslc.exe fragmentBindless.frag -o fragBindless.spv
 C:/VulkanSDK/1.3.239.0/Bin/glslc.exe skybox.vert -o skyboxv.spv
 C:/VulkanSDK/1.3.239.0/Bin/glslc.exe skybox.frag -o skyboxf.spv
 C:/VulkanSDK/1.3.239.0/Bin/glslc.exe shadowmapv.vert -o shadowmapv.spv
 C:/VulkanSDK/1.3.239.0/Bin/glslc.exe shadowmapf.frag -o shadowmapf.spv
+C:/VulkanSDK/1.3.239.0/Bin/glslc.exe cull.comp -o cull.spv
 pause
\ No newline at end of file
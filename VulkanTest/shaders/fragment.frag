@@ -10,23 +10,29 @@ layout(location = 3) in vec4 fragShadowCoord;
 
 layout(location = 0) out vec4 outColor;
 
-LightingBufferObject {
+/* render::MaterialFeatures */
+layout(constant_id = 0) const bool RECEIVE_SHADOWS = true;
+layout(constant_id = 3) const bool ALPHA_TEST = false;
+layout(constant_id = 4) const float ALPHA_CUTOFF = 0.5;
+
+/* The frame's render::LightBufferObject, a storage buffer in the frame layout */
+layout(std430, set = 0, binding = 1) readonly buffer DirectionalLight {
     mat4 view;
     mat4 proj;
     vec4 lightColor;
-}
-
-layout(set = 0, binding = 1) buffer DirectionalLights {
-    vec4 count;
-    LightingBufferObject[] lbos;
-} lights;
+} lbo;
 
 void main() {
+    vec4 albedo = texture(texSampler, fragTexCoord.xy);
+    if (ALPHA_TEST && albedo.a < ALPHA_CUTOFF) {
+        discard;
+    }
+
     vec4 lighting = vec4(0, 0, 0, 0);
-    if (fragShadowCoord.z / fragShadowCoord.w < 1.0 && texture(shadowDepthSampler, fragShadowCoord.xy / fragShadowCoord.w).r < (fragShadowCoord.z / fragShadowCoord.w)) {
+    if (RECEIVE_SHADOWS && fragShadowCoord.z / fragShadowCoord.w < 1.0 && texture(shadowDepthSampler, fragShadowCoord.xy / fragShadowCoord.w).r < (fragShadowCoord.z / fragShadowCoord.w)) {
         lighting = lbo.lightColor * 1; //* (fragShadowCoord.z / fragShadowCoord.w);
         lighting = vec4(texture(shadowDepthSampler, fragShadowCoord.xy / fragShadowCoord.w).r, fragShadowCoord.w, fragShadowCoord.z, 1);
     }
     //outColor = (vec4(texture(shadowDepthSampler, (fragShadowCoord.xy) / fragShadowCoord.w).r, 0.0, 0.0, 1.0) * 5.0) + (vec4(texture(texSampler, fragTexCoord.xy).xyz, 1.0) * 0.1);
-    outColor = (lighting) + perVertexLighting * 1 + (vec4(texture(texSampler, fragTexCoord.xy).xyz, 1.0) * 0.5);
+    outColor = (lighting) + perVertexLighting * 1 + (vec4(albedo.xyz, 1.0) * 0.5);
 }
\ No newline at end of file
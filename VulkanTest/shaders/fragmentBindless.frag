@@ -0,0 +1,50 @@
+#version 450
+#extension GL_EXT_nonuniform_qualifier : require
+
+/* fragment.frag for bindless materials, the texture comes out of one table indexed per instance */
+layout(set = 0, binding = 2) uniform sampler2D shadowDepthSampler;
+
+struct MaterialParams {
+    vec4 color;
+    uvec4 texture;
+};
+
+layout(set = 1, binding = 0) uniform sampler2D textures[];
+
+layout(std430, set = 1, binding = 1) readonly buffer Materials {
+    MaterialParams materials[];
+};
+
+layout(location = 0) in vec3 fragColor;
+layout(location = 1) in vec2 fragTexCoord;
+layout(location = 2) in vec4 perVertexLighting;
+layout(location = 3) in vec4 fragShadowCoord;
+layout(location = 4) flat in uint fragMaterial;
+
+layout(location = 0) out vec4 outColor;
+
+/* render::MaterialFeatures */
+layout(constant_id = 0) const bool RECEIVE_SHADOWS = true;
+layout(constant_id = 3) const bool ALPHA_TEST = false;
+layout(constant_id = 4) const float ALPHA_CUTOFF = 0.5;
+
+/* The frame's render::LightBufferObject, a storage buffer in the frame layout */
+layout(std430, set = 0, binding = 1) readonly buffer DirectionalLight {
+    mat4 view;
+    mat4 proj;
+    vec4 lightColor;
+} lbo;
+
+void main() {
+    MaterialParams material = materials[fragMaterial];
+    vec4 albedo = texture(textures[nonuniformEXT(material.texture.x)], fragTexCoord) * material.color;
+    if (ALPHA_TEST && albedo.a < ALPHA_CUTOFF) {
+        discard;
+    }
+
+    vec4 lighting = vec4(0.0);
+    if (RECEIVE_SHADOWS && fragShadowCoord.z / fragShadowCoord.w < 1.0 && texture(shadowDepthSampler, fragShadowCoord.xy / fragShadowCoord.w).r < (fragShadowCoord.z / fragShadowCoord.w)) {
+        lighting = lbo.lightColor;
+    }
+    outColor = lighting + perVertexLighting + vec4(albedo.xyz, 1.0) * 0.5;
+}
\ No newline at end of file
@@ -4,17 +4,26 @@ layout(location = 0) in vec3 position;
 layout(location = 1) in vec3 color;
 layout(location = 2) in vec2 texCoord;
 
+struct ObjectData {
+    mat4 model;
+    mat4 mvp;
+    mat4 previousMvp;
+    vec4 data;
+    uvec4 material;
+};
+
+/* render::InstanceData, one per instance of every draw */
+layout(std430, set = 1, binding = 0) readonly buffer Objects {
+    ObjectData objects[];
+};
+
 layout(set = 0, binding = 0) uniform UniformBufferObject {
     mat4 view;
     mat4 proj;
     vec4 color;
 } ubo;
 
-layout(push_constant) uniform constants {
-    mat4 model;
-    vec4 misc;
-} pushConstants;
-
 void main() {
-    gl_Position = ubo.proj * ubo.view * pushConstants.model * vec4(position, 1.0);
+    /* The light's matrices, mvp is the camera's */
+    gl_Position = ubo.proj * ubo.view * objects[gl_InstanceIndex].model * vec4(position, 1.0);
 }
\ No newline at end of file
@@ -7,18 +7,26 @@ layout(location = 2) in vec2 texCoord;
 layout(location = 0) out vec3 fragColor;
 layout(location = 1) out vec3 fragTexCoord;
 
+struct ObjectData {
+    mat4 model;
+    mat4 mvp;
+    mat4 previousMvp;
+    vec4 data;
+    uvec4 material;
+};
+
+/* render::InstanceData, one per instance of every draw */
+layout(std430, set = 2, binding = 0) readonly buffer Objects {
+    ObjectData objects[];
+};
+
 layout(set = 0, binding = 0) uniform UniformBufferObject {
     mat4 view;
     mat4 proj;
 } ubo;
 
-layout(push_constant) uniform constants {
-    mat4 model;
-    vec4 misc;
-} pushConstants;
-
 void main() {
-    gl_Position = ubo.proj * ubo.view * pushConstants.model * vec4(position, 1.0);
+    gl_Position = objects[gl_InstanceIndex].mvp * vec4(position, 1.0);
     fragColor = color;
     fragTexCoord = position;
 }
\ No newline at end of file
@@ -8,12 +8,39 @@ layout(location = 0) out vec3 fragColor;
 layout(location = 1) out vec2 fragTexCoord;
 layout(location = 2) out vec4 perVertexLighting;
 layout(location = 3) out vec4 fragShadowCoord;
+/* Into the bindless material table, fragmentBindless.frag */
+layout(location = 4) flat out uint fragMaterial;
+
+/* render::MaterialFeatures */
+layout(constant_id = 0) const bool RECEIVE_SHADOWS = true;
+layout(constant_id = 1) const bool VERTEX_LIGHTING = true;
+layout(constant_id = 2) const int MAX_VERTEX_LIGHTS = 40;
+
+struct ObjectData {
+    mat4 model;
+    mat4 mvp;
+    mat4 previousMvp;
+    vec4 data;
+    uvec4 material;
+};
+
+/* render::InstanceData, one per instance of every draw */
+layout(std430, set = 2, binding = 0) readonly buffer Objects {
+    ObjectData objects[];
+};
 
 layout(set = 0, binding = 0) uniform UniformBufferObject {
     mat4 view;
     mat4 proj;
 } ubo;
 
+/* The frame's render::LightBufferObject, a storage buffer in the frame layout */
+layout(std430, set = 0, binding = 1) readonly buffer DirectionalLight {
+    mat4 view;
+    mat4 proj;
+    vec4 lightColor;
+} lbo;
+
 struct VertexLight {
     vec4 pos;
     vec4 color;
@@ -24,24 +51,29 @@ layout(std430, set = 0, binding = 3) buffer VertexLights {
     VertexLight lights[];
 } vertexLights;
 
-layout(push_constant) uniform constants {
-    mat4 model;
-    vec4 misc;
-} pushConstants;
-
 mat4 shadowCoordBias = mat4(0.5, 0.0, 0.0, 0.0,
                             0.0, 0.5, 0.0, 0.0,
                             0.0, 0.0, 1.0, 0.0,
                             0.5, 0.5, 0.0, 1.0);
 
 void main() {
-    fragShadowCoord = shadowCoordBias * lbo.proj * lbo.view * pushConstants.model * vec4(position, 1.0);
-    gl_Position = pushConstants.model * vec4(position, 1.0);
+    ObjectData object = objects[gl_InstanceIndex];
+    vec4 worldPosition = object.model * vec4(position, 1.0);
+    fragShadowCoord = vec4(0.0);
+    if (RECEIVE_SHADOWS) {
+        fragShadowCoord = shadowCoordBias * lbo.proj * lbo.view * worldPosition;
+    }
     perVertexLighting = vec4(0.0);
-    for (int i = 0; i < vertexLights.count.x; i++) {
-        perVertexLighting = (vertexLights.lights[i].color / (distance(gl_Position.xyz, vertexLights.lights[i].pos.xyz) + 1)) + perVertexLighting;
+    if (VERTEX_LIGHTING) {
+        /* Constant bound, the loop can be unrolled */
+        int count = int(vertexLights.count.x);
+        for (int i = 0; i < MAX_VERTEX_LIGHTS; i++) {
+            if (i >= count) break;
+            perVertexLighting = (vertexLights.lights[i].color / (distance(worldPosition.xyz, vertexLights.lights[i].pos.xyz) + 1)) + perVertexLighting;
+        }
     }
-    gl_Position = ubo.proj * ubo.view * gl_Position;
+    gl_Position = object.mvp * vec4(position, 1.0);
     fragColor = color;
     fragTexCoord = texCoord;
+    fragMaterial = object.material.x;
 }
\ No newline at end of file
@@ -0,0 +1,216 @@
+#include "shapeRegistry.h"
+
+#include <cstring>
+#include <iostream>
+#include <fstream>
+
+#include "BulletCollision/CollisionShapes/btOptimizedBvh.h"
+#include "physicsMemory.h"
+
+/* Bump when the cache layout changes */
+const uint32_t bvhCacheVersion = 1;
+
+struct BvhCacheHeader {
+	char magic[4];
+	uint32_t version;
+	uint64_t geometryHash;
+	uint32_t vertexCount;
+	uint32_t indexCount;
+	uint32_t bvhSize;
+};
+
+inline uint64_t floatBits(btScalar f) {
+	if (f == btScalar(0)) f = btScalar(0); // -0 and 0 share a shape
+	float v = static_cast<float>(f);
+	uint32_t bits;
+	memcpy(&bits, &v, sizeof(bits));
+	return bits;
+}
+
+inline uint64_t fnv1a(const void* data, size_t size, uint64_t hash = 14695981039346656037ull) {
+	const uint8_t* bytes = reinterpret_cast<const uint8_t*>(data);
+	for (size_t i = 0; i < size; i++)
+	{
+		hash ^= bytes[i];
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+size_t ShapeRegistry::ShapeKeyHash::operator()(const ShapeKey& k) const {
+	uint64_t hash = fnv1a(&k.type, sizeof(k.type));
+	return static_cast<size_t>(fnv1a(k.params, sizeof(k.params), hash));
+}
+
+ShapeRegistry::ShapeRegistry(btAlignedObjectArray<btCollisionShape*>* owner) {
+	this->owner = owner;
+}
+
+ShapeRegistry::~ShapeRegistry() {
+	for (size_t i = 0; i < meshData.size(); i++)
+	{
+		delete meshData[i]->meshInterface;
+		if (meshData[i]->bvhBuffer != nullptr) {
+			btAlignedFree(meshData[i]->bvhBuffer);
+		}
+		delete meshData[i];
+	}
+}
+
+btCollisionShape* ShapeRegistry::find(const ShapeKey& key) {
+	auto it = shapes.find(key);
+	return it == shapes.end() ? nullptr : it->second;
+}
+
+void ShapeRegistry::add(const ShapeKey& key, btCollisionShape* shape) {
+	shapes[key] = shape;
+	owner->push_back(shape);
+}
+
+btBoxShape* ShapeRegistry::box(btVector3 halfExtents) {
+	physicsMemory::Scope scope(physicsMemory::CATEGORY_SHAPES);
+	ShapeKey key{ SHAPE_BOX, { floatBits(halfExtents.x()), floatBits(halfExtents.y()), floatBits(halfExtents.z()) } };
+	if (btCollisionShape* shape = find(key)) return static_cast<btBoxShape*>(shape);
+
+	btBoxShape* shape = new btBoxShape(halfExtents);
+	add(key, shape);
+	return shape;
+}
+
+btSphereShape* ShapeRegistry::sphere(btScalar radius) {
+	physicsMemory::Scope scope(physicsMemory::CATEGORY_SHAPES);
+	ShapeKey key{ SHAPE_SPHERE, { floatBits(radius), 0, 0 } };
+	if (btCollisionShape* shape = find(key)) return static_cast<btSphereShape*>(shape);
+
+	btSphereShape* shape = new btSphereShape(radius);
+	add(key, shape);
+	return shape;
+}
+
+btCapsuleShape* ShapeRegistry::capsule(btScalar radius, btScalar height) {
+	physicsMemory::Scope scope(physicsMemory::CATEGORY_SHAPES);
+	ShapeKey key{ SHAPE_CAPSULE, { floatBits(radius), floatBits(height), 0 } };
+	if (btCollisionShape* shape = find(key)) return static_cast<btCapsuleShape*>(shape);
+
+	btCapsuleShape* shape = new btCapsuleShape(radius, height);
+	add(key, shape);
+	return shape;
+}
+
+inline btOptimizedBvh* loadBvhCache(const char* path, const BvhCacheHeader& expected, void** buffer) {
+	std::ifstream file(path, std::ios::binary | std::ios::ate);
+	if (!file.is_open()) return nullptr;
+	uint64_t fileSize = static_cast<uint64_t>(file.tellg());
+	file.seekg(0);
+
+	BvhCacheHeader header{};
+	file.read(reinterpret_cast<char*>(&header), sizeof(header));
+	if (!file || memcmp(header.magic, expected.magic, 4) != 0 || header.version != expected.version ||
+		header.geometryHash != expected.geometryHash || header.vertexCount != expected.vertexCount || header.indexCount != expected.indexCount) {
+		std::cout << "BVH cache " << path << " is stale, rebuilding\n";
+		return nullptr;
+	}
+	/* A truncated file or a corrupt size would have deSerializeInPlace read past the buffer */
+	if (header.bvhSize == 0 || sizeof(header) + static_cast<uint64_t>(header.bvhSize) > fileSize) {
+		std::cout << "BVH cache " << path << " is truncated, rebuilding\n";
+		return nullptr;
+	}
+
+	/* deSerializeInPlace keeps pointing into the buffer, it has to stay alive with the shape */
+	*buffer = btAlignedAlloc(header.bvhSize, 16);
+	file.read(reinterpret_cast<char*>(*buffer), header.bvhSize);
+	if (!file) {
+		btAlignedFree(*buffer);
+		*buffer = nullptr;
+		return nullptr;
+	}
+
+	return static_cast<btOptimizedBvh*>(btOptimizedBvh::deSerializeInPlace(*buffer, header.bvhSize, false));
+}
+
+inline void writeBvhCache(const char* path, BvhCacheHeader header, btOptimizedBvh* bvh) {
+	header.bvhSize = bvh->calculateSerializeBufferSize();
+	void* buffer = btAlignedAlloc(header.bvhSize, 16);
+	bvh->serializeInPlace(buffer, header.bvhSize, false);
+
+	std::ofstream file(path, std::ios::binary | std::ios::trunc);
+	if (file.is_open()) {
+		file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		file.write(reinterpret_cast<const char*>(buffer), header.bvhSize);
+	}
+	else {
+		std::cout << "Could not write BVH cache " << path << "\n";
+	}
+
+	btAlignedFree(buffer);
+}
+
+btBvhTriangleMeshShape* ShapeRegistry::triangleMesh(const render::Mesh* mesh, const char* cachePath) {
+	physicsMemory::Scope scope(physicsMemory::CATEGORY_SHAPES);
+	if (mesh->hostVertices.empty()) {
+		throw std::runtime_error("Triangle mesh collision needs a mesh loaded with keepHostGeometry");
+	}
+
+	TriangleMeshData* data = new TriangleMeshData{};
+	data->positions.reserve(mesh->hostVertices.size() * 3);
+	for (size_t i = 0; i < mesh->hostVertices.size(); i++)
+	{
+		data->positions.push_back(mesh->hostVertices[i].pos.x);
+		data->positions.push_back(mesh->hostVertices[i].pos.y);
+		data->positions.push_back(mesh->hostVertices[i].pos.z);
+	}
+	for (size_t i = 0; i < mesh->submeshes.size(); i++)
+	{
+		data->indices.insert(data->indices.end(), mesh->submeshes[i].hostIndices.begin(), mesh->submeshes[i].hostIndices.end());
+	}
+
+	uint64_t geometryHash = fnv1a(data->positions.data(), data->positions.size() * sizeof(float));
+	geometryHash = fnv1a(data->indices.data(), data->indices.size() * sizeof(uint16_t), geometryHash);
+
+	ShapeKey key{ SHAPE_TRIANGLE_MESH, { geometryHash, data->positions.size(), data->indices.size() } };
+	if (btCollisionShape* shape = find(key)) {
+		delete data;
+		return static_cast<btBvhTriangleMeshShape*>(shape);
+	}
+
+	btIndexedMesh indexed{};
+	indexed.m_numTriangles = static_cast<int>(data->indices.size() / 3);
+	indexed.m_triangleIndexBase = reinterpret_cast<const unsigned char*>(data->indices.data());
+	indexed.m_triangleIndexStride = 3 * sizeof(uint16_t);
+	indexed.m_numVertices = static_cast<int>(mesh->hostVertices.size());
+	indexed.m_vertexBase = reinterpret_cast<const unsigned char*>(data->positions.data());
+	indexed.m_vertexStride = 3 * sizeof(float);
+	indexed.m_indexType = PHY_SHORT;
+	indexed.m_vertexType = PHY_FLOAT;
+
+	data->meshInterface = new btTriangleIndexVertexArray();
+	data->meshInterface->addIndexedMesh(indexed, PHY_SHORT);
+	data->bvhBuffer = nullptr;
+	meshData.push_back(data);
+
+	BvhCacheHeader header{};
+	memcpy(header.magic, "BVHC", 4);
+	header.version = bvhCacheVersion;
+	header.geometryHash = geometryHash;
+	header.vertexCount = static_cast<uint32_t>(mesh->hostVertices.size());
+	header.indexCount = static_cast<uint32_t>(data->indices.size());
+
+	btBvhTriangleMeshShape* shape = nullptr;
+	if (cachePath != nullptr) {
+		btOptimizedBvh* bvh = loadBvhCache(cachePath, header, &data->bvhBuffer);
+		if (bvh != nullptr) {
+			shape = new btBvhTriangleMeshShape(data->meshInterface, true, false);
+			shape->setOptimizedBvh(bvh);
+		}
+	}
+
+	if (shape == nullptr) {
+		shape = new btBvhTriangleMeshShape(data->meshInterface, true, true);
+		if (cachePath != nullptr) {
+			writeBvhCache(cachePath, header, shape->getOptimizedBvh());
+		}
+	}
+
+	add(key, shape);
+	return shape;
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+#include "btBulletDynamicsCommon.h"
+#include "btBulletCollisionCommon.h"
+#include "render.h"
+
+/* Hands out shared collision shapes, asking twice with the same parameters returns the same instance.
+ * Shapes are added to the owner array (Scene::Physics::collisionShapes) which frees them.
+ */
+class ShapeRegistry {
+public:
+	ShapeRegistry(btAlignedObjectArray<btCollisionShape*>* owner);
+	~ShapeRegistry();
+
+	btBoxShape* box(btVector3 halfExtents);
+	btSphereShape* sphere(btScalar radius);
+	btCapsuleShape* capsule(btScalar radius, btScalar height);
+
+	/* Static collision from a mesh loaded with keepHostGeometry.
+	 * With a cache path the quantized BVH is loaded from disk when the geometry matches, and written there after a rebuild.
+	 */
+	btBvhTriangleMeshShape* triangleMesh(const render::Mesh* mesh, const char* cachePath = nullptr);
+
+private:
+	enum ShapeType : uint32_t {
+		SHAPE_BOX,
+		SHAPE_SPHERE,
+		SHAPE_CAPSULE,
+		SHAPE_TRIANGLE_MESH
+	};
+
+	struct ShapeKey {
+		uint32_t type;
+		uint64_t params[3];
+
+		bool operator==(const ShapeKey& o) const {
+			return type == o.type && params[0] == o.params[0] && params[1] == o.params[1] && params[2] == o.params[2];
+		}
+	};
+
+	struct ShapeKeyHash {
+		size_t operator()(const ShapeKey& k) const;
+	};
+
+	/* Geometry the triangle mesh shape points into, kept alive for the shape's lifetime */
+	struct TriangleMeshData {
+		std::vector<float> positions;
+		std::vector<uint16_t> indices;
+		btTriangleIndexVertexArray* meshInterface;
+		void* bvhBuffer;
+	};
+
+	btAlignedObjectArray<btCollisionShape*>* owner;
+	std::unordered_map<ShapeKey, btCollisionShape*, ShapeKeyHash> shapes;
+	std::vector<TriangleMeshData*> meshData;
+
+	btCollisionShape* find(const ShapeKey& key);
+	void add(const ShapeKey& key, btCollisionShape* shape);
+};
@@ -0,0 +1,36 @@
+#include "slotAllocator.h"
+
+#include <stdexcept>
+#include <string>
+
+using namespace render;
+
+SlotAllocator::SlotAllocator(uint32_t capacity, const char* name) {
+    this->capacity = capacity;
+    this->name = name;
+}
+
+uint32_t SlotAllocator::allocate() {
+    std::lock_guard<std::mutex> guard(lock);
+    if (!freeSlots.empty()) {
+        uint32_t slot = freeSlots.back();
+        freeSlots.pop_back();
+        return slot;
+    }
+    if (highWater == capacity) {
+        throw std::runtime_error(std::string(name) + " table is full");
+    }
+    return highWater++;
+}
+
+void SlotAllocator::free(uint32_t slot) {
+    if (slot == noSlot) return;
+
+    std::lock_guard<std::mutex> guard(lock);
+    freeSlots.push_back(slot);
+}
+
+uint32_t SlotAllocator::used() {
+    std::lock_guard<std::mutex> guard(lock);
+    return highWater - static_cast<uint32_t>(freeSlots.size());
+}
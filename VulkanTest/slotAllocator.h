@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+namespace render
+{
+    /*
+     * Hands out indices into a fixed size descriptor array, the bindless texture table.
+     * Freed slots are reused before the array grows, so a table that streams textures in and out doesn't fill up.
+     * Slots a frame in flight could still sample go back through DeletionQueue::slot.
+     *
+     * Any thread.
+     */
+    class SlotAllocator {
+    public:
+        static const uint32_t noSlot = UINT32_MAX;
+
+        SlotAllocator(uint32_t capacity, const char* name);
+
+        /* Throws when every slot is taken */
+        uint32_t allocate();
+        void free(uint32_t slot);
+
+        uint32_t used();
+
+    private:
+        uint32_t capacity;
+        const char* name;
+
+        std::mutex lock;
+        /* Slots below this have been handed out at some point */
+        uint32_t highWater = 0;
+        std::vector<uint32_t> freeSlots;
+    };
+};
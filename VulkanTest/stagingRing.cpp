@@ -0,0 +1,501 @@
+#include "stagingRing.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <stdexcept>
+
+using namespace render;
+
+StagingRing::StagingRing(VkDevice device, VkPhysicalDevice physicalDevice, GpuAllocator* allocator, QueueFunnel* queues, VkQueue transferQueue, uint32_t transferFamily, VkQueue graphicsQueue, uint32_t graphicsFamily, VkDeviceSize capacity) {
+    this->device = device;
+    this->allocator = allocator;
+    this->queues = queues;
+    this->transferQueue = transferQueue;
+    this->graphicsQueue = graphicsQueue;
+    this->transferFamily = transferFamily;
+    this->graphicsFamily = graphicsFamily;
+    this->ownershipTransfer = transferFamily != graphicsFamily;
+    this->size = capacity;
+
+    /* Image copies need offsets that are a multiple of the texel size, 16 covers every format we upload */
+    VkPhysicalDeviceProperties props{};
+    vkGetPhysicalDeviceProperties(physicalDevice, &props);
+    alignment = std::max<VkDeviceSize>(props.limits.optimalBufferCopyOffsetAlignment, 16);
+
+    allocator->createBuffer(size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, buffer, allocation, 0, MemoryCategory::Staging);
+    mapped = static_cast<char*>(allocation.mapped);
+}
+
+StagingRing::~StagingRing() {
+    finish();
+
+    for (auto it = threads.begin(); it != threads.end(); it++)
+    {
+        ThreadContext* ctx = it->second;
+        /* Never submitted, finish asserts against it, dropped with the pools */
+        if (ctx->recording != nullptr) {
+            for (size_t i = 0; i < ctx->recording->oversized.size(); i++)
+            {
+                allocator->destroyBuffer(ctx->recording->oversized[i].buffer, ctx->recording->oversized[i].allocation);
+            }
+            ctx->spare.push_back(ctx->recording);
+        }
+        for (size_t i = 0; i < ctx->spare.size(); i++)
+        {
+            vkDestroyFence(device, ctx->spare[i]->fence, nullptr);
+            if (ownershipTransfer) vkDestroySemaphore(device, ctx->spare[i]->copied, nullptr);
+            delete ctx->spare[i];
+        }
+        vkDestroyCommandPool(device, ctx->commandPool, nullptr);
+        if (ownershipTransfer) vkDestroyCommandPool(device, ctx->acquirePool, nullptr);
+        delete ctx;
+    }
+    allocator->destroyBuffer(buffer, allocation);
+}
+
+VkDeviceSize StagingRing::capacity() const {
+    return size;
+}
+
+VkDeviceSize StagingRing::bytesInFlight() {
+    std::lock_guard<std::mutex> guard(lock);
+    return head - tail;
+}
+
+StagingRing::ThreadContext* StagingRing::context() {
+    std::thread::id id = std::this_thread::get_id();
+    auto it = threads.find(id);
+    if (it != threads.end()) return it->second;
+
+    ThreadContext* ctx = new ThreadContext{};
+
+    VkCommandPoolCreateInfo poolInfo{};
+    poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    poolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT | VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+    poolInfo.queueFamilyIndex = transferFamily;
+    if (vkCreateCommandPool(device, &poolInfo, nullptr, &ctx->commandPool) != VK_SUCCESS) {
+        throw std::runtime_error("Failed to create staging command pool");
+    }
+
+    if (ownershipTransfer) {
+        poolInfo.queueFamilyIndex = graphicsFamily;
+        if (vkCreateCommandPool(device, &poolInfo, nullptr, &ctx->acquirePool) != VK_SUCCESS) {
+            throw std::runtime_error("Failed to create staging command pool");
+        }
+    }
+
+    threads[id] = ctx;
+    return ctx;
+}
+
+StagingRing::Batch* StagingRing::currentBatch(ThreadContext* ctx) {
+    if (ctx->recording != nullptr) return ctx->recording;
+
+    Batch* batch;
+    if (!ctx->spare.empty()) {
+        batch = ctx->spare.back();
+        ctx->spare.pop_back();
+    }
+    else {
+        batch = new Batch{};
+        batch->owner = ctx;
+
+        VkCommandBufferAllocateInfo allocInfo{};
+        allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+        allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+        allocInfo.commandPool = ctx->commandPool;
+        allocInfo.commandBufferCount = 1;
+        if (vkAllocateCommandBuffers(device, &allocInfo, &batch->cmdBuffer) != VK_SUCCESS) {
+            throw std::runtime_error("Failed to allocate staging command buffer");
+        }
+
+        VkFenceCreateInfo fenceInfo{};
+        fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+        if (vkCreateFence(device, &fenceInfo, nullptr, &batch->fence) != VK_SUCCESS) {
+            throw std::runtime_error("Failed to create staging fence");
+        }
+
+        if (ownershipTransfer) {
+            allocInfo.commandPool = ctx->acquirePool;
+            if (vkAllocateCommandBuffers(device, &allocInfo, &batch->acquireCmdBuffer) != VK_SUCCESS) {
+                throw std::runtime_error("Failed to allocate staging command buffer");
+            }
+
+            VkSemaphoreCreateInfo semaphoreInfo{};
+            semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+            if (vkCreateSemaphore(device, &semaphoreInfo, nullptr, &batch->copied) != VK_SUCCESS) {
+                throw std::runtime_error("Failed to create staging semaphore");
+            }
+        }
+    }
+
+    batch->ticket = nextTicket++;
+    pending.insert(batch->ticket);
+
+    VkCommandBufferBeginInfo beginInfo{};
+    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    vkBeginCommandBuffer(batch->cmdBuffer, &beginInfo);
+
+    ctx->recording = batch;
+    return batch;
+}
+
+void StagingRing::reclaim() {
+    for (size_t i = 0; i < inFlight.size();)
+    {
+        Batch* batch = inFlight[i];
+        if (batch->waiters > 0 || vkGetFenceStatus(device, batch->fence) != VK_SUCCESS) {
+            i++;
+            continue;
+        }
+
+        for (size_t j = 0; j < batch->oversized.size(); j++)
+        {
+            allocator->destroyBuffer(batch->oversized[j].buffer, batch->oversized[j].allocation);
+        }
+        batch->oversized.clear();
+        vkResetFences(device, 1, &batch->fence);
+        pending.erase(batch->ticket);
+        batch->owner->spare.push_back(batch);
+
+        inFlight[i] = inFlight.back();
+        inFlight.pop_back();
+    }
+
+    while (!regions.empty() && pending.count(regions.front().ticket) == 0)
+    {
+        tail = regions.front().end;
+        regions.pop_front();
+    }
+    if (regions.empty()) tail = head;
+}
+
+void StagingRing::waitFor(Batch* batch, std::unique_lock<std::mutex>& held) {
+    VkFence fence = batch->fence;
+    batch->waiters++;
+    held.unlock();
+    vkWaitForFences(device, 1, &fence, VK_TRUE, UINT64_MAX);
+    held.lock();
+    batch->waiters--;
+    reclaim();
+}
+
+bool StagingRing::waitForOldest(std::unique_lock<std::mutex>& held) {
+    if (inFlight.empty()) return false;
+
+    Batch* oldest = inFlight[0];
+    for (size_t i = 1; i < inFlight.size(); i++)
+    {
+        if (inFlight[i]->ticket < oldest->ticket) oldest = inFlight[i];
+    }
+    waitFor(oldest, held);
+    return true;
+}
+
+bool StagingRing::reserve(Batch* batch, VkDeviceSize bytes, VkDeviceSize& offset, std::unique_lock<std::mutex>& held) {
+    while (true)
+    {
+        uint64_t start = (head + alignment - 1) / alignment * alignment;
+        /* Never split an upload across the end, skip to the start of the ring instead */
+        if (start % size + bytes > size) start += size - start % size;
+
+        if (start + bytes - tail <= size) {
+            head = start + bytes;
+            regions.push_back({ head, batch->ticket });
+            offset = start % size;
+            return true;
+        }
+
+        /* Whatever is left is held by batches nobody has submitted yet */
+        reclaim();
+        if (start + bytes - tail > size && !waitForOldest(held)) return false;
+    }
+}
+
+void* StagingRing::stage(Batch* batch, VkDeviceSize bytes, VkBuffer& srcBuffer, VkDeviceSize& srcOffset, std::unique_lock<std::mutex>& held) {
+    if (bytes <= size / 2 && reserve(batch, bytes, srcOffset, held)) {
+        srcBuffer = buffer;
+        return mapped + srcOffset;
+    }
+
+    OversizedBuffer oversized;
+    allocator->createBuffer(bytes, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, oversized.buffer, oversized.allocation, 0, MemoryCategory::Staging);
+    batch->oversized.push_back(oversized);
+    srcBuffer = oversized.buffer;
+    srcOffset = 0;
+    return oversized.allocation.mapped;
+}
+
+void StagingRing::uploadBuffer(VkBuffer dst, VkDeviceSize dstOffset, const void* data, VkDeviceSize bytes, bool concurrent) {
+    if (bytes == 0) return;
+
+    std::unique_lock<std::mutex> held(lock);
+    Batch* batch = currentBatch(context());
+    VkBuffer src;
+    VkBufferCopy copy{};
+    void* staged = stage(batch, bytes, src, copy.srcOffset, held);
+    held.unlock();
+
+    /* The batch belongs to this thread, recording into it needs no lock */
+    memcpy(staged, data, static_cast<size_t>(bytes));
+    copy.dstOffset = dstOffset;
+    copy.size = bytes;
+    vkCmdCopyBuffer(batch->cmdBuffer, src, dst, 1, &copy);
+
+    /* Ownership barriers aren't allowed on concurrent buffers, the semaphore and the acquire's memory barrier cover them */
+    if (concurrent && ownershipTransfer) return;
+
+    VkBufferMemoryBarrier barrier{};
+    barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+    barrier.buffer = dst;
+    barrier.offset = dstOffset;
+    barrier.size = bytes;
+    batch->bufferBarriers.push_back(barrier);
+}
+
+void StagingRing::uploadImage(VkImage dst, VkImageAspectFlags aspect, uint32_t width, uint32_t height, const void* data, VkDeviceSize bytes, VkImageLayout finalLayout) {
+    std::unique_lock<std::mutex> held(lock);
+    Batch* batch = currentBatch(context());
+    VkBuffer src;
+    VkBufferImageCopy region{};
+    void* staged = stage(batch, bytes, src, region.bufferOffset, held);
+    held.unlock();
+
+    memcpy(staged, data, static_cast<size_t>(bytes));
+    region.imageSubresource.aspectMask = aspect;
+    region.imageSubresource.layerCount = 1;
+    region.imageExtent = { width, height, 1 };
+
+    VkImageMemoryBarrier barrier{};
+    barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.image = dst;
+    barrier.subresourceRange.aspectMask = aspect;
+    barrier.subresourceRange.levelCount = 1;
+    barrier.subresourceRange.layerCount = 1;
+    barrier.srcAccessMask = 0;
+    barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    vkCmdPipelineBarrier(batch->cmdBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 1, &barrier);
+
+    vkCmdCopyBufferToImage(batch->cmdBuffer, src, dst, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
+
+    /* The move to finalLayout happens in submit, together with the release when there is one */
+    barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    barrier.newLayout = finalLayout;
+    batch->imageBarriers.push_back(barrier);
+}
+
+void StagingRing::transitionImage(VkImage image, VkImageAspectFlags aspect, VkImageLayout oldLayout, VkImageLayout newLayout) {
+    std::unique_lock<std::mutex> held(lock);
+    Batch* batch = currentBatch(context());
+    held.unlock();
+
+    /* Earlier frames may have used the image in any stage */
+    VkImageMemoryBarrier barrier{};
+    barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    barrier.oldLayout = oldLayout;
+    barrier.newLayout = newLayout;
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.srcAccessMask = VK_ACCESS_MEMORY_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_MEMORY_READ_BIT | VK_ACCESS_MEMORY_WRITE_BIT;
+    barrier.image = image;
+    barrier.subresourceRange.aspectMask = aspect;
+    barrier.subresourceRange.levelCount = VK_REMAINING_MIP_LEVELS;
+    barrier.subresourceRange.layerCount = VK_REMAINING_ARRAY_LAYERS;
+    batch->layoutBarriers.push_back(barrier);
+}
+
+void StagingRing::flush() {
+    std::lock_guard<std::mutex> guard(lock);
+    ThreadContext* ctx = context();
+    if (ctx->openBatches > 0) return;
+    submit(ctx);
+    reclaim();
+}
+
+void StagingRing::submit(ThreadContext* ctx) {
+    if (ctx->recording == nullptr) return;
+
+    Batch* batch = ctx->recording;
+    ctx->recording = nullptr;
+
+    for (size_t i = 0; i < batch->bufferBarriers.size(); i++)
+    {
+        batch->bufferBarriers[i].srcQueueFamilyIndex = ownershipTransfer ? transferFamily : VK_QUEUE_FAMILY_IGNORED;
+        batch->bufferBarriers[i].dstQueueFamilyIndex = ownershipTransfer ? graphicsFamily : VK_QUEUE_FAMILY_IGNORED;
+        batch->bufferBarriers[i].srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        batch->bufferBarriers[i].dstAccessMask = ownershipTransfer ? 0 : VK_ACCESS_MEMORY_READ_BIT;
+    }
+    for (size_t i = 0; i < batch->imageBarriers.size(); i++)
+    {
+        batch->imageBarriers[i].srcQueueFamilyIndex = ownershipTransfer ? transferFamily : VK_QUEUE_FAMILY_IGNORED;
+        batch->imageBarriers[i].dstQueueFamilyIndex = ownershipTransfer ? graphicsFamily : VK_QUEUE_FAMILY_IGNORED;
+        batch->imageBarriers[i].srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        batch->imageBarriers[i].dstAccessMask = ownershipTransfer ? 0 : VK_ACCESS_MEMORY_READ_BIT;
+    }
+
+    uint32_t bufferBarrierCount = static_cast<uint32_t>(batch->bufferBarriers.size());
+    uint32_t imageBarrierCount = static_cast<uint32_t>(batch->imageBarriers.size());
+    uint32_t layoutBarrierCount = static_cast<uint32_t>(batch->layoutBarriers.size());
+
+    if (!ownershipTransfer) {
+        /* Later submissions on the queue read what was copied, whatever stage they read it in */
+        vkCmdPipelineBarrier(batch->cmdBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, 0, 0, nullptr, bufferBarrierCount, batch->bufferBarriers.data(), imageBarrierCount, batch->imageBarriers.data());
+        /* The transfer queue is the graphics queue here. A call of their own, so they come after an upload's move to its final layout. */
+        if (layoutBarrierCount > 0) {
+            vkCmdPipelineBarrier(batch->cmdBuffer, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, 0, 0, nullptr, 0, nullptr, layoutBarrierCount, batch->layoutBarriers.data());
+        }
+    }
+    else {
+        /* Release, the semaphore carries the dependency to the acquire on the graphics queue */
+        vkCmdPipelineBarrier(batch->cmdBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, nullptr, bufferBarrierCount, batch->bufferBarriers.data(), imageBarrierCount, batch->imageBarriers.data());
+    }
+
+    if (vkEndCommandBuffer(batch->cmdBuffer) != VK_SUCCESS) {
+        throw std::runtime_error("Failed to record staging command buffer");
+    }
+
+    VkSubmitInfo submitInfo{};
+    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submitInfo.commandBufferCount = 1;
+    submitInfo.pCommandBuffers = &batch->cmdBuffer;
+
+    if (!ownershipTransfer) {
+        if (queues->submit(transferQueue, 1, &submitInfo, batch->fence) != VK_SUCCESS) {
+            throw std::runtime_error("Failed to submit staging command buffer");
+        }
+    }
+    else {
+        submitInfo.signalSemaphoreCount = 1;
+        submitInfo.pSignalSemaphores = &batch->copied;
+        if (queues->submit(transferQueue, 1, &submitInfo, VK_NULL_HANDLE) != VK_SUCCESS) {
+            throw std::runtime_error("Failed to submit staging command buffer");
+        }
+
+        /* The acquire has the same barriers with the access masks flipped, frame work submitted after it is ordered behind it */
+        for (size_t i = 0; i < batch->bufferBarriers.size(); i++)
+        {
+            batch->bufferBarriers[i].srcAccessMask = 0;
+            batch->bufferBarriers[i].dstAccessMask = VK_ACCESS_MEMORY_READ_BIT;
+        }
+        for (size_t i = 0; i < batch->imageBarriers.size(); i++)
+        {
+            batch->imageBarriers[i].srcAccessMask = 0;
+            batch->imageBarriers[i].dstAccessMask = VK_ACCESS_MEMORY_READ_BIT;
+        }
+
+        /* The semaphore wait only orders this submit, the memory barrier carries concurrent buffer writes on to later frame work */
+        VkMemoryBarrier memoryBarrier{};
+        memoryBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+        memoryBarrier.srcAccessMask = 0;
+        memoryBarrier.dstAccessMask = VK_ACCESS_MEMORY_READ_BIT;
+
+        VkCommandBufferBeginInfo beginInfo{};
+        beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+        beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+        vkBeginCommandBuffer(batch->acquireCmdBuffer, &beginInfo);
+        vkCmdPipelineBarrier(batch->acquireCmdBuffer, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, 0, 1, &memoryBarrier, bufferBarrierCount, batch->bufferBarriers.data(), imageBarrierCount, batch->imageBarriers.data());
+        if (layoutBarrierCount > 0) {
+            vkCmdPipelineBarrier(batch->acquireCmdBuffer, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, 0, 0, nullptr, 0, nullptr, layoutBarrierCount, batch->layoutBarriers.data());
+        }
+        if (vkEndCommandBuffer(batch->acquireCmdBuffer) != VK_SUCCESS) {
+            throw std::runtime_error("Failed to record staging command buffer");
+        }
+
+        VkPipelineStageFlags waitStage = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;
+        VkSubmitInfo acquireInfo{};
+        acquireInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+        acquireInfo.waitSemaphoreCount = 1;
+        acquireInfo.pWaitSemaphores = &batch->copied;
+        acquireInfo.pWaitDstStageMask = &waitStage;
+        acquireInfo.commandBufferCount = 1;
+        acquireInfo.pCommandBuffers = &batch->acquireCmdBuffer;
+        if (queues->submit(graphicsQueue, 1, &acquireInfo, batch->fence) != VK_SUCCESS) {
+            throw std::runtime_error("Failed to submit staging acquire");
+        }
+    }
+
+    batch->bufferBarriers.clear();
+    batch->imageBarriers.clear();
+    batch->layoutBarriers.clear();
+    inFlight.push_back(batch);
+}
+
+void StagingRing::finish() {
+    std::unique_lock<std::mutex> held(lock);
+    /* Looked up rather than created, a thread that never uploaded has nothing to submit */
+    auto found = threads.find(std::this_thread::get_id());
+    ThreadContext* own = found != threads.end() ? found->second : nullptr;
+    /* Another thread's batch is recorded from its own pool, submitting it here would race its uploads */
+    for (auto it = threads.begin(); it != threads.end(); it++)
+    {
+        assert((it->second == own || it->second->recording == nullptr) && "finish with another thread's uploads still recording");
+        assert(it->second->openBatches == 0 && "finish inside an open batch");
+    }
+    if (own != nullptr) submit(own);
+    while (!inFlight.empty())
+    {
+        reclaim();
+        if (!inFlight.empty()) waitForOldest(held);
+    }
+}
+
+void StagingRing::beginBatch() {
+    std::lock_guard<std::mutex> guard(lock);
+    ThreadContext* ctx = context();
+    /* Whatever was recorded before the batch goes out on its own */
+    if (ctx->openBatches++ == 0) submit(ctx);
+}
+
+uint64_t StagingRing::endBatch() {
+    std::lock_guard<std::mutex> guard(lock);
+    ThreadContext* ctx = context();
+    if (ctx->openBatches == 0) {
+        throw std::runtime_error("endBatch without beginBatch");
+    }
+    /* An inner batch shares the outer one's submit */
+    if (--ctx->openBatches > 0) return currentBatch(ctx)->ticket;
+
+    uint64_t ticket = ctx->recording != nullptr ? ctx->recording->ticket : 0;
+    submit(ctx);
+    return ticket;
+}
+
+bool StagingRing::isComplete(uint64_t ticket) {
+    std::lock_guard<std::mutex> guard(lock);
+    reclaim();
+    return pending.count(ticket) == 0;
+}
+
+void StagingRing::wait(uint64_t ticket) {
+    std::unique_lock<std::mutex> held(lock);
+    ThreadContext* ctx = context();
+    if (ctx->recording != nullptr && ctx->recording->ticket == ticket) {
+        /* Submitting here would split the outer batch, and without a submit there is nothing to wait on */
+        if (ctx->openBatches > 0) {
+            throw std::runtime_error("Waiting on uploads of a batch that is still open on this thread");
+        }
+        submit(ctx);
+    }
+
+    while (true)
+    {
+        reclaim();
+        if (pending.count(ticket) == 0) return;
+
+        Batch* batch = nullptr;
+        for (size_t i = 0; i < inFlight.size(); i++)
+        {
+            if (inFlight[i]->ticket == ticket) batch = inFlight[i];
+        }
+        /* Still recording on another thread, nothing to wait on yet */
+        if (batch == nullptr) return;
+        waitFor(batch, held);
+    }
+}
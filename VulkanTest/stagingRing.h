@@ -0,0 +1,159 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "gpuMemory.h"
+#include "queueFunnel.h"
+
+namespace render
+{
+    /*
+     * One persistently mapped upload buffer used as a ring.
+     * Uploads are copied into the ring straight away and their copy commands recorded into a pending command buffer,
+     * flush submits everything recorded so far at once with a fence and returns without waiting.
+     * Ring space is handed back when the fence of the flush that used it has signaled.
+     *
+     * With a dedicated transfer family the copies run on the transfer queue and the destinations are released to the graphics family.
+     * Each flush then also submits a small acquire command buffer to the graphics queue, waiting on a semaphore from the copy submit,
+     * so the graphics queue only waits for the uploads where frame work submitted after the flush begins.
+     *
+     * Any thread can upload. Each thread records into its own command buffers from its own pools and only ever submits its own,
+     * so a worker's uploads go out when it flushes or commits its batch, not with the frame.
+     * Mesh, Submesh and texture loads wrap their uploads in a batch of their own for that reason.
+     */
+    class StagingRing {
+    public:
+        StagingRing(VkDevice device, VkPhysicalDevice physicalDevice, GpuAllocator* allocator, QueueFunnel* queues, VkQueue transferQueue, uint32_t transferFamily, VkQueue graphicsQueue, uint32_t graphicsFamily, VkDeviceSize capacity);
+        /* Every other thread has to be done uploading */
+        ~StagingRing();
+
+        /* data can be freed as soon as these return, the copy lands on the GPU with the next flush.
+         * Destinations have to be new or idle, the copies are not ordered after earlier GPU reads of them.
+         * A concurrent dst, shared between the transfer and graphics families (MeshPool), isn't released to the graphics family.
+         */
+        void uploadBuffer(VkBuffer dst, VkDeviceSize dstOffset, const void* data, VkDeviceSize bytes, bool concurrent = false);
+        /* Whole first mip and layer, the image goes from undefined to finalLayout */
+        void uploadImage(VkImage dst, VkImageAspectFlags aspect, uint32_t width, uint32_t height, const void* data, VkDeviceSize bytes, VkImageLayout finalLayout);
+        /* For images that aren't uploaded in the same flush, the transition runs after the copies.
+         * The image stays with the graphics family, the transition is recorded on the graphics queue.
+         */
+        void transitionImage(VkImage image, VkImageAspectFlags aspect, VkImageLayout oldLayout, VkImageLayout newLayout);
+
+        /* Submits the calling thread's pending uploads. Work submitted to the graphics queue afterwards sees the results.
+         * Does nothing while the thread has a batch open.
+         */
+        void flush();
+        /* Submits the calling thread's pending uploads and blocks until everything in flight has landed, only for teardown and level loads.
+         * Other threads have to flush or end their batches first, no thread can have a batch open.
+         */
+        void finish();
+
+        /* See UploadBatch, batches belong to the thread that began them. Until the outermost batch ends nothing is submitted,
+         * uploads that don't fit the ring get their own buffer instead of forcing a submit, so the whole batch goes out as one command buffer.
+         * endBatch returns the ticket of that submit, 0 when nothing was recorded.
+         */
+        void beginBatch();
+        uint64_t endBatch();
+        bool isComplete(uint64_t ticket);
+        /* Throws for a ticket of the calling thread's batch while it is still open, its submit belongs to the outermost endBatch */
+        void wait(uint64_t ticket);
+
+        VkDeviceSize capacity() const;
+        VkDeviceSize bytesInFlight();
+
+    private:
+        struct OversizedBuffer {
+            VkBuffer buffer;
+            Allocation allocation;
+        };
+
+        struct ThreadContext;
+
+        /* One flush worth of uploads */
+        struct Batch {
+            ThreadContext* owner;
+            uint64_t ticket;
+            VkCommandBuffer cmdBuffer;
+            /* Only used with a dedicated transfer family */
+            VkCommandBuffer acquireCmdBuffer;
+            VkSemaphore copied;
+            /* Signaled once the copies, and the acquire if there is one, are done */
+            VkFence fence;
+            /* Threads blocked on the fence, the batch can't be recycled under them */
+            uint32_t waiters = 0;
+            /* Final barriers for every destination, queued until flush so they go out in one call */
+            std::vector<VkBufferMemoryBarrier> bufferBarriers;
+            std::vector<VkImageMemoryBarrier> imageBarriers;
+            /* transitionImage, recorded on the graphics queue after the copies and acquires, never an ownership transfer */
+            std::vector<VkImageMemoryBarrier> layoutBarriers;
+            /* Uploads bigger than the ring get a buffer of their own, freed with the batch */
+            std::vector<OversizedBuffer> oversized;
+        };
+
+        /* Command pools are externally synchronized, so every uploading thread gets its own */
+        struct ThreadContext {
+            VkCommandPool commandPool;
+            VkCommandPool acquirePool;
+            Batch* recording = nullptr;
+            uint32_t openBatches = 0;
+            std::vector<Batch*> spare;
+        };
+
+        /* A reserved stretch of the ring, in ring order. Batches from different threads finish out of order,
+         * the tail only moves past regions whose batch is done.
+         */
+        struct Region {
+            uint64_t end;
+            uint64_t ticket;
+        };
+
+        VkDevice device;
+        GpuAllocator* allocator;
+        QueueFunnel* queues;
+        VkQueue transferQueue;
+        VkQueue graphicsQueue;
+        uint32_t transferFamily;
+        uint32_t graphicsFamily;
+        bool ownershipTransfer;
+
+        VkBuffer buffer;
+        Allocation allocation;
+        char* mapped;
+        VkDeviceSize size;
+        VkDeviceSize alignment;
+
+        /* Guards everything below */
+        std::mutex lock;
+
+        /* Monotonic byte positions, the ring offset is position % size */
+        uint64_t head = 0;
+        uint64_t tail = 0;
+        std::deque<Region> regions;
+
+        uint64_t nextTicket = 1;
+        /* Tickets of batches that are recording or in flight */
+        std::unordered_set<uint64_t> pending;
+        std::vector<Batch*> inFlight;
+        std::unordered_map<std::thread::id, ThreadContext*> threads;
+
+        /* Everything below expects lock to be held */
+        ThreadContext* context();
+        Batch* currentBatch(ThreadContext* ctx);
+        void submit(ThreadContext* ctx);
+        void reclaim();
+        /* Unlocks while blocking on the fence */
+        void waitFor(Batch* batch, std::unique_lock<std::mutex>& held);
+        bool waitForOldest(std::unique_lock<std::mutex>& held);
+        bool reserve(Batch* batch, VkDeviceSize bytes, VkDeviceSize& offset, std::unique_lock<std::mutex>& held);
+        /* Returns where the caller copies the data to, which it does after unlocking */
+        void* stage(Batch* batch, VkDeviceSize bytes, VkBuffer& srcBuffer, VkDeviceSize& srcOffset, std::unique_lock<std::mutex>& held);
+    };
+};
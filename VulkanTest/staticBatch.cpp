@@ -0,0 +1,124 @@
+#include "staticBatch.h"
+
+#include <cmath>
+#include <iostream>
+#include <map>
+#include <tuple>
+
+/* Submeshes of a cluster share its vertex buffer, 16 bit indices reach this far into it */
+const size_t maxClusterVertices = UINT16_MAX + 1;
+
+struct ClusterGeometry {
+	std::vector<render::Vertex> vertices;
+	/* Material index to indices */
+	std::map<uint16_t, std::vector<uint16_t>> indices;
+};
+
+inline bool hasHostGeometry(const render::Mesh* mesh) {
+	if (mesh->hostVertices.empty() || mesh->hostVertices.size() > maxClusterVertices) return false;
+	for (size_t i = 0; i < mesh->submeshes.size(); i++)
+	{
+		if (mesh->submeshes[i].hostIndices.size() != mesh->submeshes[i].iBufferSize) return false;
+	}
+	return true;
+}
+
+StaticBatch::StaticBatch(render::Drawer* drawer, const std::vector<Renderer>& renderers, float clusterSize, std::vector<Renderer>& unmerged) {
+	this->drawer = drawer;
+
+	/* The last cluster of a cell is the one being filled, a cell gets another once the vertices run out */
+	std::map<std::tuple<int, int, int>, std::vector<ClusterGeometry>> cells;
+	for (size_t i = 0; i < renderers.size(); i++)
+	{
+		const render::Mesh* mesh = renderers[i].mesh;
+		if (!hasHostGeometry(mesh)) {
+			unmerged.push_back(renderers[i]);
+			continue;
+		}
+		merged.push_back(renderers[i]);
+
+		glm::mat4 model{};
+		renderers[i].motionState->getGraphicsTransform(&model);
+		glm::vec3 center = glm::vec3(model * glm::vec4((mesh->boundsMin + mesh->boundsMax) * 0.5f, 1.0f));
+		std::tuple<int, int, int> cell{
+			static_cast<int>(std::floor(center.x / clusterSize)),
+			static_cast<int>(std::floor(center.y / clusterSize)),
+			static_cast<int>(std::floor(center.z / clusterSize)) };
+
+		std::vector<ClusterGeometry>& geometry = cells[cell];
+		if (geometry.empty() || geometry.back().vertices.size() + mesh->hostVertices.size() > maxClusterVertices) geometry.emplace_back();
+		ClusterGeometry& cluster = geometry.back();
+
+		uint32_t base = static_cast<uint32_t>(cluster.vertices.size());
+		for (size_t v = 0; v < mesh->hostVertices.size(); v++)
+		{
+			render::Vertex vertex = mesh->hostVertices[v];
+			vertex.pos = glm::vec3(model * glm::vec4(vertex.pos, 1.0f));
+			cluster.vertices.push_back(vertex);
+		}
+
+		/* A mirroring transform turns the triangles around */
+		bool flip = glm::determinant(glm::mat3(model)) < 0.0f;
+		for (size_t j = 0; j < mesh->submeshes.size(); j++)
+		{
+			const render::Submesh& submesh = mesh->submeshes[j];
+			std::vector<uint16_t>& indices = cluster.indices[submesh.materialIndex];
+			for (size_t k = 0; k + 2 < submesh.hostIndices.size(); k += 3)
+			{
+				indices.push_back(static_cast<uint16_t>(base + submesh.hostIndices[k]));
+				indices.push_back(static_cast<uint16_t>(base + submesh.hostIndices[flip ? k + 2 : k + 1]));
+				indices.push_back(static_cast<uint16_t>(base + submesh.hostIndices[flip ? k + 1 : k + 2]));
+			}
+		}
+	}
+
+	for (auto it = cells.begin(); it != cells.end(); it++)
+	{
+		for (size_t i = 0; i < it->second.size(); i++)
+		{
+			ClusterGeometry& cluster = it->second[i];
+			std::vector<render::Submesh::SubmeshCreateInfo> infos;
+			for (auto material = cluster.indices.begin(); material != cluster.indices.end(); material++)
+			{
+				if (material->second.empty()) continue;
+				infos.push_back(render::Submesh::SubmeshCreateInfo(material->second.data(), static_cast<uint32_t>(material->second.size()), material->first));
+			}
+			if (infos.empty()) continue;
+
+			/* Pooled, the clusters share one vertex and one index buffer with every other static mesh */
+			clusters.push_back(new render::Mesh(drawer, cluster.vertices.data(), static_cast<uint32_t>(cluster.vertices.size()), infos));
+		}
+	}
+
+	std::cout << "Static batching: " << merged.size() << " renderers into " << clusters.size() << " clusters, " << unmerged.size() << " left unmerged\n";
+}
+
+StaticBatch::~StaticBatch() {
+	for (size_t i = 0; i < clusters.size(); i++)
+	{
+		clusters[i]->free(drawer);
+		delete clusters[i];
+	}
+}
+
+void StaticBatch::gatherDraws(std::vector<render::DrawItem>& items, const render::Frustum* frustum) const {
+	const glm::mat4 identity(1.0f);
+	for (size_t i = 0; i < clusters.size(); i++)
+	{
+		render::Mesh* mesh = clusters[i];
+		if (frustum != nullptr && !frustum->intersects(mesh->boundsMin, mesh->boundsMax, identity)) continue;
+
+		for (size_t j = 0; j < mesh->submeshes.size(); j++)
+		{
+			items.push_back({ mesh, &mesh->submeshes[j], &(drawer->registeredMaterials[mesh->submeshes[j].materialIndex]), identity, glm::vec4(0) });
+		}
+	}
+}
+
+size_t StaticBatch::clusterCount() const {
+	return clusters.size();
+}
+
+const std::vector<Renderer>& StaticBatch::sources() const {
+	return merged;
+}
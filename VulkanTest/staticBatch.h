@@ -0,0 +1,33 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <glm/glm.hpp>
+#include "render.h"
+#include "scene.h"
+
+/*
+ * Static renderers baked into world space geometry at load. Renderers are sorted into cells of clusterSize by the centre of their bounds,
+ * every cell becomes one mesh with a submesh per material, so a static world draws in a handful of calls
+ * and is still frustum culled a cluster at a time.
+ *
+ * Only meshes that kept their host geometry can be merged, renderers of other meshes are handed back.
+ * The source meshes are left alone, dynamic renderers may share them.
+ */
+class StaticBatch {
+public:
+	StaticBatch(render::Drawer* drawer, const std::vector<Renderer>& renderers, float clusterSize, std::vector<Renderer>& unmerged);
+	~StaticBatch();
+
+	/* One item per cluster submesh, only the clusters inside frustum unless it is null */
+	void gatherDraws(std::vector<render::DrawItem>& items, const render::Frustum* frustum) const;
+
+	size_t clusterCount() const;
+	/* The renderers baked into the clusters, to build from again */
+	const std::vector<Renderer>& sources() const;
+
+private:
+	render::Drawer* drawer;
+	std::vector<render::Mesh*> clusters;
+	std::vector<Renderer> merged;
+};
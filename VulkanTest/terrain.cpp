@@ -0,0 +1,286 @@
+#include "terrain.h"
+#include "scene.h"
+#include "physicsMemory.h"
+
+#include <glm/gtc/matrix_transform.hpp>
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <iostream>
+#include <stdexcept>
+
+/* Skirt vertices follow the grid, one run of chunkQuads + 1 per edge in this order */
+enum TerrainEdge {
+	EDGE_NEAR,  // z = 0
+	EDGE_FAR,   // z = chunkSize
+	EDGE_LEFT,  // x = 0
+	EDGE_RIGHT  // x = chunkSize
+};
+
+Terrain::Terrain(render::Drawer* drawer, Scene* scene, TerrainCreateInfo info) {
+	if (info.chunkQuads == 0 || (info.chunkQuads & (info.chunkQuads - 1)) != 0) {
+		throw std::runtime_error("Terrain chunkQuads has to be a power of two");
+	}
+	if ((info.chunkQuads + 1) * (info.chunkQuads + 1) + 4 * (info.chunkQuads + 1) > UINT16_MAX) {
+		throw std::runtime_error("Terrain chunk does not fit 16 bit indices");
+	}
+	if (info.lodCount == 0 || (info.chunkQuads >> (info.lodCount - 1)) == 0) {
+		throw std::runtime_error("Terrain has more LOD levels than the chunk resolution allows");
+	}
+	if (info.unloadRadius < info.loadRadius) info.unloadRadius = info.loadRadius;
+
+	this->drawer = drawer;
+	this->scene = scene;
+	this->info = info;
+	chunkSize = info.chunkQuads * info.quadSize;
+
+	buildLods();
+}
+
+Terrain::~Terrain() {
+	for (auto it = chunks.begin(); it != chunks.end(); it++)
+	{
+		scene->removeRigidBody(it->second->body);
+		drawer->budget->removeStreamable(it->second->streamId);
+		delete it->second->shape;
+		it->second->mesh->free(drawer);
+		delete it->second->mesh;
+		delete it->second;
+	}
+	chunks.clear();
+
+	for (size_t i = 0; i < lods.size(); i++)
+	{
+		lods[i].free(drawer);
+	}
+}
+
+uint64_t Terrain::chunkKey(int x, int z) {
+	return (static_cast<uint64_t>(static_cast<uint32_t>(x)) << 32) | static_cast<uint32_t>(z);
+}
+
+size_t Terrain::loadedChunks() const {
+	return chunks.size();
+}
+
+inline uint16_t skirtVertex(uint32_t quads, TerrainEdge edge, uint32_t i) {
+	uint32_t side = quads + 1;
+	return static_cast<uint16_t>(side * side + edge * side + i);
+}
+
+void Terrain::buildLods() {
+	uint32_t n = info.chunkQuads;
+	uint32_t side = n + 1;
+
+	for (uint32_t level = 0; level < info.lodCount; level++)
+	{
+		uint32_t step = 1u << level;
+		std::vector<uint16_t> indices;
+		indices.reserve((n / step) * (n / step) * 6 + 4 * (n / step) * 6);
+
+		/* Same winding as Drawer::defaultBox, front faces point up */
+		for (uint32_t r = 0; r < n; r += step)
+		{
+			for (uint32_t c = 0; c < n; c += step)
+			{
+				uint16_t v00 = static_cast<uint16_t>(r * side + c);
+				uint16_t v01 = static_cast<uint16_t>(r * side + c + step);
+				uint16_t v10 = static_cast<uint16_t>((r + step) * side + c);
+				uint16_t v11 = static_cast<uint16_t>((r + step) * side + c + step);
+				indices.insert(indices.end(), { v00, v10, v01, v01, v10, v11 });
+			}
+		}
+
+		/* Skirts hang off every edge facing outwards, deep enough to cover the gap to a neighbour at another level */
+		for (uint32_t i = 0; i < n; i += step)
+		{
+			uint16_t e0, e1, k0, k1;
+
+			e0 = static_cast<uint16_t>(i); e1 = static_cast<uint16_t>(i + step);
+			k0 = skirtVertex(n, EDGE_NEAR, i); k1 = skirtVertex(n, EDGE_NEAR, i + step);
+			indices.insert(indices.end(), { e0, e1, k0, e1, k1, k0 });
+
+			e0 = static_cast<uint16_t>(n * side + i); e1 = static_cast<uint16_t>(n * side + i + step);
+			k0 = skirtVertex(n, EDGE_FAR, i); k1 = skirtVertex(n, EDGE_FAR, i + step);
+			indices.insert(indices.end(), { e0, k0, e1, e1, k0, k1 });
+
+			e0 = static_cast<uint16_t>(i * side); e1 = static_cast<uint16_t>((i + step) * side);
+			k0 = skirtVertex(n, EDGE_LEFT, i); k1 = skirtVertex(n, EDGE_LEFT, i + step);
+			indices.insert(indices.end(), { e0, k0, e1, e1, k0, k1 });
+
+			e0 = static_cast<uint16_t>(i * side + n); e1 = static_cast<uint16_t>((i + step) * side + n);
+			k0 = skirtVertex(n, EDGE_RIGHT, i); k1 = skirtVertex(n, EDGE_RIGHT, i + step);
+			indices.insert(indices.end(), { e0, e1, k0, e1, k1, k0 });
+		}
+
+		lods.push_back(render::Submesh(drawer, render::Submesh::SubmeshCreateInfo(indices.data(), static_cast<uint32_t>(indices.size()), info.materialIndex), true));
+	}
+}
+
+void Terrain::loadChunk(int x, int z) {
+	uint32_t n = info.chunkQuads;
+	uint32_t side = n + 1;
+	float originX = x * chunkSize;
+	float originZ = z * chunkSize;
+
+	Chunk* chunk = new Chunk{};
+	chunk->x = x;
+	chunk->z = z;
+	chunk->lod = info.lodCount - 1;
+	chunk->model = glm::translate(glm::mat4(1.0f), glm::vec3(originX, 0, originZ));
+
+	chunk->heights.resize(side * side);
+	float minHeight = FLT_MAX;
+	float maxHeight = -FLT_MAX;
+	for (uint32_t r = 0; r < side; r++)
+	{
+		for (uint32_t c = 0; c < side; c++)
+		{
+			float h = info.height(originX + c * info.quadSize, originZ + r * info.quadSize);
+			chunk->heights[r * side + c] = h;
+			minHeight = std::min(minHeight, h);
+			maxHeight = std::max(maxHeight, h);
+		}
+	}
+
+	/* No normals in render::Vertex, so the slope lighting is baked into the vertex color */
+	const glm::vec3 sun = glm::normalize(glm::vec3(0.4f, 1.0f, 0.3f));
+	const glm::vec3 grass(0.25f, 0.45f, 0.18f);
+	const glm::vec3 rock(0.42f, 0.4f, 0.38f);
+	std::vector<render::Vertex> vertices(side * side + 4 * side);
+	for (uint32_t r = 0; r < side; r++)
+	{
+		for (uint32_t c = 0; c < side; c++)
+		{
+			float wx = originX + c * info.quadSize;
+			float wz = originZ + r * info.quadSize;
+			glm::vec3 normal = glm::normalize(glm::vec3(
+				info.height(wx - info.quadSize, wz) - info.height(wx + info.quadSize, wz),
+				2.0f * info.quadSize,
+				info.height(wx, wz - info.quadSize) - info.height(wx, wz + info.quadSize)));
+			glm::vec3 base = glm::mix(grass, rock, glm::clamp((1.0f - normal.y) * 4.0f, 0.0f, 1.0f));
+
+			render::Vertex& v = vertices[r * side + c];
+			v.pos = glm::vec3(c * info.quadSize, chunk->heights[r * side + c], r * info.quadSize);
+			v.color = base * (0.35f + 0.65f * std::max(glm::dot(normal, sun), 0.0f));
+			v.texCoord = glm::vec2(wx, wz) / 16.0f;
+		}
+	}
+
+	for (uint32_t i = 0; i < side; i++)
+	{
+		const uint32_t edgeVertices[4] = { i, n * side + i, i * side, i * side + n };
+		for (int edge = 0; edge < 4; edge++)
+		{
+			render::Vertex v = vertices[edgeVertices[edge]];
+			v.pos.y -= info.skirtDepth;
+			vertices[skirtVertex(n, static_cast<TerrainEdge>(edge), i)] = v;
+		}
+	}
+
+	chunk->mesh = new render::Mesh(drawer, vertices.data(), static_cast<uint32_t>(vertices.size()), {}, false, true);
+
+	{
+		physicsMemory::Scope scope(physicsMemory::CATEGORY_SHAPES);
+		chunk->shape = new btHeightfieldTerrainShape(side, side, chunk->heights.data(), 1.0f, minHeight, maxHeight, 1, PHY_FLOAT, false);
+		chunk->shape->setLocalScaling(btVector3(info.quadSize, 1, info.quadSize));
+	}
+
+	/* btHeightfieldTerrainShape is centered on its bounds */
+	btTransform transform;
+	transform.setIdentity();
+	transform.setOrigin(btVector3(originX + chunkSize * 0.5f, (minHeight + maxHeight) * 0.5f, originZ + chunkSize * 0.5f));
+	btRigidBody::btRigidBodyConstructionInfo bodyInfo(0, nullptr, chunk->shape);
+	bodyInfo.m_startWorldTransform = transform;
+	chunk->body = scene->addRigidBody(bodyInfo);
+
+	const render::Allocation& allocation = chunk->mesh->vertexAllocation;
+	chunk->streamId = drawer->budget->addStreamable(drawer->memory->heapIndex(allocation.memoryType), allocation.size, [this, chunk]() {
+		chunk->streamId = 0;
+		unloadChunk(chunk);
+	});
+
+	chunks[chunkKey(x, z)] = chunk;
+}
+
+void Terrain::unloadChunk(Chunk* chunk) {
+	if (chunk->streamId != 0) drawer->budget->removeStreamable(chunk->streamId);
+	scene->removeRigidBody(chunk->body);
+	delete chunk->shape;
+	/* Frames in flight can still read the buffers, the deletion queue holds them until they're done */
+	chunk->mesh->free(drawer);
+	delete chunk->mesh;
+	chunks.erase(chunkKey(chunk->x, chunk->z));
+	delete chunk;
+}
+
+void Terrain::update(glm::vec3 cameraPosition) {
+	int cameraX = static_cast<int>(std::floor(cameraPosition.x / chunkSize));
+	int cameraZ = static_cast<int>(std::floor(cameraPosition.z / chunkSize));
+
+	std::vector<Chunk*> leaving;
+	for (auto it = chunks.begin(); it != chunks.end(); it++)
+	{
+		int dx = std::abs(it->second->x - cameraX);
+		int dz = std::abs(it->second->z - cameraZ);
+		if (dx > info.unloadRadius || dz > info.unloadRadius) {
+			leaving.push_back(it->second);
+		}
+		else if (dx <= info.loadRadius && dz <= info.loadRadius) {
+			drawer->budget->touch(it->second->streamId);
+		}
+	}
+	for (size_t i = 0; i < leaving.size(); i++)
+	{
+		unloadChunk(leaving[i]);
+	}
+
+	/* Nearest first, a few per frame so crossing a chunk border doesn't hitch */
+	std::vector<std::pair<int, uint64_t>> missing;
+	for (int z = cameraZ - info.loadRadius; z <= cameraZ + info.loadRadius; z++)
+	{
+		for (int x = cameraX - info.loadRadius; x <= cameraX + info.loadRadius; x++)
+		{
+			if (chunks.find(chunkKey(x, z)) == chunks.end()) {
+				missing.push_back({ (x - cameraX) * (x - cameraX) + (z - cameraZ) * (z - cameraZ), chunkKey(x, z) });
+			}
+		}
+	}
+	std::sort(missing.begin(), missing.end());
+
+	uint32_t side = info.chunkQuads + 1;
+	VkDeviceSize chunkBytes = (side * side + 4 * side) * sizeof(render::Vertex);
+	uint32_t heap = drawer->memory->heapIndex(lods[0].indexAllocation.memoryType);
+	for (size_t i = 0; i < missing.size() && i < info.loadsPerUpdate; i++)
+	{
+		if (!drawer->budget->hasRoom(heap, chunkBytes)) break;
+		loadChunk(static_cast<int32_t>(missing[i].second >> 32), static_cast<int32_t>(missing[i].second & 0xFFFFFFFF));
+	}
+
+	for (auto it = chunks.begin(); it != chunks.end(); it++)
+	{
+		Chunk* chunk = it->second;
+		glm::vec2 center((chunk->x + 0.5f) * chunkSize, (chunk->z + 0.5f) * chunkSize);
+		float distance = glm::length(center - glm::vec2(cameraPosition.x, cameraPosition.z));
+
+		uint32_t lod = 0;
+		float range = info.lodDistance;
+		while (distance > range && lod + 1 < info.lodCount)
+		{
+			lod++;
+			range *= 2;
+		}
+		chunk->lod = lod;
+	}
+}
+
+void Terrain::gatherDraws(std::vector<render::DrawItem>& items, const render::Frustum* frustum) {
+	render::Material* material = &drawer->registeredMaterials[info.materialIndex];
+	for (auto it = chunks.begin(); it != chunks.end(); it++)
+	{
+		Chunk* chunk = it->second;
+		if (frustum != nullptr && !frustum->intersects(chunk->mesh->boundsMin, chunk->mesh->boundsMax, chunk->model)) continue;
+		items.push_back({ chunk->mesh, &lods[chunk->lod], material, chunk->model, glm::vec4(0) });
+	}
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <unordered_map>
+#include <vector>
+#include <glm/glm.hpp>
+#include "render.h"
+#include "btBulletDynamicsCommon.h"
+#include "BulletCollision/CollisionShapes/btHeightfieldTerrainShape.h"
+
+class Scene;
+
+struct TerrainCreateInfo {
+	/* World space height at (x, z), called from the render thread while paging */
+	std::function<float(float x, float z)> height;
+
+	/* Quads per chunk side, a power of two. (chunkQuads + 1)^2 plus the skirt has to fit 16 bit indices. */
+	uint32_t chunkQuads = 64;
+	float quadSize = 2.0f;
+
+	/* Every level halves the grid resolution, lodDistance is where level 1 starts and each level after doubles it */
+	uint32_t lodCount = 5;
+	float lodDistance = 150.0f;
+
+	/* In chunks around the camera. Chunks load inside loadRadius and stay until they leave unloadRadius,
+	 * or until the memory budget evicts them. No new chunks load while the budget has no room for them.
+	 */
+	int loadRadius = 4;
+	int unloadRadius = 6;
+	uint32_t loadsPerUpdate = 2;
+
+	float skirtDepth = 4.0f;
+	uint16_t materialIndex = 0;
+};
+
+/*
+ * Heightfield terrain split into square chunks paged around the camera.
+ * Each chunk has its own vertex buffer and a static btHeightfieldTerrainShape body.
+ * The index buffers for every LOD level are shared by all chunks, skirts hide the cracks between levels.
+ */
+class Terrain {
+public:
+	Terrain(render::Drawer* drawer, Scene* scene, TerrainCreateInfo info);
+	~Terrain();
+
+	/* Once per frame, before drawing */
+	void update(glm::vec3 cameraPosition);
+	/* Appends a draw per loaded chunk, only the ones inside frustum unless it is null */
+	void gatherDraws(std::vector<render::DrawItem>& items, const render::Frustum* frustum);
+
+	size_t loadedChunks() const;
+
+private:
+	struct Chunk {
+		int x;
+		int z;
+		uint32_t lod;
+		glm::mat4 model;
+		render::Mesh* mesh;
+		/* MemoryBudget id, chunks outside loadRadius are the first to go when VRAM runs short */
+		uint64_t streamId;
+
+		/* Bullet reads the heights in place */
+		std::vector<float> heights;
+		btHeightfieldTerrainShape* shape;
+		btRigidBody* body;
+	};
+
+	render::Drawer* drawer;
+	Scene* scene;
+	TerrainCreateInfo info;
+	float chunkSize;
+
+	std::vector<render::Submesh> lods;
+	std::unordered_map<uint64_t, Chunk*> chunks;
+
+	static uint64_t chunkKey(int x, int z);
+	void buildLods();
+	void loadChunk(int x, int z);
+	void unloadChunk(Chunk* chunk);
+};
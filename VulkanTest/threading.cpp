@@ -1,33 +1,23 @@
 #include "threading.h"
 
-void workerMain(std::vector<Work*>* workList) {
-	int log = 0;
-	while (true)
+void workerMain(Threading* threading) {
+	std::unique_lock<std::mutex> lock(threading->scheduleLock);
+	while (!threading->stopping)
 	{
-		if (workList->size() > 0) {
-			log++;
-			if (log > 10000000) {
-				//std::cout << "size: " <<  workList->size() << "\n";
-				//std::cout << "ping " << std::this_thread::get_id() << "\n";
-				log = 0;
-			}
-
-			for (size_t i = 0; i < workList->size(); i++) {
-				if (!workList->at(i)->completion) {
-					std::cout << "found work";
-					if (workList->at(i)->ownership.try_lock()) {
-						std::cout << "got work\n";
-						workList->at(i)->func(workList->at(i)->args);
-						workList->at(i)->completion = true;
-						workList->at(i)->ownership.unlock();
-						std::cout << "operation complete\n";
-					}
-				}
-			}
-		}
-		else {
-			std::this_thread::yield();
+		bool isBackground;
+		Work* w = threading->findWork(isBackground);
+		if (w == nullptr) {
+			threading->workAvailable.wait(lock);
+			continue;
 		}
+
+		if (isBackground) threading->backgroundRunning++;
+		lock.unlock();
+		w->func(w->args);
+		w->completion = true;
+		w->ownership.unlock();
+		lock.lock();
+		if (isBackground) threading->backgroundRunning--;
 	}
 }
 
@@ -45,21 +35,149 @@ ThreadData::ThreadData(std::vector<Work*> scheduled) {
 Threading::Threading() {
 	int maxConcurrent = std::thread::hardware_concurrency();
 	std::cout << "Max concurrent threads: " << maxConcurrent << "\n";
-	for (int i = 0; i < 2; i++) {
-		workers.push_back(std::thread(&workerMain, &scheduled));
-		workers[i].detach();
+	int workerThreads = std::max(2, maxConcurrent - 1);
+	maxBackgroundWorkers = std::max(1, workerThreads / 2);
+	for (int i = 0; i < workerThreads; i++) {
+		workers.push_back(std::thread(&workerMain, this));
 	}
 	//std::thread(workerMain, nullptr, &(workers[0].signal), &(workers[0].activate));
 }
 
-void Threading::update() {
-	for (int i = 0; i < scheduled.size(); i++) {
-		if (scheduled[i]->completion) {
-			scheduled.erase(scheduled.begin() + i);
+Threading::~Threading() {
+	{
+		std::lock_guard<std::mutex> lock(scheduleLock);
+		stopping = true;
+	}
+	workAvailable.notify_all();
+	for (size_t i = 0; i < workers.size(); i++) {
+		workers[i].join();
+	}
+}
+
+inline Work* claim(std::vector<Work*>& queue) {
+	for (size_t i = 0; i < queue.size(); i++) {
+		Work* w = queue[i];
+		if (!w->completion && w->ownership.try_lock()) {
+			if (!w->completion) {
+				return w;
+			}
+			w->ownership.unlock();
+		}
+	}
+	return nullptr;
+}
+
+inline void dropCompleted(std::vector<Work*>& queue) {
+	for (size_t i = 0; i < queue.size();) {
+		if (queue[i]->completion) {
+			queue.erase(queue.begin() + i);
+		}
+		else {
+			i++;
 		}
 	}
 }
 
+/* Must be called with scheduleLock held. Returns the work with its ownership locked. */
+Work* Threading::findWork(bool& isBackground) {
+	isBackground = false;
+	Work* w = claim(scheduled);
+	if (w != nullptr || backgroundRunning >= maxBackgroundWorkers) return w;
+
+	w = claim(background);
+	isBackground = w != nullptr;
+	return w;
+}
+
+void Threading::update() {
+	std::lock_guard<std::mutex> lock(scheduleLock);
+	dropCompleted(scheduled);
+	dropCompleted(background);
+}
+
 void Threading::addWork(Work* w) {
-	scheduled.push_back(w);
-}
\ No newline at end of file
+	{
+		std::lock_guard<std::mutex> lock(scheduleLock);
+		scheduled.push_back(w);
+	}
+	workAvailable.notify_one();
+}
+
+void Threading::addBackgroundWork(Work* w) {
+	{
+		std::lock_guard<std::mutex> lock(scheduleLock);
+		background.push_back(w);
+	}
+	workAvailable.notify_one();
+}
+
+size_t Threading::workerCount() const {
+	return workers.size();
+}
+
+void Threading::parallelFor(size_t count, size_t grainSize, std::function<void(size_t begin, size_t end)> func) {
+	if (count == 0) return;
+	grainSize = std::max<size_t>(grainSize, 1);
+	size_t chunkCount = (count + grainSize - 1) / grainSize;
+
+	if (chunkCount == 1) {
+		func(0, count);
+		return;
+	}
+
+	std::vector<std::pair<size_t, size_t>> ranges(chunkCount);
+	std::vector<std::unique_ptr<Work>> chunks;
+	chunks.reserve(chunkCount);
+	for (size_t i = 0; i < chunkCount; i++)
+	{
+		ranges[i] = { i * grainSize, std::min(count, (i + 1) * grainSize) };
+		chunks.push_back(std::make_unique<Work>(&ranges[i], [&func](void* args) {
+			auto range = reinterpret_cast<std::pair<size_t, size_t>*>(args);
+			func(range->first, range->second);
+		}));
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(scheduleLock);
+		for (size_t i = 0; i < chunkCount; i++) {
+			scheduled.push_back(chunks[i].get());
+		}
+	}
+	workAvailable.notify_all();
+
+	/* The calling thread takes any chunk the workers have not claimed yet */
+	for (size_t i = 0; i < chunkCount; i++)
+	{
+		Work* w = chunks[i].get();
+		if (!w->completion && w->ownership.try_lock()) {
+			if (!w->completion) {
+				w->func(w->args);
+				w->completion = true;
+			}
+			w->ownership.unlock();
+		}
+	}
+
+	for (size_t i = 0; i < chunkCount; i++)
+	{
+		while (!chunks[i]->completion) {
+			std::this_thread::yield();
+		}
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(scheduleLock);
+		scheduled.erase(std::remove_if(scheduled.begin(), scheduled.end(), [&chunks](Work* w) {
+			for (size_t i = 0; i < chunks.size(); i++) {
+				if (chunks[i].get() == w) return true;
+			}
+			return false;
+		}), scheduled.end());
+	}
+
+	/* A worker may still be releasing ownership after flagging completion */
+	for (size_t i = 0; i < chunkCount; i++)
+	{
+		std::lock_guard<std::mutex> wait(chunks[i]->ownership);
+	}
+}
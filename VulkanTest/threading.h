@@ -9,6 +9,8 @@
 #include <atomic>
 #include <semaphore>
 #include <mutex>
+#include <condition_variable>
+#include <memory>
 #include <atomic>
 #include <random>
 #include <iostream>
@@ -16,7 +18,7 @@
 
 struct Work {
 	std::mutex ownership;
-	volatile bool completion;
+	std::atomic<bool> completion;
 	void* args;
 	std::function<void(void* args)> func;
 
@@ -40,10 +42,33 @@ class Threading
 	unsigned int increment = 0;
 	std::vector<std::thread> workers;
 	std::vector<Work*> scheduled;
+	/* Low priority, only claimed when scheduled has nothing left, and by at most maxBackgroundWorkers at once */
+	std::vector<Work*> background;
+	size_t maxBackgroundWorkers = 1;
+	size_t backgroundRunning = 0;
+
+	/* Guards scheduled and background, workers sleep on workAvailable while neither has anything to claim */
+	std::mutex scheduleLock;
+	std::condition_variable workAvailable;
+	bool stopping = false;
+
+	Work* findWork(bool& isBackground);
+	friend void workerMain(Threading* threading);
 
 public:
 	Threading();
+	~Threading();
 
 	void update();
 	void addWork(Work* w);
-};
\ No newline at end of file
+	/* For long jobs nothing waits on this frame (pipeline compiles). They never hold up parallelFor chunks or other work,
+	 * and always leave some workers free for them.
+	 */
+	void addBackgroundWork(Work* w);
+	size_t workerCount() const;
+
+	/* Splits [0, count) into chunks of grainSize and runs func on the workers and the calling thread.
+	 * Returns once every chunk has finished.
+	 */
+	void parallelFor(size_t count, size_t grainSize, std::function<void(size_t begin, size_t end)> func);
+};
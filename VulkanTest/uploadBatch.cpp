@@ -0,0 +1,110 @@
+#include "uploadBatch.h"
+
+#include "stb_image.h"
+
+#include <stdexcept>
+
+using namespace render;
+
+UploadBatch::UploadBatch(Drawer* d) {
+    this->d = d;
+    d->staging->beginBatch();
+}
+
+UploadBatch::~UploadBatch() {
+    if (!committed) commit();
+}
+
+void UploadBatch::addBuffer(VkBuffer dst, VkDeviceSize dstOffset, const void* data, VkDeviceSize bytes) {
+    d->staging->uploadBuffer(dst, dstOffset, data, bytes);
+    this->bytes += bytes;
+    resources++;
+}
+
+void UploadBatch::addImage(VkImage dst, VkImageAspectFlags aspect, uint32_t width, uint32_t height, const void* data, VkDeviceSize bytes, VkImageLayout finalLayout) {
+    d->staging->uploadImage(dst, aspect, width, height, data, bytes, finalLayout);
+    this->bytes += bytes;
+    resources++;
+}
+
+void UploadBatch::addTransition(VkImage image, VkImageAspectFlags aspect, VkImageLayout oldLayout, VkImageLayout newLayout) {
+    d->staging->transitionImage(image, aspect, oldLayout, newLayout);
+}
+
+inline VkDeviceSize meshBytes(const Mesh& m) {
+    VkDeviceSize r = m.vBufferSize * sizeof(Vertex);
+    for (size_t i = 0; i < m.submeshes.size(); i++)
+    {
+        r += m.submeshes[i].iBufferSize * sizeof(uint16_t);
+    }
+    return r;
+}
+
+uint16_t UploadBatch::addMesh(const Vertex* vertices, uint32_t vcount, const std::vector<Submesh::SubmeshCreateInfo>& submeshes, bool keepHostGeometry) {
+    d->registeredMeshes.push_back(Mesh(d, vertices, vcount, submeshes, keepHostGeometry));
+    bytes += meshBytes(d->registeredMeshes.back());
+    resources += 1 + static_cast<uint32_t>(submeshes.size());
+    return static_cast<uint16_t>(d->registeredMeshes.size() - 1);
+}
+
+uint16_t UploadBatch::addMesh(const char* dir, uint16_t materialIndex, bool keepHostGeometry) {
+    uint16_t index;
+    d->loadMesh(dir, &index, materialIndex, keepHostGeometry);
+    bytes += meshBytes(d->registeredMeshes[index]);
+    resources += 1 + static_cast<uint32_t>(d->registeredMeshes[index].submeshes.size());
+    return index;
+}
+
+Submesh UploadBatch::addIndexBuffer(const uint16_t* indices, uint32_t count, uint16_t materialIndex) {
+    bytes += count * sizeof(uint16_t);
+    resources++;
+    return Submesh(d, Submesh::SubmeshCreateInfo(indices, count, materialIndex));
+}
+
+void UploadBatch::addTexture(const char* dir, VkFormat format, VkImage& image, Allocation& allocation) {
+    int width, height, channels;
+    stbi_uc* pixels = stbi_load(dir, &width, &height, &channels, STBI_rgb_alpha);
+    if (!pixels) {
+        throw std::runtime_error("Failed to load image");
+    }
+
+    VkImageCreateInfo info{};
+    info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+    info.imageType = VK_IMAGE_TYPE_2D;
+    info.extent = { static_cast<uint32_t>(width), static_cast<uint32_t>(height), 1 };
+    info.mipLevels = 1;
+    info.arrayLayers = 1;
+    info.format = format;
+    info.tiling = VK_IMAGE_TILING_OPTIMAL;
+    info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    info.usage = VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT;
+    info.samples = VK_SAMPLE_COUNT_1_BIT;
+    info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    d->memory->createImage(info, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, image, allocation, MemoryCategory::Texture);
+
+    addImage(image, VK_IMAGE_ASPECT_COLOR_BIT, info.extent.width, info.extent.height, pixels, static_cast<VkDeviceSize>(width) * height * 4, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+    stbi_image_free(pixels);
+}
+
+void UploadBatch::commit() {
+    if (committed) return;
+    committed = true;
+    ticket = d->staging->endBatch();
+}
+
+bool UploadBatch::isComplete() {
+    return committed && d->staging->isComplete(ticket);
+}
+
+void UploadBatch::wait() {
+    commit();
+    d->staging->wait(ticket);
+}
+
+uint32_t UploadBatch::resourceCount() const {
+    return resources;
+}
+
+VkDeviceSize UploadBatch::bytesAdded() const {
+    return bytes;
+}
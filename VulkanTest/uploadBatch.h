@@ -0,0 +1,54 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+
+#include <cstdint>
+#include <vector>
+
+#include "render.h"
+
+namespace render
+{
+    /*
+     * Everything added between construction and commit is recorded into one command buffer and submitted once with one fence.
+     * Meshes and textures created any other way while a batch is open (Drawer::loadMesh, Terrain chunks) join it too.
+     * Nothing added to the batch may be drawn before commit, the frame flush skips open batches.
+     *
+     * A batch belongs to the thread that created it and can be used from any worker thread.
+     * The addMesh overloads register with the drawer, so on workers construct Mesh directly and register it on the render thread once isComplete.
+     */
+    class UploadBatch {
+    public:
+        UploadBatch(Drawer* d);
+        /* Commits if commit wasn't called */
+        ~UploadBatch();
+
+        void addBuffer(VkBuffer dst, VkDeviceSize dstOffset, const void* data, VkDeviceSize bytes);
+        void addImage(VkImage dst, VkImageAspectFlags aspect, uint32_t width, uint32_t height, const void* data, VkDeviceSize bytes, VkImageLayout finalLayout);
+        /* Layout change only, recorded on the graphics queue after the batch's copies */
+        void addTransition(VkImage image, VkImageAspectFlags aspect, VkImageLayout oldLayout, VkImageLayout newLayout);
+
+        /* Registers the mesh with the drawer and returns its index in registeredMeshes */
+        uint16_t addMesh(const Vertex* vertices, uint32_t vcount, const std::vector<Submesh::SubmeshCreateInfo>& submeshes, bool keepHostGeometry = false);
+        uint16_t addMesh(const char* dir, uint16_t materialIndex = 0, bool keepHostGeometry = false);
+        Submesh addIndexBuffer(const uint16_t* indices, uint32_t count, uint16_t materialIndex = 0);
+        /* RGBA8 through stb_image, the image ends up in SHADER_READ_ONLY_OPTIMAL */
+        void addTexture(const char* dir, VkFormat format, VkImage& image, Allocation& allocation);
+
+        /* Submits without waiting */
+        void commit();
+        bool isComplete();
+        /* Throws when nested in another batch that is still open, the outer batch has to commit first */
+        void wait();
+
+        uint32_t resourceCount() const;
+        VkDeviceSize bytesAdded() const;
+
+    private:
+        Drawer* d;
+        bool committed = false;
+        uint64_t ticket = 0;
+        uint32_t resources = 0;
+        VkDeviceSize bytes = 0;
+    };
+};
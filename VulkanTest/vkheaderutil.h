@@ -27,6 +27,8 @@ struct SwapchainSupportDetails {
 struct RequiredFamilyIndices {
     std::optional<uint32_t> graphicsFamily;
     std::optional<uint32_t> presentFamily;
+    /* A family that can copy but not draw, usually the DMA engines. Empty when there isn't one. */
+    std::optional<uint32_t> transferFamily;
 
 public:
     bool isComplete() { return (graphicsFamily.has_value() && presentFamily.has_value()); }
@@ -68,16 +70,24 @@ inline RequiredFamilyIndices getQueueFamilies(VkPhysicalDevice physicalDevice, V
     vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueFamilyCount, properties.data());
 
     uint16_t i = 0;
+    bool transferOnly = false;
     for (const auto& property : properties)
     {
         if (property.queueFlags & VK_QUEUE_GRAPHICS_BIT) {
             indices.graphicsFamily = i;
         }
+        /* Compute families also advertise transfer, a family with nothing but transfer is the better pick */
+        else if (property.queueFlags & VK_QUEUE_TRANSFER_BIT && !transferOnly) {
+            indices.transferFamily = i;
+            transferOnly = !(property.queueFlags & VK_QUEUE_COMPUTE_BIT);
+        }
         VkBool32 presentSupported = false;
-        vkGetPhysicalDeviceSurfaceSupportKHR(physicalDevice, i, surface, &presentSupported);
+        if (surface != VK_NULL_HANDLE) vkGetPhysicalDeviceSurfaceSupportKHR(physicalDevice, i, surface, &presentSupported);
         if (presentSupported) indices.presentFamily = i;
         i++;
     }
+    /* Nothing to present to, the present queue is just the graphics queue */
+    if (surface == VK_NULL_HANDLE) indices.presentFamily = indices.graphicsFamily;
 
     return indices;
 }
@@ -113,6 +123,20 @@ inline bool checkExtensionSupport(VkPhysicalDevice d) {
     return true;
 }
 
+/* For optional extensions, the required ones are checked by checkExtensionSupport */
+inline bool hasDeviceExtension(VkPhysicalDevice d, const char* name) {
+    uint32_t extensionCount = 0;
+    vkEnumerateDeviceExtensionProperties(d, nullptr, &extensionCount, nullptr);
+
+    std::vector<VkExtensionProperties> supportedExtensions(extensionCount);
+    vkEnumerateDeviceExtensionProperties(d, nullptr, &extensionCount, supportedExtensions.data());
+
+    for (const auto& extension : supportedExtensions) {
+        if (strcmp(name, extension.extensionName) == 0) return true;
+    }
+    return false;
+}
+
 inline bool checkValidationLayerSupport() {
     uint32_t layerCount;
     vkEnumerateInstanceLayerProperties(&layerCount, nullptr);
@@ -213,7 +237,7 @@ inline bool hasStencilComponent(VkFormat format) {
     return format == VK_FORMAT_D32_SFLOAT_S8_UINT || format == VK_FORMAT_D24_UNORM_S8_UINT;
 }
 
-inline void createImage(VkDevice device, VkPhysicalDevice physicalDevice, uint32_t width, uint32_t height, uint32_t arrayLayers, VkFormat format, VkImageTiling tiling, VkImageCreateFlags createFlags, VkImageUsageFlags usage, VkMemoryPropertyFlags properties, VkImage& image, VkDeviceMemory& imageMemory) {
+inline void createImage(render::GpuAllocator* allocator, uint32_t width, uint32_t height, uint32_t arrayLayers, VkFormat format, VkImageTiling tiling, VkImageCreateFlags createFlags, VkImageUsageFlags usage, VkMemoryPropertyFlags properties, VkImage& image, render::Allocation& allocation, render::MemoryCategory category = render::MemoryCategory::Other) {
     VkImageCreateInfo imageInfo{};
     imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
     imageInfo.imageType = VK_IMAGE_TYPE_2D;
@@ -231,23 +255,7 @@ inline void createImage(VkDevice device, VkPhysicalDevice physicalDevice, uint32
     imageInfo.arrayLayers = arrayLayers;
     imageInfo.flags = createFlags;
 
-    if (vkCreateImage(device, &imageInfo, nullptr, &image) != VK_SUCCESS) {
-        throw std::runtime_error("failed to create image!");
-    }
-
-    VkMemoryRequirements memRequirements;
-    vkGetImageMemoryRequirements(device, image, &memRequirements);
-
-    VkMemoryAllocateInfo allocInfo{};
-    allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-    allocInfo.allocationSize = memRequirements.size;
-    allocInfo.memoryTypeIndex = findMemoryType(memRequirements.memoryTypeBits, physicalDevice, properties);
-
-    if (vkAllocateMemory(device, &allocInfo, nullptr, &imageMemory) != VK_SUCCESS) {
-        throw std::runtime_error("failed to allocate image memory!");
-    }
-
-    vkBindImageMemory(device, image, imageMemory, 0);
+    allocator->createImage(imageInfo, properties, image, allocation, category);
 }
 
 inline VkImageView createImageView(VkDevice device, VkImage image, VkImageViewType type, VkFormat imgFormat, VkImageAspectFlags aspectFlags) {
@@ -297,7 +305,7 @@ inline static VkCommandBuffer beginSimpleCommands(VkDevice device, VkCommandPool
     return buffer;
 }
 
-inline void endSimpleCommands(VkDevice device, VkCommandPool commandPool, VkCommandBuffer buffer, VkQueue queue) {
+inline void endSimpleCommands(VkDevice device, VkCommandPool commandPool, VkCommandBuffer buffer, render::QueueFunnel* queues, VkQueue queue) {
     vkEndCommandBuffer(buffer);
 
     VkSubmitInfo submitInfo{};
@@ -305,60 +313,37 @@ inline void endSimpleCommands(VkDevice device, VkCommandPool commandPool, VkComm
     submitInfo.commandBufferCount = 1;
     submitInfo.pCommandBuffers = &buffer;
 
-    vkQueueSubmit(queue, 1, &submitInfo, VK_NULL_HANDLE);
-    vkQueueWaitIdle(queue);
+    queues->submit(queue, 1, &submitInfo, VK_NULL_HANDLE);
+    queues->waitIdle(queue);
     vkFreeCommandBuffers(device, commandPool, 1, &buffer);
 }
 
-inline void copyBuffer(VkDevice device, VkQueue queue, VkCommandPool pool, VkBuffer src, VkBuffer dst, VkBufferCopy copy) {
+inline void copyBuffer(VkDevice device, render::QueueFunnel* queues, VkQueue queue, VkCommandPool pool, VkBuffer src, VkBuffer dst, VkBufferCopy copy) {
     VkCommandBuffer buffer = beginSimpleCommands(device, pool);
 
     vkCmdCopyBuffer(buffer, src, dst, 1, &copy);
 
-    endSimpleCommands(device, pool, buffer, queue);
+    endSimpleCommands(device, pool, buffer, queues, queue);
 }
 
-inline void copyBuffer(VkDevice device, VkQueue queue, VkCommandPool pool, VkBuffer src, VkBuffer dst, VkDeviceSize size) {
+inline void copyBuffer(VkDevice device, render::QueueFunnel* queues, VkQueue queue, VkCommandPool pool, VkBuffer src, VkBuffer dst, VkDeviceSize size) {
     VkBufferCopy copyRegion{};
     copyRegion.srcOffset = 0; // Optional
     copyRegion.dstOffset = 0; // Optional
     copyRegion.size = size;
 
-    copyBuffer(device, queue, pool, src, dst, copyRegion);
+    copyBuffer(device, queues, queue, pool, src, dst, copyRegion);
 }
 
-inline void createBuffer(VkDevice device, VkPhysicalDevice physicalDevice, VkDeviceSize size, VkBufferUsageFlags flags, VkMemoryPropertyFlags memFlags, VkBuffer& buffer, VkDeviceMemory& memory) {
-    VkBufferCreateInfo info{};
-    info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
-    info.size = size;
-    info.usage = flags;
-    info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
-
-    if (vkCreateBuffer(device, &info, nullptr, &buffer) != VK_SUCCESS) {
-        std::runtime_error("Error creating buffer");
-    }
-
-    VkMemoryRequirements requirements;
-    vkGetBufferMemoryRequirements(device, buffer, &requirements);
-
-    VkMemoryAllocateInfo allocInfo{};
-    allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-    allocInfo.allocationSize = requirements.size;
-    allocInfo.memoryTypeIndex = findMemoryType(requirements.memoryTypeBits, physicalDevice, memFlags);
-
-    if (vkAllocateMemory(device, &allocInfo, nullptr, &memory) != VK_SUCCESS) {
-        std::runtime_error("Error allocating GPU memory");
-    }
-
-    vkBindBufferMemory(device, buffer, memory, 0);
+inline void createBuffer(render::GpuAllocator* allocator, VkDeviceSize size, VkBufferUsageFlags flags, VkMemoryPropertyFlags memFlags, VkBuffer& buffer, render::Allocation& allocation, render::MemoryCategory category = render::MemoryCategory::Other) {
+    allocator->createBuffer(size, flags, memFlags, buffer, allocation, 0, category);
 }
 
-inline void destroyBuffer(VkDevice device, VkBuffer buffer, VkDeviceMemory memory) {
-    vkDestroyBuffer(device, buffer, nullptr);
-    vkFreeMemory(device, memory, nullptr);
+inline void destroyBuffer(render::GpuAllocator* allocator, VkBuffer buffer, render::Allocation& allocation) {
+    allocator->destroyBuffer(buffer, allocation);
 }
 
-inline void transitionImageLayout(VkDevice device, VkQueue queue, VkCommandPool cmdPool, VkImage img, VkFormat format, VkImageLayout layout, VkImageLayout newLayout, VkImageAspectFlagBits aspect) {
+inline void transitionImageLayout(VkDevice device, render::QueueFunnel* queues, VkQueue queue, VkCommandPool cmdPool, VkImage img, VkFormat format, VkImageLayout layout, VkImageLayout newLayout, VkImageAspectFlagBits aspect) {
     VkCommandBuffer buffer = beginSimpleCommands(device, cmdPool);
 
     VkImageMemoryBarrier barrier{};
@@ -404,7 +389,7 @@ inline void transitionImageLayout(VkDevice device, VkQueue queue, VkCommandPool
 
     vkCmdPipelineBarrier(buffer, sourceStage, destinationStage, 0, 0, nullptr, 0, nullptr, 1, &barrier);
 
-    endSimpleCommands(device, cmdPool, buffer, queue);
+    endSimpleCommands(device, cmdPool, buffer, queues, queue);
 }
 
 inline VkShaderModule createShaderModule(VkDevice device, std::vector<char> code) {
@@ -420,64 +405,3 @@ inline VkShaderModule createShaderModule(VkDevice device, std::vector<char> code
 
     return r;
 }
-
-namespace vkUtil {
-    class staging {
-    private:
-        VkDevice device;
-        VkPhysicalDevice physicalDevice;
-        VkQueue transferQueue;
-        VkBuffer stagingBuffer;
-        VkDeviceMemory stagingMemory;
-
-    public:
-        staging(VkDevice device, VkPhysicalDevice physicalDevice, VkQueue queue) {
-            this->device = device;
-            this->physicalDevice = physicalDevice;
-            this->transferQueue = queue;
-        }
-
-        void transfer(VkDeviceSize size, const void* src, VkBuffer* dst, const VkCommandPool* commandPool) {
-            createBuffer(device, physicalDevice, size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, stagingBuffer, stagingMemory);
-
-            void* stage;
-            vkMapMemory(device, stagingMemory, 0, size, 0, &stage);
-            memcpy(stage, src, static_cast<size_t>(size));
-            vkUnmapMemory(device, stagingMemory);
-
-            copyBuffer(device, transferQueue, *commandPool, stagingBuffer, *dst, size);
-
-            destroyBuffer(device, stagingBuffer, stagingMemory);
-        }
-    };
-
-    VkBuffer stagingBuffer;
-    VkDeviceMemory stagingBufferMem;
-    void* stagingBufferMappedMem;
-    VkCommandBuffer currentCmdBuffer;
-
-    void init(VkDevice device, VkPhysicalDevice physicalDevice, VkQueue transferQueue) {
-        VkPhysicalDeviceProperties props{};
-        vkGetPhysicalDeviceProperties(physicalDevice, &props);
-        std::cout << "Max buffer memory: " << props.limits.maxStorageBufferRange << "\n";
-        createBuffer(device, physicalDevice, props.limits.maxStorageBufferRange / 2, VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, stagingBuffer, stagingBufferMem);
-        vkMapMemory(device, stagingBufferMem, 0, VK_WHOLE_SIZE, 0, &stagingBufferMappedMem);
-    }
-
-    void begincpy(VkDevice device, VkCommandPool pool) {
-        currentCmdBuffer = beginSimpleCommands(device, pool);
-    }
-
-    void gpumemcpy(VkDevice device, VkPhysicalDevice physicalDevice, VkQueue queue, VkCommandPool commandPool, VkBuffer dst, const void* src, VkBufferCopy size) {
-        memcpy(stagingBufferMappedMem, src, static_cast<size_t>(size.size));
-        copyBuffer(device, queue, commandPool, stagingBuffer, dst, size);
-    }
-    
-    void endcpy(VkDevice device, VkCommandPool pool, VkQueue queue) {
-        endSimpleCommands(device, pool, currentCmdBuffer, queue);
-    }
-
-    void free(VkDevice device) {
-        destroyBuffer(device, stagingBuffer, stagingBufferMem);
-    }
-};
\ No newline at end of file